@@ -117,7 +117,8 @@ static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\
 
 /* Request getblocktemplate from bitcoind already connected with a connsock_t
  * and then summarise the information to the most efficient set of data
- * required to assemble a mining template, storing it in a gbtbase_t structure */
+ * required to assemble a mining template, storing it in a gbtbase_t structure.
+ * The transactions are decoded into gbt->gtxns instead of the json kept. */
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 {
 	json_t *rules_array, *coinbase_aux, *res_val, *val;
@@ -134,10 +135,12 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	int i;
 	bool ret = false;
 
-	val = json_rpc_call(cs, gbt_req);
+	gbt->gtxns = ckalloc(sizeof(gbt_txns_t));
+	gbt_txns_init(gbt->gtxns, BLOCKREQ_HEAD, BLOCKREQ_ENDLEN + 1);
+	val = json_rpc_gbt(cs, gbt_req, gbt->gtxns);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
-		return ret;
+		goto out;
 	}
 	res_val = json_object_get(val, "result");
 	if (!res_val) {
@@ -214,6 +217,10 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	ret = true;
 out:
 	json_decref(val);
+	if (!ret) {
+		gbt_txns_clear(gbt->gtxns);
+		dealloc(gbt->gtxns);
+	}
 	return ret;
 }
 
@@ -222,6 +229,10 @@ void clear_gbtbase(gbtbase_t *gbt)
 	free(gbt->flags);
 	if (gbt->json)
 		json_decref(gbt->json);
+	if (gbt->gtxns) {
+		gbt_txns_clear(gbt->gtxns);
+		free(gbt->gtxns);
+	}
 	memset(gbt, 0, sizeof(gbtbase_t));
 }
 
@@ -313,20 +324,17 @@ out:
 	return ret;
 }
 
-bool submit_block(connsock_t *cs, const char *params)
+/* Takes the whole submitblock request, already serialised, to not copy the
+ * block data again */
+bool submit_block(connsock_t *cs, const char *rpc_req)
 {
 	json_t *val, *res_val;
-	int len, retries = 0;
 	const char *res_ret;
 	bool ret = false;
-	char *rpc_req;
+	int retries = 0;
 
-	len = strlen(params) + 64;
 retry:
-	rpc_req = ckalloc(len);
-	sprintf(rpc_req, "{\"method\": \"submitblock\", \"params\": [\"%s\"]}\n", params);
 	val = json_rpc_call(cs, rpc_req);
-	dealloc(rpc_req);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to submitblock", cs->url, cs->port);
 		if (++retries < 5)
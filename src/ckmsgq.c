@@ -0,0 +1,218 @@
+/*
+ * Copyright 2014-2020,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ckpool.h"
+#include "libckpool.h"
+
+/* Generic function for creating a message queue receiving and parsing thread.
+ * Every worker of a shared pool pops from the head's list so messages are
+ * consumed by whichever worker is free first, whereas affine workers only
+ * ever consume their own list. Workers of a batch pool take as many of the
+ * queued messages as they can up to their batch size on each wakeup but
+ * never wait for more to arrive. */
+static void *ckmsg_queue(void *arg)
+{
+	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	ckmsgq_t *queue = ckmsgq->affine ? ckmsgq : ckmsgq->head;
+	ckpool_t *ckp = ckmsgq->ckp;
+	int batch = ckmsgq->batch;
+	ckmsg_t *msgs[batch];
+	void *datas[batch];
+
+	pthread_detach(pthread_self());
+	rename_proc(ckmsgq->name);
+	ckmsgq->active = true;
+
+	while (42) {
+		int i, count = 0;
+		tv_t now;
+		ts_t abs;
+
+		mutex_lock(queue->lock);
+		tv_time(&now);
+		tv_to_ts(&abs, &now);
+		abs.tv_sec++;
+		if (!queue->msgs)
+			cond_timedwait(queue->cond, queue->lock, &abs);
+		while (count < batch && queue->msgs) {
+			msgs[count] = queue->msgs;
+			DL_DELETE(queue->msgs, msgs[count]);
+			count++;
+		}
+		mutex_unlock(queue->lock);
+
+		if (!count)
+			continue;
+		if (ckmsgq->batchfunc) {
+			for (i = 0; i < count; i++)
+				datas[i] = msgs[i]->data;
+			ckmsgq->batchfunc(ckp, datas, count);
+			ckmsgq->batches++;
+		} else
+			ckmsgq->func(ckp, msgs[0]->data);
+		ckmsgq->processed += count;
+		for (i = 0; i < count; i++)
+			free(msgs[i]);
+	}
+	return NULL;
+}
+
+static void init_ckmsgq_lock(ckmsgq_t *ckmsgq)
+{
+	ckmsgq->lock = ckalloc(sizeof(mutex_t));
+	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
+	mutex_init(ckmsgq->lock);
+	cond_init(ckmsgq->cond);
+}
+
+ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+{
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+
+	strncpy(ckmsgq->name, name, 15);
+	ckmsgq->func = func;
+	ckmsgq->ckp = ckp;
+	init_ckmsgq_lock(ckmsgq);
+	ckmsgq->head = ckmsgq;
+	ckmsgq->workers = 1;
+	ckmsgq->batch = 1;
+	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
+
+	return ckmsgq;
+}
+
+static ckmsgq_t *__create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func,
+				  const void *batchfunc, const int count, const int batch,
+				  const bool affine)
+{
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
+	int i;
+
+	if (!affine)
+		init_ckmsgq_lock(ckmsgq);
+	for (i = 0; i < count; i++) {
+		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
+		ckmsgq[i].func = func;
+		ckmsgq[i].batchfunc = batchfunc;
+		ckmsgq[i].batch = batch;
+		ckmsgq[i].ckp = ckp;
+		if (affine)
+			init_ckmsgq_lock(&ckmsgq[i]);
+		else {
+			ckmsgq[i].lock = ckmsgq->lock;
+			ckmsgq[i].cond = ckmsgq->cond;
+		}
+		ckmsgq[i].head = ckmsgq;
+		ckmsgq[i].workers = count;
+		ckmsgq[i].affine = affine;
+	}
+	/* Start the threads only once every entry points to the head */
+	for (i = 0; i < count; i++)
+		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
+
+	return ckmsgq;
+}
+
+/* Create a pool of count worker threads all consuming from one shared message
+ * list. Messages are always added via the first entry of the returned array. */
+ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+{
+	return __create_ckmsgqs(ckp, name, func, NULL, count, 1, false);
+}
+
+/* Create a pool of count worker threads that each have their own message list.
+ * Messages added with ckmsgq_add_id are routed by id so that all messages for
+ * one id are processed in order by the same worker. */
+ckmsgq_t *create_affine_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+{
+	return __create_ckmsgqs(ckp, name, func, NULL, count, 1, true);
+}
+
+/* Create a shared or affine pool of count worker threads that each call
+ * batchfunc with an array of up to batch of the messages queued at the time,
+ * for work that is cheaper done on several messages at once. */
+ckmsgq_t *create_batch_ckmsgqs(ckpool_t *ckp, const char *name, const void *batchfunc,
+			       const int count, const int batch, const bool affine)
+{
+	return __create_ckmsgqs(ckp, name, NULL, batchfunc, count, batch, affine);
+}
+
+/* Generic function for adding messages to a ckmsgq linked list and signal one
+ * of the ckmsgq parsing thread(s) to wake up and process it. */
+static void __ckmsgq_add(ckmsgq_t *ckmsgq, void *data)
+{
+	ckmsg_t *msg;
+
+	while (unlikely(!ckmsgq->active))
+		cksleep_ms(10);
+
+	msg = ckalloc(sizeof(ckmsg_t));
+	msg->data = data;
+
+	mutex_lock(ckmsgq->lock);
+	ckmsgq->messages++;
+	DL_APPEND(ckmsgq->msgs, msg);
+	pthread_cond_signal(ckmsgq->cond);
+	mutex_unlock(ckmsgq->lock);
+}
+
+bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
+{
+	if (unlikely(!ckmsgq)) {
+		LOGWARNING("Sending messages to no queue from %s %s:%d", file, func, line);
+		/* Discard data if we're unlucky enough to be sending it to
+		 * msg queues not set up during start up */
+		free(data);
+		return false;
+	}
+	__ckmsgq_add(ckmsgq->head, data);
+	return true;
+}
+
+/* As ckmsgq_add but for affine pools the message goes to the worker chosen by
+ * id. Shared pools ignore the id. */
+bool _ckmsgq_add_id(ckmsgq_t *ckmsgq, const int64_t id, void *data, const char *file,
+		    const char *func, const int line)
+{
+	ckmsgq_t *head;
+
+	if (unlikely(!ckmsgq)) {
+		LOGWARNING("Sending messages to no queue from %s %s:%d", file, func, line);
+		free(data);
+		return false;
+	}
+	head = ckmsgq->head;
+	if (head->affine)
+		__ckmsgq_add(&head[(uint64_t)id % head->workers], data);
+	else
+		__ckmsgq_add(head, data);
+	return true;
+}
+
+/* Return whether there are any messages queued in the ckmsgq linked list. */
+bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+{
+	bool ret = true;
+
+	if (unlikely(!ckmsgq || !ckmsgq->active))
+		goto out;
+
+	ckmsgq = ckmsgq->head;
+	mutex_lock(ckmsgq->lock);
+	if (ckmsgq->msgs)
+		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
+	mutex_unlock(ckmsgq->lock);
+out:
+	return ret;
+}
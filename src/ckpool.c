@@ -34,6 +34,7 @@
 #include "stratifier.h"
 #include "connector.h"
 #include "api_server.h"
+#include "sha2.h"
 
 ckpool_t *global_ckp;
 
@@ -148,124 +149,6 @@ out:
 	free(buf);
 }
 
-/* Generic function for creating a message queue receiving and parsing thread */
-static void *ckmsg_queue(void *arg)
-{
-	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
-	ckpool_t *ckp = ckmsgq->ckp;
-
-	pthread_detach(pthread_self());
-	rename_proc(ckmsgq->name);
-	ckmsgq->active = true;
-
-	while (42) {
-		ckmsg_t *msg;
-		tv_t now;
-		ts_t abs;
-
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
-			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
-	}
-	return NULL;
-}
-
-ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
-{
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
-
-	strncpy(ckmsgq->name, name, 15);
-	ckmsgq->func = func;
-	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
-	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
-
-	return ckmsgq;
-}
-
-ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
-{
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	int i;
-
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
-
-	for (i = 0; i < count; i++) {
-		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
-		ckmsgq[i].func = func;
-		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
-		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
-	}
-
-	return ckmsgq;
-}
-
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
-bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
-{
-	ckmsg_t *msg;
-
-	if (unlikely(!ckmsgq)) {
-		LOGWARNING("Sending messages to no queue from %s %s:%d", file, func, line);
-		/* Discard data if we're unlucky enough to be sending it to
-		 * msg queues not set up during start up */
-		free(data);
-		return false;
-	}
-	while (unlikely(!ckmsgq->active))
-		cksleep_ms(10);
-
-	msg = ckalloc(sizeof(ckmsg_t));
-	msg->data = data;
-
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
-	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
-
-	return true;
-}
-
-/* Return whether there are any messages queued in the ckmsgq linked list. */
-bool ckmsgq_empty(ckmsgq_t *ckmsgq)
-{
-	bool ret = true;
-
-	if (unlikely(!ckmsgq || !ckmsgq->active))
-		goto out;
-
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
-out:
-	return ret;
-}
-
 /* Create a standalone thread that queues received unix messages for a proc
  * instance and adds them to linked list of received messages with their
  * associated receive socket, then signal the associated rmsg_cond for the
@@ -624,8 +507,8 @@ int read_socket_line(connsock_t *cs, float *timeout)
 	bool quiet = ckp->proxy | ckp->remote;
 	char *eom = NULL;
 	tv_t start, now;
+	int ret, ofs;
 	float diff;
-	int ret;
 
 	clear_bufline(cs);
 	recv_available(ckp, cs); // Intentionally ignore return value
@@ -655,6 +538,7 @@ int read_socket_line(connsock_t *cs, float *timeout)
 				LOGERR("Select %s in read_socket_line", !ret ? "timed out" : "failed");
 			goto out;
 		}
+		ofs = cs->bufofs;
 		ret = recv_available(ckp, cs);
 		if (ret < 1) {
 			/* If we have done wait_read_select there should be
@@ -667,7 +551,8 @@ int read_socket_line(connsock_t *cs, float *timeout)
 			ret = -1;
 			goto out;
 		}
-		eom = memchr(cs->buf, '\n', cs->bufofs);
+		/* Only search what was just received of long lines */
+		eom = memchr(cs->buf + ofs, '\n', cs->bufofs - ofs);
 		tv_time(&now);
 		diff = tvdiff(&now, &start);
 		copy_tv(&start, &now);
@@ -751,103 +636,325 @@ static const char *rpc_method(const char *rpc_req)
 	return rpc_req;
 }
 
-/* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
-static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only)
+/* Upper bounds in ms of the buckets of the RPC latency histograms, with a
+ * last bucket for anything slower */
+#define RPC_BUCKETS 13
+static const int rpc_bounds[RPC_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+
+struct rpc_stat {
+	UT_hash_handle hh;
+	char method[32];
+
+	int64_t calls;
+	int64_t fails;
+	double total; /* ms */
+	double max;
+	int64_t buckets[RPC_BUCKETS];
+};
+
+/* Set up a bitcoind connsock for calls to take connections from its pool of
+ * keep-alive connections */
+void rpc_init(connsock_t *cs)
+{
+	int i;
+
+	cksem_init(&cs->sem);
+	for (i = 0; i < RPC_CONNS; i++)
+		cksem_post(&cs->sem);
+	mutex_init(&cs->rpc_lock);
+}
+
+/* Close the idle connections of the pool, such as when the server dies */
+void rpc_close(connsock_t *cs)
+{
+	connsock_t *conn;
+
+	mutex_lock(&cs->rpc_lock);
+	for (conn = cs->rpc_idle; conn; conn = conn->rpc_next)
+		Close(conn->fd);
+	mutex_unlock(&cs->rpc_lock);
+}
+
+/* Take a connection from the pool of cs, creating one if none is idle. An
+ * idle connection with anything to read means bitcoind has closed it, so
+ * only connections still open with nothing pending are reused */
+static connsock_t *get_rpc_conn(connsock_t *cs, bool *reused)
+{
+	connsock_t *conn;
+
+	mutex_lock(&cs->rpc_lock);
+	conn = cs->rpc_idle;
+	if (conn)
+		cs->rpc_idle = conn->rpc_next;
+	else
+		cs->rpc_conns++;
+	mutex_unlock(&cs->rpc_lock);
+
+	if (!conn) {
+		conn = ckzalloc(sizeof(connsock_t));
+		conn->fd = -1;
+		conn->ckp = cs->ckp;
+	}
+	*reused = false;
+	if (conn->fd > -1) {
+		if (!wait_read_select(conn->fd, 0))
+			*reused = true;
+		else
+			Close(conn->fd);
+	}
+	return conn;
+}
+
+static void put_rpc_conn(connsock_t *cs, connsock_t *conn)
+{
+	empty_buffer(conn);
+	dealloc(conn->buf);
+
+	mutex_lock(&cs->rpc_lock);
+	conn->rpc_next = cs->rpc_idle;
+	cs->rpc_idle = conn;
+	mutex_unlock(&cs->rpc_lock);
+}
+
+/* Open a connection in the pool of cs ahead of the calls that need one the
+ * moment they are made, or replace one bitcoind has closed, without waiting
+ * if the pool is busy since the connection is then already open */
+void rpc_preconnect(connsock_t *cs)
+{
+	connsock_t *conn;
+	bool reused;
+
+	if (cksem_trywait(&cs->sem))
+		return;
+	conn = get_rpc_conn(cs, &reused);
+	if (conn->fd < 0) {
+		conn->fd = connect_socket(cs->url, cs->port);
+		if (likely(conn->fd > -1)) {
+			keep_sockalive(conn->fd);
+			mutex_lock(&cs->rpc_lock);
+			cs->rpc_connects++;
+			mutex_unlock(&cs->rpc_lock);
+		}
+	}
+	put_rpc_conn(cs, conn);
+	cksem_post(&cs->sem);
+}
+
+/* Drop a reference to a block request, freeing it with the last */
+void put_blockreq(blockreq_t *req)
 {
+	if (__atomic_sub_fetch(&req->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(req->buf);
+	free(req);
+}
+
+/* Copy the method name out of an rpc_req */
+static void rpc_method_name(char *method, const char *rpc_req)
+{
+	const char *start = strchr(rpc_method(rpc_req), '"'), *end = NULL;
+	int len;
+
+	if (start)
+		end = strchr(++start, '"');
+	if (!end) {
+		strcpy(method, "unknown");
+		return;
+	}
+	len = MIN(end - start, 31);
+	memcpy(method, start, len);
+	method[len] = '\0';
+}
+
+static void add_rpc_stat(connsock_t *cs, const char *rpc_req, const double elapsed,
+			 const bool fail, const bool reused, const bool connected)
+{
+	double ms = elapsed * 1000;
+	char method[32];
+	rpc_stat_t *stat;
+	int bucket;
+
+	rpc_method_name(method, rpc_req);
+	for (bucket = 0; bucket < RPC_BUCKETS - 1; bucket++) {
+		if (ms <= rpc_bounds[bucket])
+			break;
+	}
+
+	mutex_lock(&cs->rpc_lock);
+	HASH_FIND_STR(cs->rpc_stats, method, stat);
+	if (unlikely(!stat)) {
+		stat = ckzalloc(sizeof(rpc_stat_t));
+		strcpy(stat->method, method);
+		HASH_ADD_STR(cs->rpc_stats, method, stat);
+	}
+	stat->calls++;
+	if (fail)
+		stat->fails++;
+	stat->total += ms;
+	if (ms > stat->max)
+		stat->max = ms;
+	stat->buckets[bucket]++;
+	if (reused)
+		cs->rpc_reused++;
+	if (connected)
+		cs->rpc_connects++;
+	mutex_unlock(&cs->rpc_lock);
+}
+
+/* The connection pool and per method latency histograms of the calls made
+ * on cs, in ms */
+json_t *rpc_stats(connsock_t *cs)
+{
+	json_t *val = json_object(), *bounds, *methods, *subval, *hist;
+	rpc_stat_t *stat;
+	int i;
+
+	bounds = json_array();
+	for (i = 0; i < RPC_BUCKETS - 1; i++)
+		json_array_append_new(bounds, json_integer(rpc_bounds[i]));
+	methods = json_object();
+
+	mutex_lock(&cs->rpc_lock);
+	json_set_int(val, "conns", cs->rpc_conns);
+	json_set_int64(val, "connects", cs->rpc_connects);
+	json_set_int64(val, "reused", cs->rpc_reused);
+	for (stat = cs->rpc_stats; stat; stat = stat->hh.next) {
+		hist = json_array();
+		for (i = 0; i < RPC_BUCKETS; i++)
+			json_array_append_new(hist, json_integer(stat->buckets[i]));
+		JSON_CPACK(subval, "{sI,sI,sf,sf,so}", "calls", stat->calls, "fails", stat->fails,
+			   "avg", stat->total / stat->calls, "max", stat->max, "histogram", hist);
+		json_set_object(methods, stat->method, subval);
+	}
+	mutex_unlock(&cs->rpc_lock);
+
+	json_set_object(val, "bounds", bounds);
+	json_set_object(val, "methods", methods);
+	return val;
+}
+
+/* All of these calls are made to bitcoind over HTTP/1.1 keep-alive
+ * connections from the pool of cs. A call on a reused connection that fails
+ * before getting any response is retried once on a new connection in case
+ * bitcoind closed it just as we used it. Connections are only kept when the
+ * response was read exactly as long as its Content-Length said. */
+static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only,
+			      gbt_txns_t *txns)
+{
+	bool reused, connected = false, keepalive = false;
 	float timeout = RPC_TIMEOUT;
 	char *http_req = NULL;
 	json_error_t err_val;
 	char *warning = NULL;
+	int len, hlen, ret, clen = -1;
 	json_t *val = NULL;
 	tv_t stt_tv, fin_tv;
+	connsock_t *conn;
 	double elapsed;
-	int len, ret;
 
-	/* Serialise all calls in case we use cs from multiple threads */
-	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
-	if (unlikely(cs->fd < 0)) {
-		ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
-		goto out;
-	}
 	if (unlikely(!cs->url)) {
-		ASPRINTF(&warning, "No URL in %s", __func__);
-		goto out;
+		LOGWARNING("No URL in %s", __func__);
+		return NULL;
 	}
 	if (unlikely(!cs->port)) {
-		ASPRINTF(&warning, "No port in %s", __func__);
-		goto out;
+		LOGWARNING("No port in %s", __func__);
+		return NULL;
 	}
 	if (unlikely(!cs->auth)) {
-		ASPRINTF(&warning, "No auth in %s", __func__);
-		goto out;
+		LOGWARNING("No auth in %s", __func__);
+		return NULL;
 	}
 	if (unlikely(!rpc_req)) {
-		ASPRINTF(&warning, "Null rpc_req passed to %s", __func__);
-		goto out;
+		LOGWARNING("Null rpc_req passed to %s", __func__);
+		return NULL;
 	}
 	len = strlen(rpc_req);
 	if (unlikely(!len)) {
-		ASPRINTF(&warning, "Zero length rpc_req passed to %s", __func__);
-		goto out;
+		LOGWARNING("Zero length rpc_req passed to %s", __func__);
+		return NULL;
 	}
-	http_req = ckalloc(len + 256); // Leave room for headers
-	sprintf(http_req,
+	/* The headers are written separately to not copy large requests */
+	ASPRINTF(&http_req,
 		 "POST / HTTP/1.1\n"
 		 "Authorization: Basic %s\n"
 		 "Host: %s:%s\n"
 		 "Content-type: application/json\n"
-		 "Content-Length: %d\n\n%s",
-		 cs->auth, cs->url, cs->port, len, rpc_req);
+		 "Content-Length: %d\n\n",
+		 cs->auth, cs->url, cs->port, len);
+	hlen = strlen(http_req);
 
-	len = strlen(http_req);
+	/* Wait for a connection of the pool to be free */
+	cksem_wait(&cs->sem);
+	conn = get_rpc_conn(cs, &reused);
 	tv_time(&stt_tv);
-	ret = write_socket(cs->fd, http_req, len);
-	if (ret != len) {
+reconnect:
+	if (conn->fd < 0) {
+		conn->fd = connect_socket(cs->url, cs->port);
+		if (unlikely(conn->fd < 0)) {
+			ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
+			goto out;
+		}
+		keep_sockalive(conn->fd);
+		connected = true;
+	}
+	if (write_socket(conn->fd, http_req, hlen) != hlen ||
+	    write_socket(conn->fd, rpc_req, len) != len) {
+		if (reused)
+			goto retry;
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		ASPRINTF(&warning, "Failed to write to socket in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
+		goto out;
 	}
-	ret = read_socket_line(cs, &timeout);
+	ret = read_socket_line(conn, &timeout);
+	if (ret < 0 && reused)
+		goto retry;
 	if (ret < 1) {
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		ASPRINTF(&warning, "Failed to read socket line in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
+		goto out;
 	}
-	if (strncasecmp(cs->buf, "HTTP/1.1 200 OK", 15)) {
+	if (strncasecmp(conn->buf, "HTTP/1.1 200 OK", 15)) {
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
 		ASPRINTF(&warning, "HTTP response to (%.10s...) %.3fs not ok: %s",
-			 rpc_method(rpc_req), elapsed, cs->buf);
+			 rpc_method(rpc_req), elapsed, conn->buf);
 		timeout = 0;
 		/* Look for a json response if there is one */
-		while (read_socket_line(cs, &timeout) > 0) {
+		while (read_socket_line(conn, &timeout) > 0) {
 			timeout = 0;
-			if (*cs->buf != '{')
+			if (*conn->buf != '{')
 				continue;
 			free(warning);
 			/* Replace the warning with the json response */
 			ASPRINTF(&warning, "JSON response to (%.10s...) %.3fs not ok: %s",
-				 rpc_method(rpc_req), elapsed, cs->buf);
+				 rpc_method(rpc_req), elapsed, conn->buf);
 			break;
 		}
-		goto out_empty;
+		goto out;
 	}
+	keepalive = true;
 	do {
-		ret = read_socket_line(cs, &timeout);
+		ret = read_socket_line(conn, &timeout);
 		if (ret < 1) {
 			tv_time(&fin_tv);
 			elapsed = tvdiff(&fin_tv, &stt_tv);
 			ASPRINTF(&warning, "Failed to read http socket lines in %s (%.10s...) %.3fs",
 				 __func__, rpc_method(rpc_req), elapsed);
-			goto out_empty;
+			keepalive = false;
+			goto out;
 		}
-	} while (strncmp(cs->buf, "{", 1));
+		if (!strncasecmp(conn->buf, "Content-Length:", 15))
+			clen = atoi(conn->buf + 15);
+		else if (!strncasecmp(conn->buf, "Connection:", 11) && strcasestr(conn->buf + 11, "close"))
+			keepalive = false;
+	} while (strncmp(conn->buf, "{", 1));
+	/* Anything but exactly the one line body left it unsafe to reuse */
+	if (clen != ret + 1 || conn->buflen)
+		keepalive = false;
 	tv_time(&fin_tv);
 	elapsed = tvdiff(&fin_tv, &stt_tv);
 	if (elapsed > 5.0) {
@@ -855,14 +962,15 @@ static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool in
 			 elapsed, __func__, rpc_method(rpc_req));
 	}
 
-	val = json_loads(cs->buf, 0, &err_val);
+	if (txns && !gbt_parse_txns(conn->buf, ret, txns)) {
+		ASPRINTF(&warning, "Failed to parse transactions of (%.10s...)", rpc_method(rpc_req));
+		goto out;
+	}
+	val = json_loads(conn->buf, 0, &err_val);
 	if (!val) {
 		ASPRINTF(&warning, "JSON decode (%.10s...) failed(%d): %s",
 			 rpc_method(rpc_req), err_val.line, err_val.text);
 	}
-out_empty:
-	empty_socket(cs->fd);
-	empty_buffer(cs);
 out:
 	if (warning) {
 		if (info_only)
@@ -871,28 +979,47 @@ out:
 			LOGWARNING("%s", warning);
 		free(warning);
 	}
-	Close(cs->fd);
-	free(http_req);
-	dealloc(cs->buf);
+	if (!keepalive)
+		Close(conn->fd);
+	tv_time(&fin_tv);
+	add_rpc_stat(cs, rpc_req, tvdiff(&fin_tv, &stt_tv), !val, reused, connected);
+	put_rpc_conn(cs, conn);
 	cksem_post(&cs->sem);
+	free(http_req);
 	return val;
+
+retry:
+	LOGDEBUG("Reconnecting stale keep-alive connection to %s:%s", cs->url, cs->port);
+	Close(conn->fd);
+	empty_buffer(conn);
+	dealloc(conn->buf);
+	timeout = RPC_TIMEOUT;
+	reused = false;
+	goto reconnect;
 }
 
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, false);
+	return _json_rpc_call(cs, rpc_req, false, NULL);
+}
+
+/* As json_rpc_call for a getblocktemplate request, decoding the transactions
+ * of the template into txns instead of the json returned */
+json_t *json_rpc_gbt(connsock_t *cs, const char *rpc_req, gbt_txns_t *txns)
+{
+	return _json_rpc_call(cs, rpc_req, false, txns);
 }
 
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, true);
+	return _json_rpc_call(cs, rpc_req, true, NULL);
 }
 
 /* For when we are submitting information that is not important and don't care
  * about the response. */
 void json_rpc_msg(connsock_t *cs, const char *rpc_req)
 {
-	json_t *val = _json_rpc_call(cs, rpc_req, true);
+	json_t *val = _json_rpc_call(cs, rpc_req, true, NULL);
 
 	/* We don't care about the result */
 	json_decref(val);
@@ -1480,6 +1607,10 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
+	json_get_int(&ckp->listeners, json_conf, "listeners");
+	json_get_bool(&ckp->iouring, json_conf, "iouring");
+	json_get_bool(&ckp->clientaffinity, json_conf, "clientaffinity");
+	json_get_bool(&ckp->binarysharelog, json_conf, "binarysharelog");
 	json_get_double(&ckp->donation, json_conf, "donation");
 	/* Avoid dust-sized donations */
 	if (ckp->donation < 0.1)
@@ -1891,6 +2022,8 @@ int main(int argc, char **argv)
 		ckp.maxclients = ret * 9 / 10;
 	}
 
+	LOGNOTICE("Using %s sha256 implementation", sha256_impl());
+
 	// ckp.ckpapi = create_ckmsgq(&ckp, "api", &ckpool_api);
 	create_pthread(&ckp.pth_listener, listener, &ckp.main);
 
@@ -17,9 +17,12 @@
 #include <sys/types.h>
 
 #include "libckpool.h"
+#include "gbtparse.h"
 #include "uthash.h"
 
 #define RPC_TIMEOUT 60
+/* Keep-alive connections to each bitcoind for RPC calls to run on at once */
+#define RPC_CONNS 4
 
 struct ckpool_instance;
 typedef struct ckpool_instance ckpool_t;
@@ -51,6 +54,20 @@ struct ckmsgq {
 	void (*func)(ckpool_t *, void *);
 	int64_t messages;
 	bool active;
+
+	/* All workers of a pool created with create_ckmsgqs pop from the
+	 * shared msgs list of the first entry, the head, unless the pool is
+	 * affine in which case each worker has its own list */
+	struct ckmsgq *head;
+	int workers;
+	bool affine;
+	int64_t processed; /* Messages processed by this worker */
+
+	/* Batch pools hand up to batch queued messages at a time to
+	 * batchfunc instead of calling func on each */
+	void (*batchfunc)(ckpool_t *, void **, int);
+	int batch;
+	int64_t batches; /* Calls to batchfunc by this worker */
 };
 
 typedef struct ckmsgq ckmsgq_t;
@@ -72,6 +89,8 @@ struct proc_instance {
 	pthread_cond_t rmsg_cond;
 };
 
+typedef struct rpc_stat rpc_stat_t;
+
 struct connsock {
 	int fd;
 	char *url;
@@ -90,10 +109,44 @@ struct connsock {
 	sem_t sem;
 
 	bool alive;
+
+	/* For bitcoind connsocks set up with rpc_init, sem is posted RPC_CONNS
+	 * times and calls take a keep-alive connection, itself a connsock,
+	 * from the idle list so up to that many run concurrently */
+	mutex_t rpc_lock;
+	struct connsock *rpc_idle;
+	struct connsock *rpc_next;
+	int rpc_conns;
+	int64_t rpc_connects;
+	int64_t rpc_reused;
+	/* Hashtable of the latency stats of each RPC method called */
+	rpc_stat_t *rpc_stats;
 };
 
 typedef struct connsock connsock_t;
 
+/* A serialised submitblock request, kept by each workbase as a template with
+ * its transactions already in place. The header and coinbase of a solved
+ * block are written back from txnofs into the space reserved before the
+ * transactions so the request starts at rpc_req, and the workbase and every
+ * submission of the block share it by reference. */
+struct blockreq {
+	char *buf;
+	char *rpc_req;
+	int len; /* Of the request from rpc_req */
+	int txnofs;
+	int txnlen; /* Of the transactions and the end of the request */
+	int refs;
+};
+
+typedef struct blockreq blockreq_t;
+
+/* Space reserved before the transactions of a block request for the start
+ * of the request, the header, txn count varint and the largest coinbase, and
+ * the length of the end of the request after them */
+#define BLOCKREQ_HEAD (64 + 160 + 10 + 1024)
+#define BLOCKREQ_ENDLEN 4
+
 typedef struct char_entry char_entry_t;
 
 struct char_entry {
@@ -122,6 +175,17 @@ struct server_instance {
 	bool notify;
 	bool alive;
 	connsock_t cs;
+
+	/* Connection used only to submit blocks, kept open by the server
+	 * watchdog, and the queue of the thread submitting them on it */
+	connsock_t blockcs;
+	ckmsgq_t *blockq;
+	/* Blocks submitted to this server and the latency from the solve to
+	 * its submitblock response, in ms */
+	int64_t blocks;
+	int64_t blocks_accepted;
+	double block_last;
+	double block_max;
 };
 
 typedef struct server_instance server_instance_t;
@@ -141,6 +205,8 @@ struct ckpool_instance {
 	bool killold;
 	/* Whether to log shares or not */
 	bool logshares;
+	/* Log shares in the binary sharelog format instead of json */
+	bool binarysharelog;
 	/* Logging level */
 	int loglevel;
 	/* Main process name */
@@ -163,6 +229,10 @@ struct ckpool_instance {
 	bool handover;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Number of SO_REUSEPORT listeners per serverurl, each owning its clients */
+	int listeners;
+	/* Service client I/O with io_uring instead of epoll where supported */
+	bool iouring;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
@@ -216,6 +286,9 @@ struct ckpool_instance {
 	/* Should we disable the throbber */
 	bool quiet;
 
+	/* Route each client's messages to the same share/receive worker */
+	bool clientaffinity;
+
 	/* Have we given warnings about the inability to raise buf sizes */
 	bool wmem_warn;
 	bool rmem_warn;
@@ -344,8 +417,14 @@ void get_timestamp(char *stamp);
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_affine_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_batch_ckmsgqs(ckpool_t *ckp, const char *name, const void *batchfunc,
+			       const int count, const int batch, const bool affine);
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+bool _ckmsgq_add_id(ckmsgq_t *ckmsgq, const int64_t id, void *data, const char *file,
+		    const char *func, const int line);
+#define ckmsgq_add_id(ckmsgq, id, data) _ckmsgq_add_id(ckmsgq, id, data, __FILE__, __func__, __LINE__)
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
@@ -365,7 +444,13 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 		     const int line);
 #define ckdb_msg_call(ckp, msg) _ckdb_msg_call(ckp, msg, __FILE__, __func__, __LINE__)
 
+void rpc_init(connsock_t *cs);
+void rpc_close(connsock_t *cs);
+void rpc_preconnect(connsock_t *cs);
+void put_blockreq(blockreq_t *req);
+json_t *rpc_stats(connsock_t *cs);
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
+json_t *json_rpc_gbt(connsock_t *cs, const char *rpc_req, gbt_txns_t *txns);
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req);
 void json_rpc_msg(connsock_t *cs, const char *rpc_req);
 bool _send_json_msg(connsock_t *cs, const json_t *json_msg, const char *file, const char *func, const int line);
@@ -13,6 +13,9 @@
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -22,9 +25,25 @@
 #include "utlist.h"
 #include "stratifier.h"
 #include "generator.h"
+#include "connector.h"
+#include "uring.h"
 
 #define MAX_MSGSIZE 1024
 
+/* Clients only keep the partial message pending from them between receives,
+ * in a small inline buffer or, once it outgrows that, a chunk from their
+ * shard's pool of the smallest size class it fits. Chunks are carved out of
+ * BUF_SLAB_SIZE slabs and go back to the pool as soon as the message
+ * completes. Only trusted remote servers may send more than the largest
+ * class, which then comes straight off the heap. */
+#define CLIENT_INLINE_BUF 128
+#define BUF_CLASSES 2
+#define BUF_SLAB_SIZE 65536
+static const int buf_classes[BUF_CLASSES] = { 512, MAX_MSGSIZE * 2 };
+
+/* Most read from a client's socket at once */
+#define RECV_BUFSIZE 16384
+
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
 typedef struct share share_t;
@@ -39,7 +58,8 @@ struct client_instance {
 	int fd;
 
 	/* Reference count for when this instance is used outside of the
-	 * connector_data lock */
+	 * shard lock. Updated atomically so that it can be taken under the
+	 * read lock and dropped without the lock */
 	int ref;
 
 	/* Have we disabled this client to be removed when there are no refs? */
@@ -60,11 +80,26 @@ struct client_instance {
 	/* Which serverurl is this instance connected to */
 	int server;
 
+	/* The partial message pending from this client and its size. buf is
+	 * ibuf until the message outgrows it. Only used by the shard's
+	 * receiver thread */
 	char *buf;
 	unsigned long bufofs;
+	int bufsize;
+	char ibuf[CLIENT_INLINE_BUF];
+
+	/* Sends queued to this client, written out together with writev */
+	sender_send_t *sends;
+	/* Protects sends and serialises writes to and rearming of the fd */
+	mutex_t send_lock;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* For the cdata flush_clients list of the client message processor */
+	client_instance_t *flush_next;
+	bool flush_queued;
+
+	/* For the shard's blocked_clients list */
+	client_instance_t *blocked_next;
+	client_instance_t *blocked_prev;
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -80,11 +115,17 @@ struct client_instance {
 	/* Has this client been authorised in redirector mode */
 	bool authorised;
 
-	/* Time this client started blocking, 0 when not blocked */
+	/* Time this client started blocking, 0 when not blocked. Set and
+	 * cleared under the shard lock */
 	time_t blocked_time;
+	/* Has a POLLOUT request on the shard's io_uring, under send_lock */
+	bool pollout;
 
 	/* The size of the socket send buffer */
 	int sendbufsize;
+
+	/* The connector shard owning this client */
+	struct connector_shard *shard;
 };
 
 struct sender_send {
@@ -95,6 +136,9 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* The broadcast buf belongs to, if it is not our own */
+	bcast_t *bcast;
 };
 
 struct share {
@@ -112,56 +156,118 @@ struct redirect {
 	int redirect_no;
 };
 
-/* Private data for the connector */
-struct connector_data {
-	ckpool_t *ckp;
-	cklock_t lock;
-	proc_instance_t *pi;
-
-	time_t start_time;
+/* Clients are owned by connector shards, each with its own thread servicing
+ * the events of its clients from its own epoll fd, harvesting up to
+ * CEVENT_BATCH of them per wakeup. Sends are written straight to the socket,
+ * queueing on the client only what it won't take yet and waiting on EPOLLOUT
+ * in the shard's epoll set to write the rest. A client's id
+ * modulo the number of shards is the shard owning it. With the listeners
+ * option each shard also has its own SO_REUSEPORT listening sockets and
+ * accepts its clients itself, otherwise the receiver thread accepts all
+ * clients and spreads them across the shards. */
+#define CEVENT_BATCH 256
+
+/* Most messages to clients the client message processor handles at once, and
+ * most queued sends written by one writev */
+#define CMPQ_BATCH 64
+#define SEND_IOVECS 64
+
+/* With the iouring option each shard services its clients with an io_uring
+ * instead of its epoll fd. Every client has a multishot receive into the
+ * shard's provided buffers and listening sockets a multishot accept, so they
+ * stay armed, and clients with sends blocked get a POLLOUT request. Requests
+ * carry the client id, or the serverurl of a listening socket, with their
+ * type in the top bits, leaving user data 0 for the ring's own use. */
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024
+#define URING_RECV (1ull << 62)
+#define URING_POLLOUT (2ull << 62)
+#define URING_ACCEPT (3ull << 62)
+#define URING_TYPE (3ull << 62)
+
+struct connector_shard {
+	struct connector_data *cdata;
+	int id;
 
-	/* Array of server fds */
+	/* Listening sockets of this shard in listeners mode */
 	int *serverfd;
-	/* All time count of clients connected */
-	int nfds;
-	/* The epoll fd */
+	/* The epoll fd of this shard's clients and listening sockets */
 	int epfd;
+	/* The io_uring used instead of epfd in iouring mode */
+	uring_t *ring;
 
-	bool accept;
-	pthread_t pth_sender;
 	pthread_t pth_receiver;
 
-	/* For the hashtable of all clients */
+	/* Protects the clients lists. Lookups only need the read lock */
+	cklock_t lock;
+
+	/* For the hashtable of this shard's clients */
 	client_instance_t *clients;
 	/* Linked list of dead clients no longer in use but may still have references */
 	client_instance_t *dead_clients;
 	/* Linked list of client structures we can reuse */
 	client_instance_t *recycled_clients;
+	/* Linked list of clients with sends queued */
+	client_instance_t *blocked_clients;
 
 	int clients_generated;
 	int dead_generated;
 
+	/* Next client id of this shard, stepping by the number of shards */
 	int64_t client_ids;
 
-	/* client message process queue */
-	ckmsgq_t *cmpq;
-
-	/* client message event process queue */
-	ckmsgq_t *cevents;
-
-	/* For the linked list of pending sends */
-	sender_send_t *sender_sends;
-
+	/* Updated atomically */
 	int64_t sends_generated;
-	int64_t sends_delayed;
+	int64_t sends_delayed; /* Sends that had to be queued */
 	int64_t sends_queued;
 	int64_t sends_size;
+	int64_t sends_written; /* Sends written out in full */
+	int64_t send_writes; /* writev calls writing them */
+
+	/* Protects the pool of client receive buffer chunks */
+	mutex_t buf_lock;
+	/* Free chunks of each size class, linked through their first bytes */
+	void *free_chunks[BUF_CLASSES];
+	int chunks_used[BUF_CLASSES];
+	int buf_slabs;
+	/* Heap buffers of remote servers beyond the largest size class */
+	int large_bufs;
+	int64_t large_bufs_size;
+};
+
+typedef struct connector_shard cshard_t;
+
+/* Private data for the connector */
+struct connector_data {
+	ckpool_t *ckp;
+	cklock_t lock;
+	proc_instance_t *pi;
+
+	time_t start_time;
 
-	/* For protecting the pending sends list */
-	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
+	/* Array of server fds, those of shard 0 in listeners mode */
+	int *serverfd;
+	/* All time count of clients connected */
+	int nfds;
+	/* The epoll fd of the listening sockets */
+	int epfd;
+
+	bool accept;
+	pthread_t pth_receiver;
+
+	cshard_t *shards;
+	int nshards;
+	/* Shard the receiver hands the next client to */
+	int next_shard;
+
+	/* client message process queue */
+	ckmsgq_t *cmpq;
+	/* Clients the current batch of cmpq has queued sends to, only
+	 * accessed by the cmpq thread */
+	client_instance_t *flush_clients;
 
-	/* Hash list of all redirected IP address in redirector mode */
+	/* Hash list of all redirected IP address in redirector mode, protected
+	 * by lock */
 	redirect_t *redirects;
 	/* What redirect we're currently up to */
 	int redirect;
@@ -184,45 +290,47 @@ void connector_upstream_msg(ckpool_t *ckp, char *msg)
 	ckmsgq_add(cdata->upstream_sends, msg);
 }
 
-/* Increase the reference count of instance */
-static void __inc_instance_ref(client_instance_t *client)
+static inline cshard_t *shard_by_id(cdata_t *cdata, const int64_t id)
 {
-	client->ref++;
+	return &cdata->shards[(uint64_t)id % cdata->nshards];
 }
 
-static void inc_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Increase the reference count of instance. Must hold the shard lock, the
+ * read lock being enough, to keep a client found by lookup from being
+ * invalidated and recycled before the reference is taken. */
+static void __inc_instance_ref(client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__inc_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_RELAXED);
 }
 
-/* Increase the reference count of instance */
-static void __dec_instance_ref(client_instance_t *client)
+/* Take another reference to a client we already hold one of, no lock
+ * required */
+static void inc_instance_ref(client_instance_t *client)
 {
-	client->ref--;
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_RELAXED);
 }
 
-static void dec_instance_ref(cdata_t *cdata, client_instance_t *client)
+/* Decrease the reference count of instance. No lock is needed since a client
+ * is only recycled once it is invalid, when no new references can be taken,
+ * and its count has dropped to zero. */
+static void dec_instance_ref(client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__dec_instance_ref(client);
-	ck_wunlock(&cdata->lock);
+	__atomic_sub_fetch(&client->ref, 1, __ATOMIC_RELEASE);
 }
 
 /* Recruit a client structure from a recycled one if available, creating a
  * new structure only if we have none to reuse. */
-static client_instance_t *recruit_client(cdata_t *cdata)
+static client_instance_t *recruit_client(cshard_t *shard)
 {
 	client_instance_t *client = NULL;
 
-	ck_wlock(&cdata->lock);
-	if (cdata->recycled_clients) {
-		client = cdata->recycled_clients;
-		DL_DELETE2(cdata->recycled_clients, client, recycled_prev, recycled_next);
+	ck_wlock(&shard->lock);
+	if (shard->recycled_clients) {
+		client = shard->recycled_clients;
+		DL_DELETE2(shard->recycled_clients, client, recycled_prev, recycled_next);
 	} else
-		cdata->clients_generated++;
-	ck_wunlock(&cdata->lock);
+		shard->clients_generated++;
+	ck_wunlock(&shard->lock);
 
 	if (!client) {
 		LOGDEBUG("Connector created new client instance");
@@ -230,77 +338,158 @@ static client_instance_t *recruit_client(cdata_t *cdata)
 	} else
 		LOGDEBUG("Connector recycled client instance");
 
-	client->buf = ckzalloc(PAGESIZE);
+	client->buf = client->ibuf;
+	client->bufsize = CLIENT_INLINE_BUF;
+	client->shard = shard;
+	mutex_init(&client->send_lock);
 
 	return client;
 }
 
-static void __recycle_client(cdata_t *cdata, client_instance_t *client)
+/* Take a chunk of a size class from the shard's pool, carving a new slab
+ * into chunks if it has none free */
+static char *alloc_buf_chunk(cshard_t *shard, const int class)
+{
+	void *chunk;
+
+	mutex_lock(&shard->buf_lock);
+	if (unlikely(!shard->free_chunks[class])) {
+		const int size = buf_classes[class];
+		char *slab = ckalloc(BUF_SLAB_SIZE);
+		int i;
+
+		for (i = 0; i + size <= BUF_SLAB_SIZE; i += size) {
+			chunk = slab + i;
+			*(void **)chunk = shard->free_chunks[class];
+			shard->free_chunks[class] = chunk;
+		}
+		shard->buf_slabs++;
+	}
+	chunk = shard->free_chunks[class];
+	shard->free_chunks[class] = *(void **)chunk;
+	shard->chunks_used[class]++;
+	mutex_unlock(&shard->buf_lock);
+
+	return chunk;
+}
+
+/* Return a client's buffer to its shard's pool, or the heap, leaving it
+ * with its empty inline buffer */
+static void release_client_buf(cshard_t *shard, client_instance_t *client)
+{
+	int class;
+
+	if (likely(client->buf == client->ibuf))
+		return;
+	for (class = 0; class < BUF_CLASSES; class++) {
+		if (client->bufsize == buf_classes[class])
+			break;
+	}
+	mutex_lock(&shard->buf_lock);
+	if (class < BUF_CLASSES) {
+		*(void **)client->buf = shard->free_chunks[class];
+		shard->free_chunks[class] = client->buf;
+		shard->chunks_used[class]--;
+	} else {
+		free(client->buf);
+		shard->large_bufs--;
+		shard->large_bufs_size -= client->bufsize;
+	}
+	mutex_unlock(&shard->buf_lock);
+	client->buf = client->ibuf;
+	client->bufsize = CLIENT_INLINE_BUF;
+}
+
+/* Make room for len bytes in the client's buffer, moving what it has into a
+ * bigger one if need be */
+static void reserve_client_buf(client_instance_t *client, const unsigned long len)
+{
+	cshard_t *shard = client->shard;
+	int class, size;
+	char *buf;
+
+	if (likely(len <= (unsigned long)client->bufsize))
+		return;
+	for (class = 0; class < BUF_CLASSES; class++) {
+		if (len <= (unsigned long)buf_classes[class])
+			break;
+	}
+	if (class < BUF_CLASSES) {
+		buf = alloc_buf_chunk(shard, class);
+		size = buf_classes[class];
+	} else {
+		size = round_up_page(len);
+		buf = ckalloc(size);
+		mutex_lock(&shard->buf_lock);
+		shard->large_bufs++;
+		shard->large_bufs_size += size;
+		mutex_unlock(&shard->buf_lock);
+	}
+	memcpy(buf, client->buf, client->bufofs);
+	release_client_buf(shard, client);
+	client->buf = buf;
+	client->bufsize = size;
+}
+
+static void __recycle_client(cshard_t *shard, client_instance_t *client)
 {
-	dealloc(client->buf);
+	release_client_buf(shard, client);
 	memset(client, 0, sizeof(client_instance_t));
 	client->id = -1;
-	DL_APPEND2(cdata->recycled_clients, client, recycled_prev, recycled_next);
+	DL_APPEND2(shard->recycled_clients, client, recycled_prev, recycled_next);
 }
 
-static void recycle_client(cdata_t *cdata, client_instance_t *client)
+static void recycle_client(cshard_t *shard, client_instance_t *client)
 {
-	ck_wlock(&cdata->lock);
-	__recycle_client(cdata, client);
-	ck_wunlock(&cdata->lock);
+	ck_wlock(&shard->lock);
+	__recycle_client(shard, client);
+	ck_wunlock(&shard->lock);
 }
 
 /* Allows the stratifier to get a unique local virtualid for subclients */
 int64_t connector_newclientid(ckpool_t *ckp)
 {
+	cdata_t *cdata = ckp->cdata;
+	cshard_t *shard = &cdata->shards[0];
 	int64_t ret;
 
-	cdata_t *cdata = ckp->cdata;
-
-	ck_wlock(&cdata->lock);
-	ret = cdata->client_ids++;
-	ck_wunlock(&cdata->lock);
+	ck_wlock(&shard->lock);
+	ret = shard->client_ids;
+	shard->client_ids += cdata->nshards;
+	ck_wunlock(&shard->lock);
 
 	return ret;
 }
 
-/* Accepts incoming connections on the server socket and generates client
- * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+static int client_count(cdata_t *cdata)
 {
-	int fd, port, no_clients, sockd;
-	ckpool_t *ckp = cdata->ckp;
-	client_instance_t *client;
-	struct epoll_event event;
-	socklen_t address_len;
-	socklen_t optlen;
+	int i, ret = 0;
 
-	ck_rlock(&cdata->lock);
-	no_clients = HASH_COUNT(cdata->clients);
-	ck_runlock(&cdata->lock);
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
 
-	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
-		LOGWARNING("Server full with %d clients", no_clients);
-		return 0;
+		ck_rlock(&shard->lock);
+		ret += HASH_COUNT(shard->clients);
+		ck_runlock(&shard->lock);
 	}
+	return ret;
+}
 
-	sockd = cdata->serverfd[server];
-	client = recruit_client(cdata);
-	client->server = server;
-	client->address = (struct sockaddr *)&client->address_storage;
-	address_len = sizeof(client->address_storage);
-	fd = accept(sockd, client->address, &address_len);
-	if (unlikely(fd < 0)) {
-		/* Handle these errors gracefully should we ever share this
-		 * socket */
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-			LOGERR("Recoverable error on accept in accept_client");
-			return 0;
-		}
-		LOGERR("Failed to accept on socket %d in acceptor", sockd);
-		recycle_client(cdata, client);
-		return -1;
-	}
+/* Requests queued by other threads need to wake the shard's thread to submit
+ * them, its own are submitted with its next wait */
+static bool uring_wake_now(const cshard_t *shard)
+{
+	return !pthread_equal(pthread_self(), shard->pth_receiver);
+}
+
+/* Sets up a client accepted on fd and starts servicing its events on its
+ * shard */
+static int add_client(cdata_t *cdata, cshard_t *shard, client_instance_t *client, int fd,
+		      const int no_clients)
+{
+	struct epoll_event event;
+	socklen_t optlen;
+	int port;
 
 	switch (client->address->sa_family) {
 		const struct sockaddr_in *inet4_in;
@@ -320,7 +509,7 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 			LOGWARNING("Unknown INET type for client %d on socket %d",
 				   cdata->nfds, fd);
 			Close(fd);
-			recycle_client(cdata, client);
+			recycle_client(shard, client);
 			return 0;
 	}
 
@@ -330,33 +519,77 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	LOGINFO("Connected new client %d on socket %d to %d active clients from %s:%d",
 		cdata->nfds, fd, no_clients, client->address_name, port);
 
-	ck_wlock(&cdata->lock);
-	client->id = cdata->client_ids++;
-	HASH_ADD_I64(cdata->clients, id, client);
-	cdata->nfds++;
-	ck_wunlock(&cdata->lock);
+	ck_wlock(&shard->lock);
+	client->id = shard->client_ids;
+	shard->client_ids += cdata->nshards;
+	HASH_ADD_I64(shard->clients, id, client);
+	ck_wunlock(&shard->lock);
+	__atomic_add_fetch(&cdata->nfds, 1, __ATOMIC_RELAXED);
 
 	/* We increase the ref count on this client as epoll creates a pointer
 	 * to it. We drop that reference when the socket is closed which
 	 * removes it automatically from the epoll list. */
-	__inc_instance_ref(client);
+	inc_instance_ref(client);
 	client->fd = fd;
 	optlen = sizeof(client->sendbufsize);
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
 	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
 
+	if (shard->ring) {
+		if (unlikely(!uring_recv(shard->ring, fd, URING_RECV | client->id,
+					 uring_wake_now(shard)))) {
+			LOGERR("Failed to queue io_uring receive in add_client");
+			dec_instance_ref(client);
+			return 0;
+		}
+		return 1;
+	}
 	event.data.u64 = client->id;
 	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
-		LOGERR("Failed to epoll_ctl add in accept_client");
-		dec_instance_ref(cdata, client);
+	if (unlikely(epoll_ctl(shard->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+		LOGERR("Failed to epoll_ctl add in add_client");
+		dec_instance_ref(client);
 		return 0;
 	}
 
 	return 1;
 }
 
-static int __drop_client(cdata_t *cdata, client_instance_t *client)
+/* Accepts incoming connections on the server socket and generates client
+ * instances */
+static int accept_client(cdata_t *cdata, cshard_t *shard, const int sockd, const int server)
+{
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	socklen_t address_len;
+	int fd, no_clients;
+
+	no_clients = client_count(cdata);
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		return 0;
+	}
+
+	client = recruit_client(shard);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	fd = accept(sockd, client->address, &address_len);
+	if (unlikely(fd < 0)) {
+		/* Handle these errors gracefully should we ever share this
+		 * socket */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+			LOGERR("Recoverable error on accept in accept_client");
+			return 0;
+		}
+		LOGERR("Failed to accept on socket %d in acceptor", sockd);
+		recycle_client(shard, client);
+		return -1;
+	}
+	return add_client(cdata, shard, client, fd, no_clients);
+}
+
+static int __drop_client(cshard_t *shard, client_instance_t *client)
 {
 	int ret = -1;
 
@@ -364,14 +597,18 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 		goto out;
 	client->invalid = true;
 	ret = client->fd;
+	/* Requests on an io_uring hold the socket open until they complete, so
+	 * shut it down to end them */
+	if (shard->ring)
+		shutdown(client->fd, SHUT_RDWR);
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
-	HASH_DEL(cdata->clients, client);
-	DL_APPEND2(cdata->dead_clients, client, dead_prev, dead_next);
+	HASH_DEL(shard->clients, client);
+	DL_APPEND2(shard->dead_clients, client, dead_prev, dead_next);
 	/* This is the reference to this client's presence in the
 	 * epoll list. */
-	__dec_instance_ref(client);
-	cdata->dead_generated++;
+	dec_instance_ref(client);
+	shard->dead_generated++;
 out:
 	return ret;
 }
@@ -390,12 +627,13 @@ static int drop_client(cdata_t *cdata, client_instance_t *client)
 	bool passthrough = client->passthrough, remote = client->remote;
 	char address_name[INET6_ADDRSTRLEN];
 	int64_t client_id = client->id;
+	cshard_t *shard = client->shard;
 	int fd = -1;
 
 	strcpy(address_name, client->address_name);
-	ck_wlock(&cdata->lock);
-	fd = __drop_client(cdata, client);
-	ck_wunlock(&cdata->lock);
+	ck_wlock(&shard->lock);
+	fd = __drop_client(shard, client);
+	ck_wunlock(&shard->lock);
 
 	if (fd > -1) {
 		if (passthrough) {
@@ -428,16 +666,96 @@ static void stratifier_drop_client(ckpool_t *ckp, const client_instance_t *clien
 	stratifier_drop_id(ckp, client->id);
 }
 
+/* Serialise a message to be broadcast, returning it with one reference for
+ * the first client it is sent to */
+bcast_t *create_bcast(const json_t *val)
+{
+	bcast_t *bcast = ckalloc(sizeof(bcast_t));
+
+	bcast->buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
+	bcast->len = strlen(bcast->buf);
+	bcast->refs = 1;
+	return bcast;
+}
+
+void ref_bcast(bcast_t *bcast)
+{
+	__atomic_add_fetch(&bcast->refs, 1, __ATOMIC_RELAXED);
+}
+
+void drop_bcast(bcast_t *bcast)
+{
+	if (__atomic_sub_fetch(&bcast->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(bcast->buf);
+	free(bcast);
+}
+
+static void free_sender_send(sender_send_t *sender_send)
+{
+	if (sender_send->bcast)
+		drop_bcast(sender_send->bcast);
+	else
+		free(sender_send->buf);
+	free(sender_send);
+}
+
+/* Free all the queued sends of a client. Must hold send_lock */
+static void __clear_sends(client_instance_t *client)
+{
+	cshard_t *shard = client->shard;
+	sender_send_t *sender_send, *tmp;
+
+	DL_FOREACH_SAFE(client->sends, sender_send, tmp) {
+		DL_DELETE(client->sends, sender_send);
+		__atomic_sub_fetch(&shard->sends_queued, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&shard->sends_size, sender_send->len, __ATOMIC_RELAXED);
+		free_sender_send(sender_send);
+	}
+}
+
+/* Take a client whose queued sends have all gone off the blocked list,
+ * returning true if the reference the queue held must now be dropped. Must
+ * hold send_lock */
+static bool __unblock_client(client_instance_t *client)
+{
+	cshard_t *shard = client->shard;
+
+	if (client->sends || !client->blocked_time)
+		return false;
+	ck_wlock(&shard->lock);
+	DL_DELETE2(shard->blocked_clients, client, blocked_prev, blocked_next);
+	client->blocked_time = 0;
+	ck_wunlock(&shard->lock);
+	return true;
+}
+
+/* Discard anything still queued to an invalidated client */
+static void clear_client_sends(client_instance_t *client)
+{
+	bool unblocked;
+
+	mutex_lock(&client->send_lock);
+	__clear_sends(client);
+	unblocked = __unblock_client(client);
+	mutex_unlock(&client->send_lock);
+
+	if (unblocked)
+		dec_instance_ref(client);
+}
+
 /* Invalidate this instance. Remove them from the hashtables we look up
  * regularly but keep the instances in a linked list until their ref count
  * drops to zero when we can remove them lazily. Client must hold a reference
  * count. */
 static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
+	cshard_t *shard = client->shard;
 	client_instance_t *tmp;
 	int ret;
 
 	ret = drop_client(cdata, client);
+	clear_client_sends(client);
 	if ((!ckp->passthrough || ckp->node) && !client->passthrough)
 		stratifier_drop_client(ckp, client);
 	if (ckp->passthrough)
@@ -445,20 +763,20 @@ static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *c
 
 	/* Cull old unused clients lazily when there are no more reference
 	 * counts for them. */
-	ck_wlock(&cdata->lock);
-	DL_FOREACH_SAFE2(cdata->dead_clients, client, tmp, dead_next) {
-		if (!client->ref) {
-			DL_DELETE2(cdata->dead_clients, client, dead_prev, dead_next);
+	ck_wlock(&shard->lock);
+	DL_FOREACH_SAFE2(shard->dead_clients, client, tmp, dead_next) {
+		if (!__atomic_load_n(&client->ref, __ATOMIC_ACQUIRE)) {
+			DL_DELETE2(shard->dead_clients, client, dead_prev, dead_next);
 			LOGINFO("Connector recycling client %"PRId64, client->id);
 			/* We only close the client fd once we're sure there
 			 * are no references to it left to prevent fds being
 			 * reused on new and old clients. */
 			nolinger_socket(client->fd);
 			Close(client->fd);
-			__recycle_client(cdata, client);
+			__recycle_client(shard, client);
 		}
 	}
-	ck_wunlock(&cdata->lock);
+	ck_wunlock(&shard->lock);
 
 	return ret;
 }
@@ -466,19 +784,25 @@ static int invalidate_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *c
 static void drop_all_clients(cdata_t *cdata)
 {
 	client_instance_t *client, *tmp;
+	int i;
 
-	ck_wlock(&cdata->lock);
-	HASH_ITER(hh, cdata->clients, client, tmp) {
-		__drop_client(cdata, client);
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		ck_wlock(&shard->lock);
+		HASH_ITER(hh, shard->clients, client, tmp) {
+			__drop_client(shard, client);
+		}
+		ck_wunlock(&shard->lock);
 	}
-	ck_wunlock(&cdata->lock);
 }
 
-static void send_client(ckpool_t *ckp, cdata_t *cdata, int64_t id, char *buf);
+static void send_client(ckpool_t *ckp, cdata_t *cdata, int64_t id, char *buf,
+			const bool defer);
 
 /* Look for shares being submitted via a redirector and add them to a linked
  * list for looking up the responses. */
-static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, const json_t *val)
+static void parse_redirector_share(client_instance_t *client, const json_t *val)
 {
 	share_t *share, *tmp;
 	time_t now;
@@ -495,9 +819,9 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 
 	LOGINFO("Redirector adding client %"PRId64" share id: %"PRId64, client->id, id);
 
-	/* We use the cdata lock instead of a separate lock since this function
+	/* We use the shard lock instead of a separate lock since this function
 	 * is called infrequently. */
-	ck_wlock(&cdata->lock);
+	ck_wlock(&client->shard->lock);
 	DL_APPEND(client->shares, share);
 
 	/* Age old shares. */
@@ -507,189 +831,448 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 			dealloc(share);
 		}
 	}
-	ck_wunlock(&cdata->lock);
+	ck_wunlock(&client->shard->lock);
 }
 
-/* Client is holding a reference count from being on the epoll list. Returns
- * true if we will still be receiving messages from this client. */
-static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+/* Hand one message of the client, with its EOL replaced by a null, to be
+ * processed. Returns false if the client should be dropped. */
+static bool parse_client_line(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      const char *msg)
 {
-	int buflen, ret;
 	json_t *val;
-	char *eol;
 
-retry:
-	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
-		if (!client->remote) {
-			LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
-				client->id, client->fd);
-			return false;
-		}
-		client->buf = realloc(client->buf, round_up_page(client->bufofs + MAX_MSGSIZE + 1));
-	}
-	/* This read call is non-blocking since the socket is set to O_NOBLOCK */
-	ret = read(client->fd, client->buf + client->bufofs, MAX_MSGSIZE);
-	if (ret < 1) {
-		if (likely(errno == EAGAIN || errno == EWOULDBLOCK || !ret))
-			return true;
-		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d errno %d %s",
-			client->id, client->fd, client->bufofs, ret, errno, ret && errno ? strerror(errno) : "");
+	if (!(val = json_loads(msg, JSON_DISABLE_EOF_CHECK, NULL))) {
+		char *buf = strdup("Invalid JSON, disconnecting\n");
+
+		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, msg);
+		send_client(ckp, cdata, client->id, buf, false);
 		return false;
 	}
-	client->bufofs += ret;
-reparse:
-	eol = memchr(client->buf, '\n', client->bufofs);
-	if (!eol)
-		goto retry;
+	if (client->passthrough) {
+		int64_t passthrough_id;
 
-	/* Do something useful with this message now */
-	buflen = eol - client->buf + 1;
-	if (unlikely(buflen > MAX_MSGSIZE && !client->remote)) {
-		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
-		return false;
+		json_getdel_int64(&passthrough_id, val, "client_id");
+		passthrough_id = (client->id << 32) | passthrough_id;
+		json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
+	} else {
+		if (ckp->redirector && !client->redirected && strstr(msg, "mining.submit"))
+			parse_redirector_share(client, val);
+		json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
+		json_object_set_new_nocheck(val, "address", json_string(client->address_name));
 	}
+	json_object_set_new_nocheck(val, "server", json_integer(client->server));
 
-	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
-		char *buf = strdup("Invalid JSON, disconnecting\n");
+	/* Do not send messages of clients we've already dropped. We
+	 * do this unlocked as the occasional false negative can be
+	 * filtered by the stratifier. */
+	if (likely(!client->invalid)) {
+		if (!ckp->passthrough)
+			stratifier_add_recv(ckp, val);
+		if (ckp->node)
+			stratifier_add_recv(ckp, json_deep_copy(val));
+		if (ckp->passthrough)
+			generator_add_send(ckp, val);
+	} else
+		json_decref(val);
+	return true;
+}
 
-		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
-		send_client(ckp, cdata, client->id, buf);
-		return false;
-	} else {
-		if (client->passthrough) {
-			int64_t passthrough_id;
+/* Process every message in len bytes received from the client, walking a
+ * cursor through the data where they are parsed in place. Only a message
+ * split across receives is copied into the client's buffer, where it is
+ * completed with the start of the next receive. Returns false if the client
+ * should be dropped. Client must hold a reference count */
+static bool parse_client_data(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      char *data, int len)
+{
+	unsigned long msglen;
+	bool ret;
+	char *eol;
 
-			json_getdel_int64(&passthrough_id, val, "client_id");
-			passthrough_id = (client->id << 32) | passthrough_id;
-			json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
-		} else {
-			if (ckp->redirector && !client->redirected && strstr(client->buf, "mining.submit"))
-				parse_redirector_share(cdata, client, val);
-			json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
-			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+	while (len > 0) {
+		eol = memchr(data, '\n', len);
+		if (!eol) {
+			if (unlikely(client->bufofs + len > MAX_MSGSIZE && !client->remote)) {
+				LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
+					  client->id, client->fd);
+				return false;
+			}
+			/* Keep the partial message for the next receive */
+			reserve_client_buf(client, client->bufofs + len);
+			memcpy(client->buf + client->bufofs, data, len);
+			client->bufofs += len;
+			break;
 		}
-		json_object_set_new_nocheck(val, "server", json_integer(client->server));
-
-		/* Do not send messages of clients we've already dropped. We
-		 * do this unlocked as the occasional false negative can be
-		 * filtered by the stratifier. */
-		if (likely(!client->invalid)) {
-			if (!ckp->passthrough)
-				stratifier_add_recv(ckp, val);
-			if (ckp->node)
-				stratifier_add_recv(ckp, json_deep_copy(val));
-			if (ckp->passthrough)
-				generator_add_send(ckp, val);
-		} else
-			json_decref(val);
+		*eol = '\0';
+		msglen = eol - data + 1;
+		if (unlikely(client->bufofs + msglen > MAX_MSGSIZE && !client->remote)) {
+			LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
+			return false;
+		}
+		if (likely(!client->bufofs))
+			ret = parse_client_line(ckp, cdata, client, data);
+		else {
+			reserve_client_buf(client, client->bufofs + msglen);
+			memcpy(client->buf + client->bufofs, data, msglen);
+			ret = parse_client_line(ckp, cdata, client, client->buf);
+			client->bufofs = 0;
+			release_client_buf(client->shard, client);
+		}
+		if (unlikely(!ret))
+			return false;
+		data += msglen;
+		len -= msglen;
 	}
-	client->bufofs -= buflen;
-	if (client->bufofs)
-		memmove(client->buf, client->buf + buflen, client->bufofs);
-	client->buf[client->bufofs] = '\0';
+	return true;
+}
 
-	if (client->bufofs)
-		goto reparse;
-	goto retry;
+/* Client is holding a reference count from being on the epoll list. Returns
+ * true if we will still be receiving messages from this client. */
+static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	char buf[RECV_BUFSIZE];
+	int ret;
+
+	while (42) {
+		/* This read call is non-blocking since the socket is set to O_NOBLOCK */
+		ret = read(client->fd, buf, RECV_BUFSIZE);
+		if (ret < 1) {
+			if (likely(errno == EAGAIN || errno == EWOULDBLOCK || !ret))
+				return true;
+			LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d errno %d %s",
+				client->id, client->fd, client->bufofs, ret, errno, ret && errno ? strerror(errno) : "");
+			return false;
+		}
+		if (unlikely(!parse_client_data(ckp, cdata, client, buf, ret)))
+			return false;
+	}
 }
 
 static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
 {
+	cshard_t *shard = shard_by_id(cdata, id);
 	client_instance_t *client;
 
-	ck_wlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
+	ck_rlock(&shard->lock);
+	HASH_FIND_I64(shard->clients, &id, client);
 	if (client) {
 		if (!client->invalid)
 			__inc_instance_ref(client);
 		else
 			client = NULL;
 	}
-	ck_wunlock(&cdata->lock);
-
-	return client;
+	ck_runlock(&shard->lock);
+
+	return client;
+}
+
+/* Caller must hold a reference to the client */
+static void redirect_client(ckpool_t *ckp, client_instance_t *client);
+static void __rearm_client(client_instance_t *client);
+static void write_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client);
+static void drop_blocked_clients(ckpool_t *ckp, cdata_t *cdata, cshard_t *shard);
+
+static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+{
+	redirect_t *redirect;
+
+	ck_rlock(&cdata->lock);
+	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
+	ck_runlock(&cdata->lock);
+
+	return redirect;
+}
+
+static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+{
+	const uint32_t events = event->events;
+	const uint64_t id = event->data.u64;
+	cdata_t *cdata = ckp->cdata;
+	client_instance_t *client;
+
+	client = ref_client_by_id(cdata, id);
+	if (unlikely(!client)) {
+		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
+		return;
+	}
+	/* We can have both messages and read hang ups so process the
+	 * message first. */
+	if (likely(events & EPOLLIN)) {
+		/* Rearm the client for epoll events if we have successfully
+		 * parsed a message from it */
+		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
+			invalidate_client(ckp, cdata, client);
+			goto out;
+		}
+	}
+	/* The socket can take more of the sends queued to this client */
+	if (events & EPOLLOUT)
+		write_client_sends(ckp, cdata, client);
+	if (unlikely(events & EPOLLERR)) {
+		socklen_t errlen = sizeof(int);
+		int error = 0;
+
+		/* See what type of error this is and raise the log
+			* level of the message if it's unexpected. */
+		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
+		if (error != 104) {
+			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+					client->id, client->fd, error, strerror(error));
+		} else {
+			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+				client->id, client->fd, error, strerror(error));
+		}
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	} else if (unlikely(events & EPOLLHUP)) {
+		/* Client connection reset by peer */
+		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	} else if (unlikely(events & EPOLLRDHUP)) {
+		/* Client disconnected by peer */
+		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	}
+out:
+	if (likely(!client->invalid)) {
+		/* Rearm the fd in the epoll list if it's still active */
+		mutex_lock(&client->send_lock);
+		__rearm_client(client);
+		mutex_unlock(&client->send_lock);
+	}
+	dec_instance_ref(client);
+}
+
+/* Services the events of this shard's epoll fd in batches, straight out of
+ * the array epoll_wait fills, accepting new clients on its own listening
+ * sockets in listeners mode. */
+static void *shard_receiver(void *arg)
+{
+	struct epoll_event events[CEVENT_BATCH];
+	cshard_t *shard = (cshard_t *)arg;
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	const uint64_t serverfds = ckp->serverurls;
+	time_t last_check = 0;
+	char name[16];
+	int ret, i;
+
+	snprintf(name, 15, "creceiver%d", shard->id);
+	rename_proc(name);
+
+	/* Wait for the stratifier to be ready for us */
+	while (!ckp->stratifier_ready)
+		cksleep_ms(10);
+
+	while (42) {
+		time_t now_t;
+
+		while (unlikely(!cdata->accept))
+			cksleep_ms(10);
+		now_t = time(NULL);
+		if (now_t != last_check) {
+			last_check = now_t;
+			drop_blocked_clients(ckp, cdata, shard);
+		}
+		ret = epoll_wait(shard->epfd, events, CEVENT_BATCH, 1000);
+		if (unlikely(ret < 1)) {
+			if (unlikely(ret == -1 && errno != EINTR)) {
+				LOGEMERG("FATAL: Failed to epoll_wait in shard receiver");
+				break;
+			}
+			continue;
+		}
+		for (i = 0; i < ret; i++) {
+			const uint64_t edu64 = events[i].data.u64;
+
+			if (edu64 < serverfds) {
+				if (unlikely(accept_client(cdata, shard, shard->serverfd[edu64], edu64) < 0)) {
+					LOGEMERG("FATAL: Failed to accept_client in shard receiver");
+					return NULL;
+				}
+				continue;
+			}
+			client_event_processor(ckp, &events[i]);
+		}
+	}
+	return NULL;
+}
+
+#ifdef USE_IO_URING
+/* Takes a client the multishot accept of a listening socket brought in */
+static int uring_accept_client(cdata_t *cdata, cshard_t *shard, int fd, const int server)
+{
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	socklen_t address_len;
+	int no_clients;
+
+	no_clients = client_count(cdata);
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		Close(fd);
+		return 0;
+	}
+
+	client = recruit_client(shard);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	if (unlikely(getpeername(fd, client->address, &address_len) < 0)) {
+		LOGINFO("Failed to getpeername of newly accepted socket %d", fd);
+		Close(fd);
+		recycle_client(shard, client);
+		return 0;
+	}
+	return add_client(cdata, shard, client, fd, no_clients);
 }
 
-static void redirect_client(ckpool_t *ckp, client_instance_t *client);
-
-static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+/* Process what a multishot receive brought into one of the shard's provided
+ * buffers, handing the buffer straight back. Returns false if the client
+ * should be dropped. */
+static bool uring_client_recv(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      const struct io_uring_cqe *cqe)
 {
-	redirect_t *redirect;
+	uring_t *ring = client->shard->ring;
+	bool ret;
 
-	ck_rlock(&cdata->lock);
-	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
-	ck_runlock(&cdata->lock);
-
-	return redirect;
+	ret = parse_client_data(ckp, cdata, client, uring_buf(ring, cqe), cqe->res);
+	uring_recycle_buf(ring, cqe);
+	return ret;
 }
 
-static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+static void uring_client_event(ckpool_t *ckp, cshard_t *shard, const struct io_uring_cqe *cqe)
 {
-	const uint32_t events = event->events;
-	const uint64_t id = event->data.u64;
+	const uint64_t type = cqe->user_data & URING_TYPE;
+	const int64_t id = cqe->user_data & ~URING_TYPE;
 	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
 
 	client = ref_client_by_id(cdata, id);
+	if (type == URING_POLLOUT) {
+		if (unlikely(!client))
+			return;
+		/* The socket can take more of the sends queued to this client */
+		write_client_sends(ckp, cdata, client);
+		mutex_lock(&client->send_lock);
+		client->pollout = false;
+		if (likely(!client->invalid))
+			__rearm_client(client);
+		mutex_unlock(&client->send_lock);
+		goto out;
+	}
+
+	/* The end of the receives of dropped clients still use buffers */
 	if (unlikely(!client)) {
-		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			uring_recycle_buf(shard->ring, cqe);
+		return;
 	}
-	/* We can have both messages and read hang ups so process the
-	 * message first. */
-	if (likely(events & EPOLLIN)) {
-		/* Rearm the client for epoll events if we have successfully
-		 * parsed a message from it */
-		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
+	if (likely(cqe->res > 0)) {
+		if (unlikely(!uring_client_recv(ckp, cdata, client, cqe))) {
 			invalidate_client(ckp, cdata, client);
 			goto out;
 		}
+	} else if (cqe->res == -ENOBUFS) {
+		/* Out of buffers, they will be back by the time the receive
+		 * is resubmitted below */
+	} else {
+		if (!cqe->res)
+			LOGINFO("Client id %"PRId64" fd %d disconnected", client->id, client->fd);
+		else {
+			LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu errno %d %s",
+				client->id, client->fd, client->bufofs, -cqe->res, strerror(-cqe->res));
+		}
+		invalidate_client(ckp, cdata, client);
+		goto out;
 	}
-	if (unlikely(events & EPOLLERR)) {
-		socklen_t errlen = sizeof(int);
-		int error = 0;
+	/* The kernel ended the multishot receive so start another */
+	if (unlikely(!(cqe->flags & IORING_CQE_F_MORE)) &&
+	    unlikely(!uring_recv(shard->ring, client->fd, URING_RECV | id, false))) {
+		LOGWARNING("Failed to requeue io_uring receive for client id %"PRId64, id);
+		invalidate_client(ckp, cdata, client);
+	}
+out:
+	dec_instance_ref(client);
+}
 
-		/* See what type of error this is and raise the log
-			* level of the message if it's unexpected. */
-		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
-		if (error != 104) {
-			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-					client->id, client->fd, error, strerror(error));
-		} else {
-			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-				client->id, client->fd, error, strerror(error));
+/* As shard_receiver but reaping the completions of the shard's io_uring,
+ * with the requests its own events queue submitted in the same call that
+ * waits for more. */
+static void *uring_shard_receiver(void *arg)
+{
+	struct io_uring_cqe cqes[CEVENT_BATCH];
+	cshard_t *shard = (cshard_t *)arg;
+	cdata_t *cdata = shard->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	time_t last_check = 0;
+	char name[16];
+	int ret, i;
+
+	snprintf(name, 15, "creceiver%d", shard->id);
+	rename_proc(name);
+	shard->pth_receiver = pthread_self();
+
+	/* Wait for the stratifier to be ready for us */
+	while (!ckp->stratifier_ready)
+		cksleep_ms(10);
+
+	for (i = 0; shard->serverfd && i < ckp->serverurls; i++) {
+		if (unlikely(!uring_accept(shard->ring, shard->serverfd[i], URING_ACCEPT | i, false))) {
+			LOGEMERG("FATAL: Failed to queue io_uring accept in shard receiver");
+			return NULL;
 		}
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLHUP)) {
-		/* Client connection reset by peer */
-		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLRDHUP)) {
-		/* Client disconnected by peer */
-		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
 	}
-out:
-	if (likely(!client->invalid)) {
-		/* Rearm the fd in the epoll list if it's still active */
-		event->data.u64 = id;
-		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
+
+	while (42) {
+		time_t now_t;
+
+		while (unlikely(!cdata->accept))
+			cksleep_ms(10);
+		now_t = time(NULL);
+		if (now_t != last_check) {
+			last_check = now_t;
+			drop_blocked_clients(ckp, cdata, shard);
+		}
+		ret = uring_wait(shard->ring, cqes, CEVENT_BATCH, 1000);
+		if (unlikely(ret < 0)) {
+			LOGEMERG("FATAL: Failed to wait on io_uring in shard receiver");
+			break;
+		}
+		for (i = 0; i < ret; i++) {
+			const struct io_uring_cqe *cqe = &cqes[i];
+
+			if ((cqe->user_data & URING_TYPE) != URING_ACCEPT) {
+				uring_client_event(ckp, shard, cqe);
+				continue;
+			}
+			if (likely(cqe->res > -1))
+				uring_accept_client(cdata, shard, cqe->res, cqe->user_data & ~URING_TYPE);
+			else if (cqe->res != -EAGAIN && cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+				LOGEMERG("FATAL: Failed to accept on io_uring in shard receiver: %s",
+					 strerror(-cqe->res));
+				return NULL;
+			}
+			if (unlikely(!(cqe->flags & IORING_CQE_F_MORE)) &&
+			    unlikely(!uring_accept(shard->ring, shard->serverfd[cqe->user_data & ~URING_TYPE],
+						   cqe->user_data, false))) {
+				LOGEMERG("FATAL: Failed to requeue io_uring accept in shard receiver");
+				return NULL;
+			}
+		}
 	}
-	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+	return NULL;
 }
+#endif /* USE_IO_URING */
 
-/* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
+/* Waits on the listening sockets and accepts new clients, handing them to
+ * the shards in turn. Not used in listeners mode. */
 static void *receiver(void *arg)
 {
 	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
+	struct epoll_event events[CEVENT_BATCH];
 	ckpool_t *ckp = cdata->ckp;
 	uint64_t serverfds, i;
-	int ret, epfd;
+	int ret, epfd, nev;
 
 	rename_proc("creceiver");
 
@@ -701,10 +1284,11 @@ static void *receiver(void *arg)
 	serverfds = ckp->serverurls;
 	/* Add all the serverfds to the epoll */
 	for (i = 0; i < serverfds; i++) {
-		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
+		struct epoll_event event;
+
+		event.data.u64 = i;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], &event);
 		if (ret < 0) {
 			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
 			goto out;
@@ -716,144 +1300,239 @@ static void *receiver(void *arg)
 		cksleep_ms(10);
 
 	while (42) {
-		uint64_t edu64;
-
 		while (unlikely(!cdata->accept))
 			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
-		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
+		nev = epoll_wait(epfd, events, CEVENT_BATCH, 1000);
+		if (unlikely(nev < 1)) {
+			if (unlikely(nev == -1)) {
 				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
 				break;
 			}
 			/* Nothing to service, still very unlikely */
 			continue;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
+		for (i = 0; i < (uint64_t)nev; i++) {
+			const uint64_t server = events[i].data.u64;
+			cshard_t *shard;
+
+			shard = &cdata->shards[cdata->next_shard++ % cdata->nshards];
+			ret = accept_client(cdata, shard, cdata->serverfd[server], server);
 			if (unlikely(ret < 0)) {
 				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
+				goto out;
 			}
-			continue;
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
 	}
 out:
 	/* We shouldn't get here unless there's an error */
 	return NULL;
 }
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+/* Rearm the client in its shard's epoll set, asking for EPOLLOUT as well
+ * while it has sends queued. Receives on an io_uring stay armed so there it
+ * only asks for POLLOUT. Must hold send_lock */
+static void __rearm_client(client_instance_t *client)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
-
-	if (unlikely(client->invalid))
-		goto out_true;
-
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
-
-	client->sending = sender_send;
-	now_t = time(NULL);
-
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+	cshard_t *shard = client->shard;
+	struct epoll_event event;
 
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+	if (shard->ring) {
+		if (client->sends && !client->pollout) {
+			client->pollout = uring_poll(shard->ring, client->fd, POLLOUT,
+						     URING_POLLOUT | client->id,
+						     uring_wake_now(shard));
+		}
+		return;
+	}
+	event.data.u64 = client->id;
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	if (client->sends)
+		event.events |= EPOLLOUT;
+	epoll_ctl(shard->epfd, EPOLL_CTL_MOD, client->fd, &event);
+}
 
+/* Write out as much of the client's queued sends as the socket will take,
+ * gathering up to SEND_IOVECS of them into each writev. Returns false on a
+ * write error the client should be dropped for. Must hold send_lock */
+static bool __write_sends(ckpool_t *ckp, client_instance_t *client)
+{
+	cshard_t *shard = client->shard;
+	struct iovec iov[SEND_IOVECS];
+	sender_send_t *sender_send, *tmp;
+
+	while (client->sends) {
+		int iovcnt = 0, written = 0;
+		ssize_t ret;
+
+		DL_FOREACH(client->sends, sender_send) {
+			/* Increase sendbufsize to match large messages sent to clients - this
+			 * usually only applies to clients as mining nodes. */
+			if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
+				client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+			iov[iovcnt].iov_base = sender_send->buf + sender_send->ofs;
+			iov[iovcnt].iov_len = sender_send->len;
+			if (++iovcnt == SEND_IOVECS)
+				break;
+		}
+		ret = writev(client->fd, iov, iovcnt);
 		if (ret < 1) {
-			/* Invalidate clients that block for more than 60 seconds */
-			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
-				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
-					  client->id, client->fd);
-				invalidate_client(ckp, cdata, client);
-				goto out_true;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
-				if (!client->blocked_time)
-					client->blocked_time = now_t;
-				return false;
-			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret)
+				return true;
 			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
 				client->id, client->fd, errno, strerror(errno));
-			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			return false;
 		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
-		client->blocked_time = 0;
+		__atomic_add_fetch(&shard->send_writes, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&shard->sends_size, ret, __ATOMIC_RELAXED);
+		DL_FOREACH_SAFE(client->sends, sender_send, tmp) {
+			if (ret < sender_send->len) {
+				sender_send->ofs += ret;
+				sender_send->len -= ret;
+				break;
+			}
+			ret -= sender_send->len;
+			DL_DELETE(client->sends, sender_send);
+			free_sender_send(sender_send);
+			written++;
+		}
+		__atomic_sub_fetch(&shard->sends_queued, written, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&shard->sends_written, written, __ATOMIC_RELAXED);
 	}
-out_true:
-	client->sending = NULL;
 	return true;
 }
 
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+/* Write out the client's queued sends, putting it on the shard's blocked list
+ * and asking for EPOLLOUT to write the rest later if the socket will not take
+ * them all. While on the blocked list the queue holds a reference to the
+ * client. Returns false if the client should be dropped. Must hold send_lock */
+static bool __flush_sends(ckpool_t *ckp, client_instance_t *client)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	cshard_t *shard = client->shard;
+
+	if (unlikely(!__write_sends(ckp, client))) {
+		__clear_sends(client);
+		return false;
+	}
+	if (client->sends) {
+		__atomic_add_fetch(&shard->sends_delayed, 1, __ATOMIC_RELAXED);
+		ck_wlock(&shard->lock);
+		inc_instance_ref(client);
+		client->blocked_time = time(NULL);
+		DL_APPEND2(shard->blocked_clients, client, blocked_prev, blocked_next);
+		ck_wunlock(&shard->lock);
+		__rearm_client(client);
+	}
+	return true;
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
-static void *sender(void *arg)
+/* Queue a send to its client behind any earlier sends. Unless deferred it is
+ * written out straight away, otherwise the client is put on the flush_clients
+ * list for flush_client_sends to write out everything the current batch of
+ * client messages queued to it at once. Sends to a blocked client are left
+ * for EPOLLOUT. Caller must hold a reference to the client. */
+static void send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send,
+			     const bool defer)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
-	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client = sender_send->client;
+	cshard_t *shard = client->shard;
+	bool drop = false;
 
-	rename_proc("csender");
+	__atomic_add_fetch(&shard->sends_generated, 1, __ATOMIC_RELAXED);
 
-	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
-			}
+	mutex_lock(&client->send_lock);
+	if (unlikely(client->invalid)) {
+		mutex_unlock(&client->send_lock);
+		free_sender_send(sender_send);
+		return;
+	}
+	__atomic_add_fetch(&shard->sends_queued, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->sends_size, sender_send->len, __ATOMIC_RELAXED);
+	DL_APPEND(client->sends, sender_send);
+	/* Already blocked, so it will be written on EPOLLOUT */
+	if (client->blocked_time)
+		goto out_unlock;
+
+	if (defer) {
+		if (!client->flush_queued) {
+			client->flush_queued = true;
+			inc_instance_ref(client);
+			LL_PREPEND2(cdata->flush_clients, client, flush_next);
 		}
+	} else
+		drop = !__flush_sends(ckp, client);
+out_unlock:
+	mutex_unlock(&client->send_lock);
+
+	if (drop)
+		invalidate_client(ckp, cdata, client);
+}
+
+/* Write out what the last batch of client messages queued to each client,
+ * dropping the references the flush_clients list held. Only called from the
+ * cmpq thread. */
+static void flush_client_sends(ckpool_t *ckp, cdata_t *cdata)
+{
+	client_instance_t *client, *tmp;
+
+	LL_FOREACH_SAFE2(cdata->flush_clients, client, tmp, flush_next) {
+		bool drop = false;
+
+		mutex_lock(&client->send_lock);
+		client->flush_queued = false;
+		if (!client->invalid && !client->blocked_time && client->sends)
+			drop = !__flush_sends(ckp, client);
+		mutex_unlock(&client->send_lock);
+
+		if (drop)
+			invalidate_client(ckp, cdata, client);
+		dec_instance_ref(client);
+	}
+	cdata->flush_clients = NULL;
+}
+
+/* The socket of a blocked client can take more, so write out what we can of
+ * its queued sends. Caller must hold a reference to the client. */
+static void write_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	bool drop = false, unblocked;
+
+	mutex_lock(&client->send_lock);
+	if (unlikely(!__write_sends(ckp, client))) {
+		__clear_sends(client);
+		drop = true;
+	}
+	unblocked = __unblock_client(client);
+	mutex_unlock(&client->send_lock);
+
+	if (unblocked)
+		dec_instance_ref(client);
+	if (drop)
+		invalidate_client(ckp, cdata, client);
+}
+
+/* Invalidate clients whose sends have been blocked for 60 seconds or more */
+static void drop_blocked_clients(ckpool_t *ckp, cdata_t *cdata, cshard_t *shard)
+{
+	time_t now_t = time(NULL);
+	client_instance_t *client;
 
-		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
+	do {
+		ck_wlock(&shard->lock);
+		DL_FOREACH2(shard->blocked_clients, client, blocked_next) {
+			if (!client->invalid && now_t - client->blocked_time >= 60) {
+				__inc_instance_ref(client);
+				break;
+			}
 		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+		ck_wunlock(&shard->lock);
+
+		if (client) {
+			LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+				  client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+			dec_instance_ref(client);
 		}
-		mutex_unlock(&cdata->sender_lock);
-	}
-	/* We shouldn't get here unless there's an error */
-	return NULL;
+	} while (client);
 }
 
 static int add_redirect(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
@@ -901,18 +1580,12 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
-	inc_instance_ref(cdata, client);
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	send_sender_send(ckp, cdata, sender_send, false);
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
  * client to a protected server. */
-static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, const char *buf)
+static bool test_redirector_shares(client_instance_t *client, const char *buf)
 {
 	json_t *val = json_loads(buf, 0, NULL);
 	share_t *share, *found = NULL;
@@ -929,7 +1602,7 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 		goto out;
 	}
 
-	ck_rlock(&cdata->lock);
+	ck_rlock(&client->shard->lock);
 	DL_FOREACH(client->shares, share) {
 		if (share->id == id) {
 			LOGDEBUG("Found matching share %"PRId64" in trs for client %"PRId64,
@@ -938,7 +1611,7 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 			break;
 		}
 	}
-	ck_runlock(&cdata->lock);
+	ck_runlock(&client->shard->lock);
 
 	if (found) {
 		bool result = false;
@@ -960,12 +1633,12 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 		ret = true;
 
 		/* Clear the list now since we don't need it any more */
-		ck_wlock(&cdata->lock);
+		ck_wlock(&client->shard->lock);
 		DL_FOREACH_SAFE(client->shares, share, found) {
 			DL_DELETE(client->shares, share);
 			dealloc(share);
 		}
-		ck_wunlock(&cdata->lock);
+		ck_wunlock(&client->shard->lock);
 	}
 out:
 	json_decref(val);
@@ -974,7 +1647,8 @@ out:
 
 /* Send a client by id a heap allocated buffer, allowing this function to
  * free the ram. */
-static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			const bool defer)
 {
 	sender_send_t *sender_send;
 	client_instance_t *client;
@@ -1000,8 +1674,8 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		return;
 	}
 
-	/* Grab a reference to this client until the sender_send has
-	 * completed processing. Is this a passthrough subclient ? */
+	/* Grab a reference to this client while we send to it. Is this a
+	 * passthrough subclient ? */
 	if ((pass_id = subclient(id))) {
 		int64_t client_id = id & 0xffffffffll;
 
@@ -1014,7 +1688,7 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 			client = ref_client_by_id(cdata, client_id);
 			if (client) {
 				invalidate_client(ckp, cdata, client);
-				dec_instance_ref(cdata, client);
+				dec_instance_ref(client);
 			} else
 				stratifier_drop_id(ckp, id);
 			free(buf);
@@ -1035,7 +1709,7 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 			if (redirect_matches(cdata, client))
 				redirect = true;
 			else
-				redirect = test_redirector_shares(cdata, client, buf);
+				redirect = test_redirector_shares(client, buf);
 		}
 	}
 
@@ -1043,19 +1717,16 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	send_sender_send(ckp, cdata, sender_send, defer);
 
 	/* Redirect after sending response to shares and authorise */
 	if (unlikely(redirect))
 		redirect_client(ckp, client);
+	dec_instance_ref(client);
 }
 
-static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg)
+static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg,
+			     const bool defer)
 {
 	client_instance_t *client;
 	char *msg;
@@ -1066,14 +1737,14 @@ static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, j
 		json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
 		json_object_set_new_nocheck(val, "address", json_string(client->address_name));
 		json_object_set_new_nocheck(val, "server", json_integer(client->server));
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		stratifier_add_recv(ckp, val);
 	}
 	if (ckp->passthrough && client_id)
 		json_object_del(json_msg, "node.method");
 
 	msg = json_dumps(json_msg, JSON_EOL | JSON_COMPACT);
-	send_client(ckp, cdata, client_id, msg);
+	send_client(ckp, cdata, client_id, msg, defer);
 	json_decref(json_msg);
 }
 
@@ -1083,13 +1754,15 @@ static bool client_exists(cdata_t *cdata, int64_t id)
 {
 	int64_t parent_id = subclient(id);
 	client_instance_t *client;
+	cshard_t *shard;
 
 	if (parent_id)
 		id = parent_id;
 
-	ck_rlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	ck_runlock(&cdata->lock);
+	shard = shard_by_id(cdata, id);
+	ck_rlock(&shard->lock);
+	HASH_FIND_I64(shard->clients, &id, client);
+	ck_runlock(&shard->lock);
 
 	return !!client;
 }
@@ -1101,7 +1774,7 @@ static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t
 	LOGINFO("Connector adding passthrough client %"PRId64, client->id);
 	client->passthrough = true;
 	JSON_CPACK(val, "{sb}", "result", true);
-	send_client_json(ckp, cdata, client->id, val);
+	send_client_json(ckp, cdata, client->id, val, false);
 	if (!ckp->rmem_warn)
 		set_recvbufsize(ckp, client->fd, 1048576);
 	if (!ckp->wmem_warn)
@@ -1294,15 +1967,43 @@ out:
 	return ret;
 }
 
-static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
+/* Send a client a broadcast message shared with other clients, handing the
+ * reference to bcast to the send. */
+static void send_client_bcast(ckpool_t *ckp, cdata_t *cdata, const int64_t id, bcast_t *bcast)
+{
+	sender_send_t *sender_send;
+	client_instance_t *client;
+
+	client = ref_client_by_id(cdata, id);
+	if (unlikely(!client)) {
+		LOGINFO("Connector failed to find client id %"PRId64" to broadcast to", id);
+		stratifier_drop_id(ckp, id);
+		drop_bcast(bcast);
+		return;
+	}
+	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send->client = client;
+	sender_send->buf = bcast->buf;
+	sender_send->len = bcast->len;
+	sender_send->bcast = bcast;
+	send_sender_send(ckp, cdata, sender_send, true);
+	dec_instance_ref(client);
+}
+
+static void client_message_processor(ckpool_t *ckp, smsg_t *msg)
 {
+	int64_t client_id = msg->client_id;
+	json_t *json_msg = msg->json_msg;
 	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
-	int64_t client_id;
 
-	/* Extract the client id from the json message and remove its entry */
-	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
-	json_object_del(json_msg, "client_id");
+	if (msg->bcast) {
+		send_client_bcast(ckp, cdata, client_id, msg->bcast);
+		free(msg);
+		return;
+	}
+	free(msg);
+
 	/* Put client_id back in for a passthrough subclient, passing its
 	 * upstream client_id instead of the passthrough's. */
 	if (subclient(client_id))
@@ -1317,16 +2018,28 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 			if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
 				client->authorised = true;
 		}
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	}
-	send_client_json(ckp, cdata, client_id, json_msg);
+	send_client_json(ckp, cdata, client_id, json_msg, true);
+}
+
+/* Messages to clients usually come in bursts to the same client, such as a
+ * share result followed by a new diff and work, so the sends of each batch of
+ * queued messages are gathered per client and written with one writev. */
+static void client_message_batch(ckpool_t *ckp, smsg_t **msgs, const int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		client_message_processor(ckp, msgs[i]);
+	flush_client_sends(ckp, ckp->cdata);
 }
 
-void connector_add_message(ckpool_t *ckp, json_t *val)
+void connector_add_message(ckpool_t *ckp, smsg_t *msg)
 {
 	cdata_t *cdata = ckp->cdata;
 
-	ckmsgq_add(cdata->cmpq, val);
+	ckmsgq_add(cdata->cmpq, msg);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1340,57 +2053,106 @@ static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t
 	/* We have a direct connection to the passthrough's connector so we
 	 * can send it any regular commands. */
 	ASPRINTF(&msg, "dropclient=%"PRId64"\n", client_id);
-	send_client(ckp, cdata, id, msg);
+	send_client(ckp, cdata, id, msg, false);
 }
 
 char *connector_stats(void *data, const int runtime)
 {
+	int64_t sends_generated, sends_queued, sends_size, sends_delayed, sends_written, send_writes;
+	int64_t memsize, bufsize, perclient;
 	json_t *val = json_object(), *subval;
+	int objects, generated, bufs, i, j;
 	client_instance_t *client;
-	int objects, generated;
 	cdata_t *cdata = data;
-	sender_send_t *send;
-	int64_t memsize;
 	char *buf;
 
 	/* If called in passthrough mode we log stats instead of the stratifier */
 	if (runtime)
 		json_set_int(val, "runtime", runtime);
 
-	ck_rlock(&cdata->lock);
-	objects = HASH_COUNT(cdata->clients);
-	memsize = SAFE_HASH_OVERHEAD(cdata->clients) + sizeof(client_instance_t) * objects;
-	generated = cdata->clients_generated;
-	ck_runlock(&cdata->lock);
+	objects = memsize = generated = 0;
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
 
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
+		ck_rlock(&shard->lock);
+		objects += HASH_COUNT(shard->clients);
+		memsize += SAFE_HASH_OVERHEAD(shard->clients);
+		generated += shard->clients_generated;
+		ck_runlock(&shard->lock);
+	}
+	memsize += sizeof(client_instance_t) * objects;
+
+	/* Receive buffers of clients with partial messages pending, the memory
+	 * being all the slabs the pools have carved */
+	bufs = bufsize = 0;
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		mutex_lock(&shard->buf_lock);
+		for (j = 0; j < BUF_CLASSES; j++)
+			bufs += shard->chunks_used[j];
+		bufs += shard->large_bufs;
+		bufsize += (int64_t)shard->buf_slabs * BUF_SLAB_SIZE + shard->large_bufs_size;
+		mutex_unlock(&shard->buf_lock);
+	}
+	memsize += bufsize;
+	perclient = objects ? memsize / objects : 0;
+
+	JSON_CPACK(subval, "{si,sI,si,sI}", "count", objects, "memory", memsize, "generated", generated,
+		   "perclient", perclient);
 	json_set_object(val, "clients", subval);
 
-	ck_rlock(&cdata->lock);
-	DL_COUNT2(cdata->dead_clients, client, objects, dead_next);
-	generated = cdata->dead_generated;
-	ck_runlock(&cdata->lock);
+	JSON_CPACK(subval, "{si,sI}", "count", bufs, "memory", bufsize);
+	json_set_object(val, "buffers", subval);
+
+	objects = generated = 0;
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+		int dead;
+
+		ck_rlock(&shard->lock);
+		DL_COUNT2(shard->dead_clients, client, dead, dead_next);
+		objects += dead;
+		generated += shard->dead_generated;
+		ck_runlock(&shard->lock);
+	}
 
 	memsize = objects * sizeof(client_instance_t);
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "dead", subval);
 
 	objects = 0;
-	memsize = 0;
-
-	mutex_lock(&cdata->sender_lock);
-	DL_FOREACH(cdata->sender_sends, send) {
-		objects++;
-		memsize += sizeof(sender_send_t) + send->len + 1;
+	sends_generated = sends_queued = sends_size = sends_delayed = 0;
+	sends_written = send_writes = 0;
+
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+		int blocked;
+
+		ck_rlock(&shard->lock);
+		DL_COUNT2(shard->blocked_clients, client, blocked, blocked_next);
+		ck_runlock(&shard->lock);
+		objects += blocked;
+		sends_generated += __atomic_load_n(&shard->sends_generated, __ATOMIC_RELAXED);
+		sends_queued += __atomic_load_n(&shard->sends_queued, __ATOMIC_RELAXED);
+		sends_size += __atomic_load_n(&shard->sends_size, __ATOMIC_RELAXED);
+		sends_delayed += __atomic_load_n(&shard->sends_delayed, __ATOMIC_RELAXED);
+		sends_written += __atomic_load_n(&shard->sends_written, __ATOMIC_RELAXED);
+		send_writes += __atomic_load_n(&shard->send_writes, __ATOMIC_RELAXED);
 	}
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
+	memsize = sends_queued * sizeof(sender_send_t) + sends_size;
+	JSON_CPACK(subval, "{sI,sI,sI}", "count", sends_queued, "memory", memsize, "generated", sends_generated);
 	json_set_object(val, "sends", subval);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
-	mutex_unlock(&cdata->sender_lock);
-
+	/* Clients with sends waiting on EPOLLOUT */
+	JSON_CPACK(subval, "{si,sI,sI}", "count", objects, "memory", memsize, "generated", sends_delayed);
 	json_set_object(val, "delays", subval);
 
+	/* Write syscalls saved by coalescing sends with writev */
+	JSON_CPACK(subval, "{sI,sI,sI}", "count", send_writes, "sends", sends_written,
+		   "saved", sends_written - send_writes);
+	json_set_object(val, "writes", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1449,8 +2211,18 @@ retry:
 	 * so look for them first. */
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
+		smsg_t *msg;
 
-		ckmsgq_add(cdata->cmpq, val);
+		if (unlikely(!val)) {
+			LOGWARNING("Connector failed to parse json message: %s", buf);
+			goto retry;
+		}
+		/* Extract the client id from the json message and remove its entry */
+		msg = ckzalloc(sizeof(smsg_t));
+		msg->json_msg = val;
+		msg->client_id = json_integer_value(json_object_get(val, "client_id"));
+		json_object_del(val, "client_id");
+		ckmsgq_add(cdata->cmpq, msg);
 	} else if (cmdmatch(buf, "dropclient")) {
 		client_instance_t *client;
 
@@ -1470,7 +2242,7 @@ retry:
 			goto retry;
 		}
 		ret = invalidate_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 		if (ret >= 0)
 			LOGINFO("Connector dropped client id: %"PRId64, client_id);
 	} else if (cmdmatch(buf, "testclient")) {
@@ -1516,7 +2288,7 @@ retry:
 			goto retry;
 		}
 		passthrough_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		dec_instance_ref(client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
@@ -1528,14 +2300,107 @@ retry:
 	goto retry;
 }
 
+static bool reuseport_socket(const int sockd)
+{
+	socklen_t optlen;
+	int on = 0;
+
+	optlen = sizeof(on);
+	if (getsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, &optlen) < 0)
+		return false;
+	return on;
+}
+
+/* Open another listening socket bound to the same address as sockd */
+static int reuseport_listener(const int sockd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	const int on = 1;
+	int fd;
+
+	addrlen = sizeof(addr);
+	if (getsockname(sockd, (struct sockaddr *)&addr, &addrlen) < 0)
+		return -1;
+	fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0 || listen(fd, 8192) < 0) {
+		Close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Give a shard its own listening sockets for each serverurl in listeners
+ * mode, shard 0 using the original ones. */
+static bool shard_listen(cdata_t *cdata, cshard_t *shard)
+{
+	ckpool_t *ckp = cdata->ckp;
+	int i;
+
+	shard->serverfd = ckalloc(sizeof(int) * ckp->serverurls);
+	for (i = 0; i < ckp->serverurls; i++) {
+		struct epoll_event event;
+		int sockd;
+
+		if (shard->id)
+			sockd = reuseport_listener(cdata->serverfd[i]);
+		else
+			sockd = cdata->serverfd[i];
+		if (sockd < 0) {
+			LOGEMERG("FATAL: Failed to open listener %d for %s", shard->id,
+				 ckp->serverurl[i]);
+			return false;
+		}
+		shard->serverfd[i] = sockd;
+		/* The shard's io_uring accepts on them once it starts */
+		if (shard->ring)
+			continue;
+		event.data.u64 = i;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, sockd, &event) < 0) {
+			LOGEMERG("FATAL: Failed to add listener %d for %s to epoll", shard->id,
+				 ckp->serverurl[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Give every shard its own io_uring, or none of them if any fails so that
+ * all clients are serviced the same way */
+static bool shards_uring(cdata_t *cdata)
+{
+	int i, j;
+
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		shard->ring = uring_init(URING_ENTRIES, URING_BUFS, MAX_MSGSIZE);
+		if (!shard->ring) {
+			LOGWARNING("Failed to set up io_uring for connector shard %d, using epoll", i);
+			for (j = 0; j < i; j++) {
+				uring_free(cdata->shards[j].ring);
+				cdata->shards[j].ring = NULL;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
 void *connector(void *arg)
 {
 	proc_instance_t *pi = (proc_instance_t *)arg;
 	cdata_t *cdata = ckzalloc(sizeof(cdata_t));
 	char newurl[INET6_ADDRSTRLEN], newport[8];
-	int threads, sockd, i, tries = 0, ret;
+	int sockd, i, tries = 0, ret;
 	ckpool_t *ckp = pi->ckp;
 	const int on = 1;
+	int64_t first_id;
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s connector starting", ckp->name);
@@ -1555,6 +2420,8 @@ void *connector(void *arg)
 			goto out;
 		}
 		setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (ckp->listeners > 1)
+			setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 		memset(&serv_addr, 0, sizeof(serv_addr));
 		serv_addr.sin_family = AF_INET;
 		serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -1609,11 +2476,16 @@ void *connector(void *arg)
 					Close(sockd);
 				}
 			}
+			if (ckp->listeners > 1 && sockd > 0 && !reuseport_socket(sockd)) {
+				LOGWARNING("Handed over socket %s:%s does not have SO_REUSEPORT for listeners, creating new socket",
+					   newurl, newport);
+				Close(sockd);
+			}
 
 			do {
 				if (sockd > 0)
 					break;
-				sockd = bind_socket(newurl, newport);
+				sockd = bind_socket(newurl, newport, ckp->listeners > 1);
 				if (sockd > 0)
 					break;
 				LOGWARNING("Connector failed to bind to socket, retrying in 5s");
@@ -1636,7 +2508,8 @@ void *connector(void *arg)
 	if (tries)
 		LOGWARNING("Connector successfully bound to socket");
 
-	cdata->cmpq = create_ckmsgq(ckp, "cmpq", &client_message_processor);
+	cdata->cmpq = create_batch_ckmsgqs(ckp, "cmpq", &client_message_batch, 1, CMPQ_BATCH,
+					   false);
 
 	if (ckp->remote && !setup_upstream(ckp, cdata))
 		goto out;
@@ -1644,15 +2517,52 @@ void *connector(void *arg)
 	cklock_init(&cdata->lock);
 	cdata->pi = pi;
 	cdata->nfds = 0;
-	/* Set the client id to the highest serverurl count to distinguish
-	 * them from the server fds in epoll. */
-	cdata->client_ids = ckp->serverurls;
-	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
-	create_pthread(&cdata->pth_sender, sender, cdata);
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+	if (ckp->listeners > 1)
+		cdata->nshards = ckp->listeners;
+	else
+		cdata->nshards = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+	cdata->shards = ckzalloc(sizeof(cshard_t) * cdata->nshards);
+	/* Start the client ids above the highest serverurl count to
+	 * distinguish them from the server fds in epoll, rounded up so each
+	 * shard's ids are its own id modulo the number of shards. */
+	first_id = (ckp->serverurls + cdata->nshards - 1) / cdata->nshards * cdata->nshards;
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+		shard->cdata = cdata;
+		shard->id = i;
+		shard->client_ids = first_id + i;
+		cklock_init(&shard->lock);
+		mutex_init(&shard->buf_lock);
+		shard->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (shard->epfd < 0) {
+			LOGEMERG("FATAL: Failed to create epoll for connector shard %d", i);
+			goto out;
+		}
+	}
+	if (ckp->iouring && !shards_uring(cdata))
+		ckp->iouring = false;
+	for (i = 0; ckp->listeners > 1 && i < cdata->nshards; i++) {
+		if (!shard_listen(cdata, &cdata->shards[i]))
+			goto out;
+	}
+	for (i = 0; i < cdata->nshards; i++) {
+		cshard_t *shard = &cdata->shards[i];
+
+#ifdef USE_IO_URING
+		if (shard->ring) {
+			create_pthread(&shard->pth_receiver, uring_shard_receiver, shard);
+			continue;
+		}
+#endif
+		create_pthread(&shard->pth_receiver, shard_receiver, shard);
+	}
+	if (ckp->iouring)
+		LOGWARNING("Connector servicing clients with io_uring");
+	if (ckp->listeners > 1)
+		LOGWARNING("Connector listening with %d SO_REUSEPORT listeners", cdata->nshards);
+	else
+		create_pthread(&cdata->pth_receiver, receiver, cdata);
 	cdata->start_time = time(NULL);
 
 	ckp->connector_ready = true;
@@ -10,9 +10,33 @@
 #ifndef CONNECTOR_H
 #define CONNECTOR_H
 
+/* A message serialised once and shared by all the clients it is broadcast to */
+struct bcast {
+	char *buf;
+	int len;
+
+	/* Updated atomically */
+	int refs;
+};
+
+typedef struct bcast bcast_t;
+
+/* Stratum json messages with their associated client id, or a reference to a
+ * broadcast message instead of json */
+struct smsg {
+	json_t *json_msg;
+	bcast_t *bcast;
+	int64_t client_id;
+};
+
+typedef struct smsg smsg_t;
+
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
-void connector_add_message(ckpool_t *ckp, json_t *val);
+bcast_t *create_bcast(const json_t *val);
+void ref_bcast(bcast_t *bcast);
+void drop_bcast(bcast_t *bcast);
+void connector_add_message(ckpool_t *ckp, smsg_t *msg);
 char *connector_stats(void *data, const int runtime);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
 void *connector(void *arg);
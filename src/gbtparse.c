@@ -0,0 +1,323 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libckpool.h"
+#include "gbtparse.h"
+
+static void *gbt_realloc(void *ptr, const size_t len)
+{
+	int backoff = 1;
+	void *newptr;
+
+	while (42) {
+		newptr = realloc(ptr, len);
+		if (likely(newptr))
+			break;
+		if (backoff == 1)
+			fprintf(stderr, "Failed to realloc %d in gbtparse, retrying\n", (int)len);
+		cksleep_ms(backoff);
+		backoff <<= 1;
+	}
+	return newptr;
+}
+
+void gbt_txns_init(gbt_txns_t *txns, const int headroom, const int tailroom)
+{
+	memset(txns, 0, sizeof(gbt_txns_t));
+	txns->headroom = headroom;
+	txns->tailroom = tailroom;
+	txns->dataofs = ckzalloc(sizeof(int));
+}
+
+void gbt_txns_clear(gbt_txns_t *txns)
+{
+	free(txns->txids);
+	free(txns->hashes);
+	free(txns->dataofs);
+	free(txns->buf);
+	memset(txns, 0, sizeof(gbt_txns_t));
+}
+
+/* Make room for datasize bytes of data in the arena */
+static void reserve_data(gbt_txns_t *txns, const int datasize)
+{
+	if (datasize <= txns->datasize && txns->buf)
+		return;
+	txns->buf = gbt_realloc(txns->buf, txns->headroom + datasize + txns->tailroom);
+	txns->data = txns->buf + txns->headroom;
+	txns->datasize = datasize;
+}
+
+/* Decode 64 hex characters that need not be null terminated */
+static bool hash_hex2bin(uchar *bin, const char *hex)
+{
+	int i, nibble1, nibble2;
+
+	for (i = 0; i < 32; i++) {
+		nibble1 = hex2bin_tbl[(uchar)hex[i * 2]];
+		nibble2 = hex2bin_tbl[(uchar)hex[i * 2 + 1]];
+		if (unlikely(nibble1 < 0 || nibble2 < 0))
+			return false;
+		bin[i] = (nibble1 << 4) | nibble2;
+	}
+	return true;
+}
+
+bool gbt_txns_add(gbt_txns_t *txns, const char *txid, const char *hash, const char *data,
+		  const int len)
+{
+	int i = txns->count;
+
+	if (!txid)
+		txid = hash;
+	if (!hash)
+		hash = txid;
+	if (unlikely(!txid || !data))
+		return false;
+
+	if (i == txns->size) {
+		txns->size = txns->size ? txns->size * 2 : 256;
+		txns->txids = gbt_realloc(txns->txids, txns->size * 32);
+		txns->hashes = gbt_realloc(txns->hashes, txns->size * 32);
+		txns->dataofs = gbt_realloc(txns->dataofs, (txns->size + 1) * sizeof(int));
+	}
+	if (unlikely(!hash_hex2bin(txns->txids + i * 32, txid) ||
+		     !hash_hex2bin(txns->hashes + i * 32, hash)))
+		return false;
+	if (txns->datalen + len > txns->datasize || !txns->buf)
+		reserve_data(txns, MAX(txns->datasize * 2, txns->datalen + len));
+	memcpy(txns->data + txns->datalen, data, len);
+	txns->datalen += len;
+	txns->dataofs[++txns->count] = txns->datalen;
+	return true;
+}
+
+static inline const char *skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')
+		p++;
+	return p;
+}
+
+/* Past the end of the string p is on the opening quote of */
+static const char *skip_string(const char *p)
+{
+	for (p++; *p != '"'; p++) {
+		if (unlikely(!*p))
+			return NULL;
+		if (*p == '\\' && !*++p)
+			return NULL;
+	}
+	return p + 1;
+}
+
+/* Past the end of any value without looking inside it */
+static const char *skip_value(const char *p)
+{
+	int depth = 0;
+
+	do {
+		p = skip_ws(p);
+		switch (*p) {
+			case '"':
+				p = skip_string(p);
+				if (unlikely(!p))
+					return NULL;
+				break;
+			case '{':
+			case '[':
+				depth++;
+				p++;
+				break;
+			case '}':
+			case ']':
+				if (unlikely(--depth < 0))
+					return NULL;
+				p++;
+				break;
+			case ',':
+			case ':':
+				if (unlikely(!depth))
+					return NULL;
+				p++;
+				break;
+			case '\0':
+				return NULL;
+			default:
+				while (*p && !strchr(",:]} \n\r\t", *p))
+					p++;
+				break;
+		}
+	} while (depth);
+	return p;
+}
+
+/* Reads the key of an object member p is on, leaving p on its value */
+static const char *member_key(const char **p, int *keylen)
+{
+	const char *key = *p, *end;
+
+	if (unlikely(*key != '"'))
+		return NULL;
+	end = skip_string(key);
+	if (unlikely(!end))
+		return NULL;
+	end = skip_ws(end);
+	if (unlikely(*end != ':'))
+		return NULL;
+	*keylen = end - key - 2;
+	*p = skip_ws(end + 1);
+	return key + 1;
+}
+
+/* Moves past the value of a member to the next one, returning false at the
+ * end of the object or if it is malformed */
+static bool next_member(const char **p, bool *malformed)
+{
+	const char *q = skip_ws(*p);
+
+	if (*q == ',') {
+		*p = skip_ws(q + 1);
+		return true;
+	}
+	*malformed = *q != '}';
+	*p = q + 1;
+	return false;
+}
+
+/* The value of key in the object p is on, NULL if absent or malformed */
+static const char *find_member(const char *p, const char *key)
+{
+	int keylen, len = strlen(key);
+	bool malformed = false;
+	const char *name;
+
+	p = skip_ws(p);
+	if (unlikely(*p++ != '{'))
+		return NULL;
+	p = skip_ws(p);
+	if (*p == '}')
+		return NULL;
+	do {
+		name = member_key(&p, &keylen);
+		if (unlikely(!name))
+			return NULL;
+		if (keylen == len && !memcmp(name, key, len))
+			return p;
+		p = skip_value(p);
+		if (unlikely(!p))
+			return NULL;
+	} while (next_member(&p, &malformed));
+	return NULL;
+}
+
+/* A hex string value p is on, which never has escapes, storing its length */
+static const char *hex_value(const char **p, int *len)
+{
+	const char *start = *p + 1, *end = start;
+
+	if (unlikely(**p != '"'))
+		return NULL;
+	while (*end != '"') {
+		if (unlikely(!*end || *end == '\\'))
+			return NULL;
+		end++;
+	}
+	*len = end - start;
+	*p = end + 1;
+	return start;
+}
+
+/* Decodes one transaction object p is on, leaving p past its end */
+static bool parse_txn(const char **p, gbt_txns_t *txns)
+{
+	const char *txid = NULL, *hash = NULL, *data = NULL, *name, *val;
+	int keylen, len, datalen = 0;
+	bool malformed = false;
+
+	if (unlikely(**p != '{'))
+		return false;
+	*p = skip_ws(*p + 1);
+	if (**p == '}')
+		return false;
+	do {
+		name = member_key(p, &keylen);
+		if (unlikely(!name))
+			return false;
+		if (keylen == 4 && !memcmp(name, "data", 4)) {
+			data = hex_value(p, &datalen);
+			if (unlikely(!data))
+				return false;
+		} else if (keylen == 4 && (!memcmp(name, "txid", 4) || !memcmp(name, "hash", 4))) {
+			val = hex_value(p, &len);
+			if (unlikely(!val || len != 64))
+				return false;
+			if (name[0] == 't')
+				txid = val;
+			else
+				hash = val;
+		} else {
+			*p = skip_value(*p);
+			if (unlikely(!*p))
+				return false;
+		}
+	} while (next_member(p, &malformed));
+	if (unlikely(malformed))
+		return false;
+	return gbt_txns_add(txns, txid, hash, data, datalen);
+}
+
+bool gbt_parse_txns(char *json, const int len, gbt_txns_t *txns)
+{
+	const char *result, *p;
+	char *start;
+
+	result = find_member(json, "result");
+	if (unlikely(!result))
+		return false;
+	p = find_member(result, "transactions");
+	if (!p)
+		return true;
+	if (unlikely(*p != '['))
+		return false;
+	start = (char *)p;
+
+	/* No more data than the whole response can be in the transactions so
+	 * reserve that to never move the arena as it is filled */
+	reserve_data(txns, len);
+	p = skip_ws(p + 1);
+	if (*p != ']') {
+		while (42) {
+			if (unlikely(!parse_txn(&p, txns)))
+				return false;
+			p = skip_ws(p);
+			if (*p != ',')
+				break;
+			p = skip_ws(p + 1);
+		}
+		if (unlikely(*p != ']'))
+			return false;
+	}
+	p++;
+	/* Return the slack of the arena */
+	txns->buf = gbt_realloc(txns->buf, txns->headroom + txns->datalen + txns->tailroom);
+	txns->data = txns->buf + txns->headroom;
+	txns->datasize = txns->datalen;
+
+	/* Leave an empty array in place of the transactions */
+	start[0] = '[';
+	start[1] = ']';
+	memmove(start + 2, p, strlen(p) + 1);
+	return true;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef GBTPARSE_H
+#define GBTPARSE_H
+
+#include "config.h"
+
+#include <stdbool.h>
+
+#include "libckpool.h"
+
+/* The transactions of a block template decoded without building a json tree
+ * of them. Txids and witness hashes are binary in the byte order hex2bin
+ * gives, and the hex data of every transaction is concatenated into one
+ * arena with headroom and tailroom left around it so a block can be built
+ * around the data in place. */
+typedef struct gbt_txns gbt_txns_t;
+
+struct gbt_txns {
+	int count;
+	int size; /* Entries allocated */
+	uchar *txids;
+	uchar *hashes;
+	int *dataofs; /* Of each transaction's data, count + 1 of them */
+
+	char *buf; /* Allocation holding data with its headroom and tailroom */
+	char *data;
+	int datalen;
+	int datasize;
+	int headroom;
+	int tailroom;
+};
+
+void gbt_txns_init(gbt_txns_t *txns, const int headroom, const int tailroom);
+void gbt_txns_clear(gbt_txns_t *txns);
+
+/* Adds a transaction from its hex txid and hash, either of which may be NULL
+ * to use the other for both as pre-segwit templates have no hash. Returns
+ * false if neither is valid hex of a hash. */
+bool gbt_txns_add(gbt_txns_t *txns, const char *txid, const char *hash, const char *data,
+		  const int len);
+
+/* Decodes the transactions of the getblocktemplate response in the json of
+ * len into txns, then cuts them out of the json in place leaving an empty
+ * transactions array so the rest of the template is small to parse. The json
+ * is left untouched when false is returned for a malformed response. */
+bool gbt_parse_txns(char *json, const int len, gbt_txns_t *txns);
+
+#endif /* GBTPARSE_H */
@@ -272,6 +272,11 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 	}
 	si->alive = cs->alive = ret = true;
 	LOGNOTICE("Server alive: %s:%s", cs->url, cs->port);
+	if (!si->blockcs.url) {
+		si->blockcs.url = strdup(cs->url);
+		si->blockcs.port = strdup(cs->port);
+		si->blockcs.auth = strdup(cs->auth);
+	}
 out:
 	/* Close the file handle */
 	close(fd);
@@ -329,6 +334,7 @@ static void kill_server(server_instance_t *si)
 	LOGNOTICE("Killing server");
 	cs = &si->cs;
 	Close(cs->fd);
+	rpc_close(cs);
 	empty_buffer(cs);
 	dealloc(cs->url);
 	dealloc(cs->port);
@@ -345,22 +351,106 @@ static void clear_unix_msg(unix_msg_t **umsg)
 	}
 }
 
-bool generator_submitblock(ckpool_t *ckp, const char *buf)
-{
-	gdata_t *gdata = ckp->gdata;
+/* A solved block being submitted to every bitcoind at once, each on its own
+ * block submission thread and connection, shared by those threads and the
+ * solver waiting on them */
+typedef struct block_submit block_submit_t;
+
+struct block_submit {
+	blockreq_t *req;
+	tv_t solved;
+
+	mutex_t lock;
+	pthread_cond_t cond;
+	int pending; /* Servers yet to respond */
+	int refs;
+	bool accepted;
+};
+
+typedef struct block_msg block_msg_t;
+
+struct block_msg {
 	server_instance_t *si;
-	bool warn = false;
-	connsock_t *cs;
+	block_submit_t *bs;
+};
+
+/* Drops a reference to bs, freeing it with the last */
+static void put_block_submit(block_submit_t *bs, const bool submitted, const bool accepted)
+{
+	int refs;
 
-	while (unlikely(!(si = gdata->current_si))) {
-		if (!warn)
-			LOGWARNING("No live current server in generator_blocksubmit! Resubmitting indefinitely!");
-		warn = true;
-		cksleep_ms(10);
+	mutex_lock(&bs->lock);
+	if (submitted) {
+		bs->pending--;
+		if (accepted)
+			bs->accepted = true;
+		pthread_cond_signal(&bs->cond);
 	}
-	cs = &si->cs;
-	LOGNOTICE("Submitting block data!");
-	return submit_block(cs, buf);
+	refs = --bs->refs;
+	mutex_unlock(&bs->lock);
+
+	if (!refs) {
+		put_blockreq(bs->req);
+		free(bs);
+	}
+}
+
+static void block_submitter(ckpool_t __maybe_unused *ckp, block_msg_t *msg)
+{
+	server_instance_t *si = msg->si;
+	block_submit_t *bs = msg->bs;
+	double latency;
+	tv_t now;
+	bool ret;
+
+	ret = submit_block(&si->blockcs, bs->req->rpc_req);
+	tv_time(&now);
+	latency = tvdiff(&now, &bs->solved) * 1000;
+	si->blocks++;
+	if (ret)
+		si->blocks_accepted++;
+	si->block_last = latency;
+	if (latency > si->block_max)
+		si->block_max = latency;
+	LOGWARNING("Block %s by %s %.3fms after solve", ret ? "accepted" : "rejected",
+		   si->url, latency);
+	put_block_submit(bs, true, ret);
+	free(msg);
+}
+
+/* Submits the block request to every server in parallel, absorbing its
+ * reference, and waits for the first to accept it or all of them to fail. */
+bool generator_submitblock(ckpool_t *ckp, blockreq_t *req, const tv_t *solved)
+{
+	block_submit_t *bs;
+	bool ret;
+	int i;
+
+	bs = ckzalloc(sizeof(block_submit_t));
+	bs->req = req;
+	copy_tv(&bs->solved, solved);
+	mutex_init(&bs->lock);
+	cond_init(&bs->cond);
+	bs->pending = ckp->btcds;
+	bs->refs = ckp->btcds + 1;
+
+	LOGNOTICE("Submitting block data to %d bitcoind%s!", ckp->btcds, ckp->btcds > 1 ? "s" : "");
+	for (i = 0; i < ckp->btcds; i++) {
+		block_msg_t *msg = ckalloc(sizeof(block_msg_t));
+
+		msg->si = ckp->servers[i];
+		msg->bs = bs;
+		ckmsgq_add(msg->si->blockq, msg);
+	}
+
+	mutex_lock(&bs->lock);
+	while (bs->pending && !bs->accepted)
+		cond_wait(&bs->cond, &bs->lock);
+	ret = bs->accepted;
+	mutex_unlock(&bs->lock);
+
+	put_block_submit(bs, false, false);
+	return ret;
 }
 
 void generator_preciousblock(ckpool_t *ckp, const char *hash)
@@ -391,6 +481,30 @@ bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash)
 	return get_blockhash(cs, height, hash);
 }
 
+/* The RPC connection pool and latency stats of each bitcoind, and of the
+ * blocks submitted to it */
+static char *server_stats(ckpool_t *ckp)
+{
+	json_t *val = json_object(), *servers = json_array(), *subval, *blocks;
+	char *s;
+	int i;
+
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
+
+		JSON_CPACK(blocks, "{sI,sI,sf,sf,so}", "submitted", si->blocks,
+			   "accepted", si->blocks_accepted, "last", si->block_last,
+			   "max", si->block_max, "rpc", rpc_stats(&si->blockcs));
+		JSON_CPACK(subval, "{ss,sb,so,so}", "url", si->url, "alive", si->alive,
+			   "rpc", rpc_stats(&si->cs), "blocks", blocks);
+		json_array_append_new(servers, subval);
+	}
+	json_set_object(val, "servers", servers);
+	s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(6));
+	json_decref(val);
+	return s;
+}
+
 static void gen_loop(proc_instance_t *pi)
 {
 	server_instance_t *si = NULL, *old_si;
@@ -493,6 +607,13 @@ retry:
 	} else if (cmdmatch(buf, "ping")) {
 		LOGDEBUG("Generator received ping request");
 		send_unix_msg(umsg->sockd, "pong");
+	} else if (cmdmatch(buf, "stats")) {
+		char *msg;
+
+		LOGDEBUG("Generator received stats request");
+		msg = server_stats(ckp);
+		send_unix_msg(umsg->sockd, msg);
+		free(msg);
 	}
 	goto retry;
 
@@ -861,6 +982,8 @@ static void reconnect_generator(ckpool_t *ckp)
 	send_proc(ckp->generator, "reconnect");
 }
 
+/* Get a block template from the current server, handed straight to the
+ * stratifier already decoded into a workbase it then owns */
 struct genwork *generator_getbase(ckpool_t *ckp)
 {
 	gdata_t *gdata = ckp->gdata;
@@ -3292,6 +3415,10 @@ static void *server_watchdog(void *arg)
 			/* Have we reached the current server? */
 			if (server_alive(ckp, si, true) && !best)
 				best = si;
+			/* Keep a block submission connection open, replacing
+			 * any bitcoind has closed */
+			if (si->blockcs.url)
+				rpc_preconnect(&si->blockcs);
 		}
 		if (best && best != gdata->current_si)
 			send_proc(ckp->generator, "reconnect");
@@ -3303,6 +3430,7 @@ static void *server_watchdog(void *arg)
 static void setup_servers(ckpool_t *ckp)
 {
 	pthread_t pth_watchdog;
+	char qname[20];
 	int i;
 
 	ckp->servers = ckalloc(sizeof(server_instance_t *) * ckp->btcds);
@@ -3319,8 +3447,11 @@ static void setup_servers(ckpool_t *ckp)
 		si->id = i;
 		cs = &si->cs;
 		cs->ckp = ckp;
-		cksem_init(&cs->sem);
-		cksem_post(&cs->sem);
+		rpc_init(cs);
+		si->blockcs.ckp = ckp;
+		rpc_init(&si->blockcs);
+		sprintf(qname, "bsubmit%d", i);
+		si->blockq = create_ckmsgq(ckp, qname, &block_submitter);
 	}
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
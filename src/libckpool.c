@@ -675,7 +675,7 @@ void _close(int *fd, const char *file, const char *func, const int line)
 	}
 }
 
-int bind_socket(char *url, char *port)
+int bind_socket(char *url, char *port, const bool reuseport)
 {
 	struct addrinfo servinfobase, *servinfo, hints, *p;
 	int ret, sockd = -1;
@@ -700,6 +700,8 @@ int bind_socket(char *url, char *port)
 		goto out;
 	}
 	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport)
+		setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 	ret = bind(sockd, p->ai_addr, p->ai_addrlen);
 	if (ret < 0) {
 		LOGWARNING("Failed to bind socket for %s:%s", url, port);
@@ -2056,6 +2058,45 @@ double sane_tdiff(tv_t *end, tv_t *start)
 	return tdiff;
 }
 
+/* Add diff to be accounted for the next time the averages are decayed,
+ * keeping any fraction of it */
+void add_decay(decay_t *decay, const double diff)
+{
+	double old, new;
+
+	__atomic_load(&decay->diff, &old, __ATOMIC_RELAXED);
+	do {
+		new = old + diff;
+	} while (!__atomic_compare_exchange(&decay->diff, &old, &new, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Whether the averages were last decayed at least interval seconds ago */
+bool decay_due(decay_t *decay, tv_t *now_t, const double interval)
+{
+	return tvdiff(now_t, &decay->last) >= interval;
+}
+
+/* Take the diff accumulated since the averages were last decayed and the time
+ * it was accumulated over. Returns false if another thread is already
+ * decaying them, in which case their current values are as good as any. */
+bool begin_decay(decay_t *decay, tv_t *now_t, double *diff, double *tdiff)
+{
+	double none = 0;
+
+	if (__atomic_exchange_n(&decay->busy, 1, __ATOMIC_ACQUIRE))
+		return false;
+	*tdiff = sane_tdiff(now_t, &decay->last);
+	copy_tv(&decay->last, now_t);
+	__atomic_exchange(&decay->diff, &none, diff, __ATOMIC_RELAXED);
+	return true;
+}
+
+void end_decay(decay_t *decay)
+{
+	__atomic_store_n(&decay->busy, 0, __ATOMIC_RELEASE);
+}
+
 /* Convert a double value into a truncated string for displaying with its
  * associated suitable for Mega, Giga etc. Buf array needs to be long enough */
 void suffix_string(double val, char *buf, size_t bufsiz, int sigdigits)
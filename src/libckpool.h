@@ -339,6 +339,17 @@ struct unixsock {
 
 typedef struct unixsock unixsock_t;
 
+/* Diff accumulated towards a set of rolling hashrate averages. Share threads
+ * only add to diff atomically, and the exp() heavy decaying of the averages
+ * is done lazily whenever they are read, by one thread at a time. */
+struct decay {
+	double diff;
+	tv_t last; /* Time the averages were last decayed */
+	int busy;
+};
+
+typedef struct decay decay_t;
+
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line);
 #define json_check(VAL, ERR) _json_check(VAL, ERR,  __FILE__, __func__, __LINE__)
 
@@ -512,7 +523,7 @@ void block_socket(int fd);
 void _close(int *fd, const char *file, const char *func, const int line);
 #define _Close(FD) _close(FD, __FILE__, __func__, __LINE__)
 #define Close(FD) _close(&FD, __FILE__, __func__, __LINE__)
-int bind_socket(char *url, char *port);
+int bind_socket(char *url, char *port, const bool reuseport);
 int connect_socket(char *url, char *port);
 int round_trip(char *url);
 int write_socket(int fd, const void *buf, size_t nbyte);
@@ -602,6 +613,10 @@ double tvdiff(tv_t *end, tv_t *start);
 
 void decay_time(double *f, double fadd, double fsecs, double interval);
 double sane_tdiff(tv_t *end, tv_t *start);
+void add_decay(decay_t *decay, const double diff);
+bool decay_due(decay_t *decay, tv_t *now_t, const double interval);
+bool begin_decay(decay_t *decay, tv_t *now_t, double *diff, double *tdiff);
+void end_decay(decay_t *decay);
 void suffix_string(double val, char *buf, size_t bufsiz, int sigdigits);
 
 double le256todouble(const uchar *target);
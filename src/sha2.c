@@ -34,6 +34,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -85,45 +86,40 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-#ifdef USE_AVX2
-extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+/* The 64 rounds of a block given its message schedule */
+static inline void sha256_rounds(uint32_t *h, const uint32_t *w)
 {
-	sha256_rorx(message, ctx->h, block_nb);
-}
-#elif defined(USE_AVX1)
-extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
+    uint32_t wv[8];
+    uint32_t t1, t2;
+    int j;
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_avx(message, ctx->h, block_nb);
-}
-#elif defined(USE_SSE4)
-extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
+    for (j = 0; j < 8; j++) {
+        wv[j] = h[j];
+    }
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_sse4(message, ctx->h, block_nb);
-}
-#elif defined(USE_ARM_SHA2)
-extern void sha256_arm_sha2(uint32_t[8], const unsigned char *, uint64_t);
+    for (j = 0; j < 64; j++) {
+        t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
+            + sha256_k[j] + w[j];
+        t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-        sha256_arm_sha2(ctx->h, message, block_nb);
+    for (j = 0; j < 8; j++) {
+        h[j] += wv[j];
+    }
 }
-#else
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+
+static void sha256_transf_generic(uint32_t *h, const unsigned char *message,
+                                  uint64_t block_nb)
 {
     uint32_t w[64];
-    uint32_t wv[8];
-    uint32_t t1, t2;
     const unsigned char *sub_block;
     int i;
 
@@ -140,30 +136,228 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
             SHA256_SCR(j);
         }
 
-        for (j = 0; j < 8; j++) {
-            wv[j] = ctx->h[j];
-        }
+        sha256_rounds(h, w);
+    }
+}
 
-        for (j = 0; j < 64; j++) {
-            t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
-                + sha256_k[j] + w[j];
-            t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
-            wv[7] = wv[6];
-            wv[6] = wv[5];
-            wv[5] = wv[4];
-            wv[4] = wv[3] + t1;
-            wv[3] = wv[2];
-            wv[2] = wv[1];
-            wv[1] = wv[0];
-            wv[0] = t1 + t2;
-        }
+static bool cpu_generic(void)
+{
+    return true;
+}
 
-        for (j = 0; j < 8; j++) {
-            ctx->h[j] += wv[j];
+#if defined(USE_AVX2) || defined(USE_AVX1) || defined(USE_SSE4) || defined(USE_X86_SHANI) || \
+    defined(USE_AVX2_8WAY)
+#include <cpuid.h>
+
+static bool cpuid_bit(unsigned int leaf, int reg, unsigned int bit)
+{
+    unsigned int regs[4] = {0, 0, 0, 0};
+
+    if (!__get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3]))
+        return false;
+    return !!(regs[reg] & (1u << bit));
+}
+
+#define CPUID_EBX 1
+#define CPUID_ECX 2
+#endif
+
+#if defined(USE_AVX2) || defined(USE_AVX1) || defined(USE_AVX2_8WAY)
+/* The OS must also save the AVX register state across context switches */
+static bool cpu_avx_os(void)
+{
+    unsigned int eax, edx;
+
+    if (!cpuid_bit(1, CPUID_ECX, 27) || !cpuid_bit(1, CPUID_ECX, 28))
+        return false;
+    __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return (eax & 6) == 6;
+}
+#endif
+
+#ifdef USE_AVX2
+extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
+
+static void sha256_transf_avx2(uint32_t *h, const unsigned char *message,
+                               uint64_t block_nb)
+{
+    sha256_rorx(message, h, block_nb);
+}
+
+static bool cpu_avx2(void)
+{
+    /* AVX2 and BMI2 for rorx */
+    return cpu_avx_os() && cpuid_bit(7, CPUID_EBX, 5) && cpuid_bit(7, CPUID_EBX, 8);
+}
+#endif
+
+#ifdef USE_AVX1
+extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
+
+static void sha256_transf_avx1(uint32_t *h, const unsigned char *message,
+                               uint64_t block_nb)
+{
+    sha256_avx(message, h, block_nb);
+}
+
+static bool cpu_avx1(void)
+{
+    return cpu_avx_os();
+}
+#endif
+
+#ifdef USE_SSE4
+extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
+
+static void sha256_transf_sse4(uint32_t *h, const unsigned char *message,
+                               uint64_t block_nb)
+{
+    sha256_sse4(message, h, block_nb);
+}
+
+static bool cpu_sse4(void)
+{
+    /* SSSE3 and SSE4.1 */
+    return cpuid_bit(1, CPUID_ECX, 9) && cpuid_bit(1, CPUID_ECX, 19);
+}
+#endif
+
+#ifdef USE_X86_SHANI
+extern void sha256_x86_shani(uint32_t *, const unsigned char *, uint64_t);
+
+static bool cpu_x86_shani(void)
+{
+    /* SHA extensions plus the SSSE3/SSE4.1 shuffles used alongside them */
+    return cpuid_bit(7, CPUID_EBX, 29) && cpuid_bit(1, CPUID_ECX, 9) &&
+        cpuid_bit(1, CPUID_ECX, 19);
+}
+#endif
+
+#ifdef USE_AVX2_8WAY
+extern void sha256_avx2_8way(uint32_t[8][8], const unsigned char *const[8]);
+
+static bool cpu_avx2_8way(void)
+{
+    return cpu_avx_os() && cpuid_bit(7, CPUID_EBX, 5);
+}
+#endif
+
+#ifdef USE_ARM_SHA2
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+extern void sha256_arm_sha2(uint32_t[8], const unsigned char *, uint64_t);
+
+static bool cpu_arm_sha2(void)
+{
+    return !!(getauxval(AT_HWCAP) & HWCAP_SHA2);
+}
+#endif
+
+typedef void (*sha256_transf_fn)(uint32_t *, const unsigned char *, uint64_t);
+
+struct sha256_backend {
+    const char *name;
+    sha256_transf_fn transf;
+    bool (*supported)(void);
+    bool hw;
+};
+
+/* Backends compiled in, fastest first */
+static const struct sha256_backend sha256_backends[] = {
+#ifdef USE_X86_SHANI
+    { "shani", sha256_x86_shani, cpu_x86_shani, true },
+#endif
+#ifdef USE_AVX2
+    { "avx2", sha256_transf_avx2, cpu_avx2, false },
+#endif
+#ifdef USE_AVX1
+    { "avx1", sha256_transf_avx1, cpu_avx1, false },
+#endif
+#ifdef USE_SSE4
+    { "sse4", sha256_transf_sse4, cpu_sse4, false },
+#endif
+#ifdef USE_ARM_SHA2
+    { "armv8", sha256_arm_sha2, cpu_arm_sha2, true },
+#endif
+    { "generic", sha256_transf_generic, cpu_generic, false },
+};
+
+#define SHA256_BACKENDS (int)(sizeof(sha256_backends) / sizeof(sha256_backends[0]))
+
+static void sha256_transf_select(uint32_t *h, const unsigned char *message,
+                                 uint64_t block_nb);
+
+/* Starts as a stub that picks the fastest backend this CPU supports on first
+ * use and replaces itself with it. */
+static sha256_transf_fn sha256_transf_ptr = sha256_transf_select;
+static const char *sha256_transf_name;
+/* Whether the backend in use has dedicated sha256 instructions, making it
+ * faster per message than hashing several at once with the AVX2 transform */
+static bool sha256_transf_hw;
+
+static void sha256_select_best(void)
+{
+    int i;
+
+    for (i = 0; i < SHA256_BACKENDS; i++) {
+        if (sha256_backends[i].supported()) {
+            sha256_transf_name = sha256_backends[i].name;
+            sha256_transf_ptr = sha256_backends[i].transf;
+            sha256_transf_hw = sha256_backends[i].hw;
+            return;
         }
     }
 }
-#endif
+
+static void sha256_transf_select(uint32_t *h, const unsigned char *message,
+                                 uint64_t block_nb)
+{
+    sha256_select_best();
+    sha256_transf_ptr(h, message, block_nb);
+}
+
+static inline void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                                 unsigned int block_nb)
+{
+    sha256_transf_ptr(ctx->h, message, block_nb);
+}
+
+const char *sha256_impl(void)
+{
+    if (!sha256_transf_name)
+        sha256_select_best();
+    return sha256_transf_name;
+}
+
+const char *sha256_impl_available(int index)
+{
+    int i;
+
+    for (i = 0; i < SHA256_BACKENDS; i++) {
+        if (!sha256_backends[i].supported())
+            continue;
+        if (!index--)
+            return sha256_backends[i].name;
+    }
+    return NULL;
+}
+
+bool sha256_select_impl(const char *name)
+{
+    int i;
+
+    for (i = 0; i < SHA256_BACKENDS; i++) {
+        if (strcmp(sha256_backends[i].name, name) || !sha256_backends[i].supported())
+            continue;
+        sha256_transf_name = sha256_backends[i].name;
+        sha256_transf_ptr = sha256_backends[i].transf;
+        sha256_transf_hw = sha256_backends[i].hw;
+        return true;
+    }
+    return false;
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -218,6 +412,255 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
     ctx->tot_len += (block_nb + 1) << 6;
 }
 
+/* Padding blocks for the fixed length messages hashed by sha256d_64 and
+ * sha256d_80, and for the 32 byte digest hashed a second time by both. */
+static const unsigned char sha256_pad64[64] = {
+    [0] = 0x80, [62] = 0x02, [63] = 0x00	/* 512 bits */
+};
+
+static const unsigned char sha256_pad80[48] = {
+    [0] = 0x80, [46] = 0x02, [47] = 0x80	/* 640 bits */
+};
+
+static const unsigned char sha256_pad32[32] = {
+    [0] = 0x80, [30] = 0x01, [31] = 0x00	/* 256 bits */
+};
+
+/* Message schedule of sha256_pad64 for the generic backend */
+static const uint32_t sha256_pad64_w[64] =
+            {0x80000000, 0x00000000, 0x00000000, 0x00000000,
+             0x00000000, 0x00000000, 0x00000000, 0x00000000,
+             0x00000000, 0x00000000, 0x00000000, 0x00000000,
+             0x00000000, 0x00000000, 0x00000000, 0x00000200,
+             0x80000000, 0x01400000, 0x00205000, 0x00005088,
+             0x22000800, 0x22550014, 0x05089742, 0xa0000020,
+             0x5a880000, 0x005c9400, 0x0016d49d, 0xfa801f00,
+             0xd33225d0, 0x11675959, 0xf6e6bfda, 0xb30c1549,
+             0x08b2b050, 0x9d7c4c27, 0x0ce2a393, 0x88e6e1ea,
+             0xa52b4335, 0x67a16f49, 0xd732016f, 0x4eeb2e91,
+             0x5dbf55e5, 0x8eee2335, 0xe2bc5ec2, 0xa83f4394,
+             0x45ad78f7, 0x36f3d0cd, 0xd99c05e8, 0xb0511dc7,
+             0x69bc7ac4, 0xbd11375b, 0xe3ba71e5, 0x3b209ff2,
+             0x18feee17, 0xe25ad9e7, 0x13375046, 0x0515089d,
+             0x4f0d0f04, 0x2627484e, 0x310128d2, 0xc668b434,
+             0x420841cc, 0x62d311b8, 0xe59ba771, 0x85a7a484};
+
+/* Hash the 32 byte digest in state h again into digest */
+static inline void sha256d_second(const uint32_t *h, unsigned char *digest)
+{
+    unsigned char block[64];
+    uint32_t h2[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        UNPACK32(h[i], &block[i << 2]);
+    }
+    memcpy(block + 32, sha256_pad32, 32);
+    memcpy(h2, sha256_h0, sizeof(h2));
+    sha256_transf_ptr(h2, block, 1);
+
+    for (i = 0; i < 8; i++) {
+        UNPACK32(h2[i], &digest[i << 2]);
+    }
+}
+
+/* Double sha256 of a 64 byte message such as a merkle node. Message and
+ * digest may overlap. */
+void sha256d_64(const unsigned char *message, unsigned char *digest)
+{
+    unsigned char blocks[128];
+    uint32_t h[8];
+
+    memcpy(h, sha256_h0, sizeof(h));
+    if (sha256_transf_ptr == sha256_transf_generic) {
+        sha256_transf_generic(h, message, 1);
+        sha256_rounds(h, sha256_pad64_w);
+    } else {
+        /* Both blocks in one call saves reloading the backend's state */
+        memcpy(blocks, message, 64);
+        memcpy(blocks + 64, sha256_pad64, 64);
+        sha256_transf_ptr(h, blocks, 2);
+    }
+    sha256d_second(h, digest);
+}
+
+/* Double sha256 of an 80 byte block header. Message and digest may overlap. */
+void sha256d_80(const unsigned char *message, unsigned char *digest)
+{
+    unsigned char blocks[128];
+    uint32_t h[8];
+
+    memcpy(h, sha256_h0, sizeof(h));
+    memcpy(blocks, message, 80);
+    memcpy(blocks + 80, sha256_pad80, 48);
+    sha256_transf_ptr(h, blocks, 2);
+    sha256d_second(h, digest);
+}
+
+void sha256_midstate_final(const uint32_t *midstate, const unsigned char *blocks,
+                           unsigned int block_nb, unsigned char *digest)
+{
+    uint32_t h[8];
+    int i;
+
+    memcpy(h, midstate, sizeof(h));
+    sha256_transf_ptr(h, blocks, block_nb);
+
+    for (i = 0 ; i < 8; i++) {
+        UNPACK32(h[i], &digest[i << 2]);
+    }
+}
+
+int sha256_lanes(void)
+{
+#ifdef USE_AVX2_8WAY
+    static int avx2_8way = -1;
+
+    if (avx2_8way < 0)
+        avx2_8way = cpu_avx2_8way();
+    if (sha256_transf_ptr == sha256_transf_select)
+        sha256_select_best();
+    if (avx2_8way && !sha256_transf_hw)
+        return SHA256_LANES;
+#endif
+    return 1;
+}
+
+#ifdef USE_AVX2_8WAY
+/* Double sha256 of up to SHA256_LANES messages in lockstep, one per lane.
+ * Lanes with fewer blocks than the longest are fed a dummy block once done,
+ * their state having been set aside, as are the unused lanes. */
+static void sha256d_8way(const uint32_t *const midstate[], const unsigned char *const blocks[],
+                         const int block_nb[], unsigned char *const digest[], int lanes)
+{
+    static const unsigned char dummy[64];
+    unsigned char second[SHA256_LANES][64];
+    uint32_t state[SHA256_LANES][8], done[SHA256_LANES][8];
+    const unsigned char *ptr[SHA256_LANES];
+    int i, j, max = 0;
+
+    for (i = 0; i < SHA256_LANES; i++) {
+        if (i < lanes && midstate && midstate[i])
+            memcpy(state[i], midstate[i], sizeof(state[i]));
+        else
+            memcpy(state[i], sha256_h0, sizeof(state[i]));
+        if (i < lanes && block_nb[i] > max)
+            max = block_nb[i];
+    }
+    for (j = 0; j < max; j++) {
+        for (i = 0; i < SHA256_LANES; i++)
+            ptr[i] = i < lanes && j < block_nb[i] ? blocks[i] + (j << 6) : dummy;
+        sha256_avx2_8way(state, ptr);
+        for (i = 0; i < lanes; i++) {
+            if (j == block_nb[i] - 1)
+                memcpy(done[i], state[i], sizeof(done[i]));
+        }
+    }
+
+    for (i = 0; i < SHA256_LANES; i++) {
+        if (i < lanes) {
+            for (j = 0; j < 8; j++) {
+                UNPACK32(done[i][j], &second[i][j << 2]);
+            }
+        } else
+            memset(second[i], 0, 32);
+        memcpy(second[i] + 32, sha256_pad32, 32);
+        memcpy(state[i], sha256_h0, sizeof(state[i]));
+        ptr[i] = second[i];
+    }
+    sha256_avx2_8way(state, ptr);
+
+    for (i = 0; i < lanes; i++) {
+        for (j = 0; j < 8; j++) {
+            UNPACK32(state[i][j], &digest[i][j << 2]);
+        }
+    }
+}
+#endif
+
+void sha256d_lanes(const uint32_t *const midstate[], const unsigned char *const blocks[],
+                   const int block_nb[], unsigned char *const digest[], int count)
+{
+    uint32_t h[8];
+    int i;
+
+#ifdef USE_AVX2_8WAY
+    if (count > 1 && sha256_lanes() > 1) {
+        for (i = 0; i < count; i += SHA256_LANES) {
+            int lanes = count - i < SHA256_LANES ? count - i : SHA256_LANES;
+
+            sha256d_8way(midstate ? midstate + i : NULL, blocks + i, block_nb + i,
+                         digest + i, lanes);
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++) {
+        if (midstate && midstate[i])
+            memcpy(h, midstate[i], sizeof(h));
+        else
+            memcpy(h, sha256_h0, sizeof(h));
+        sha256_transf_ptr(h, blocks[i], block_nb[i]);
+        sha256d_second(h, digest[i]);
+    }
+}
+
+void sha256d_64_lanes(const unsigned char *const message[], unsigned char *const digest[],
+                      int count)
+{
+    int i;
+
+#ifdef USE_AVX2_8WAY
+    if (count > 1 && sha256_lanes() > 1) {
+        static const int block_nb[SHA256_LANES] = {2, 2, 2, 2, 2, 2, 2, 2};
+        unsigned char blocks[SHA256_LANES][128];
+        const unsigned char *ptr[SHA256_LANES];
+
+        for (i = 0; i < count; i += SHA256_LANES) {
+            int j, lanes = count - i < SHA256_LANES ? count - i : SHA256_LANES;
+
+            for (j = 0; j < lanes; j++) {
+                memcpy(blocks[j], message[i + j], 64);
+                memcpy(blocks[j] + 64, sha256_pad64, 64);
+                ptr[j] = blocks[j];
+            }
+            sha256d_8way(NULL, ptr, block_nb, digest + i, lanes);
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++)
+        sha256d_64(message[i], digest[i]);
+}
+
+void sha256d_80_lanes(const unsigned char *const message[], unsigned char *const digest[],
+                      int count)
+{
+    int i;
+
+#ifdef USE_AVX2_8WAY
+    if (count > 1 && sha256_lanes() > 1) {
+        static const int block_nb[SHA256_LANES] = {2, 2, 2, 2, 2, 2, 2, 2};
+        unsigned char blocks[SHA256_LANES][128];
+        const unsigned char *ptr[SHA256_LANES];
+
+        for (i = 0; i < count; i += SHA256_LANES) {
+            int j, lanes = count - i < SHA256_LANES ? count - i : SHA256_LANES;
+
+            for (j = 0; j < lanes; j++) {
+                memcpy(blocks[j], message[i + j], 80);
+                memcpy(blocks[j] + 80, sha256_pad80, 48);
+                ptr[j] = blocks[j];
+            }
+            sha256d_8way(NULL, ptr, block_nb, digest + i, lanes);
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++)
+        sha256d_80(message[i], digest[i]);
+}
+
 void sha256_final(sha256_ctx *ctx, unsigned char *digest)
 {
     unsigned int block_nb;
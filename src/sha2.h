@@ -37,6 +37,9 @@
 #ifndef SHA2_H
 #define SHA2_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define SHA256_DIGEST_SIZE ( 256 / 8)
 #define SHA256_BLOCK_SIZE  ( 512 / 8)
 
@@ -65,5 +68,36 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+/* Double sha256 of fixed length messages with precomputed padding */
+void sha256d_64(const unsigned char *message, unsigned char *digest);
+void sha256d_80(const unsigned char *message, unsigned char *digest);
+/* Finish a hash from the state h of a sha256_ctx saved after whole blocks
+ * of a message, given the remaining blocks already carrying the padding */
+void sha256_midstate_final(const uint32_t *midstate, const unsigned char *blocks,
+                           unsigned int block_nb, unsigned char *digest);
+
+/* Multi-buffer double sha256 of count independent messages. sha256_lanes
+ * returns how many are hashed at once, SHA256_LANES when the 8 way AVX2
+ * transform is built in, supported and faster than the backend in use,
+ * otherwise 1 and the messages are hashed in turn. sha256d_lanes finishes
+ * each message from its midstate (or from scratch where midstate or its
+ * entry is NULL) given its block_nb remaining blocks which already carry the
+ * padding. Each digest may only overlap its own message. */
+#define SHA256_LANES 8
+int sha256_lanes(void);
+void sha256d_lanes(const uint32_t *const midstate[], const unsigned char *const blocks[],
+                   const int block_nb[], unsigned char *const digest[], int count);
+void sha256d_64_lanes(const unsigned char *const message[], unsigned char *const digest[],
+                      int count);
+void sha256d_80_lanes(const unsigned char *const message[], unsigned char *const digest[],
+                      int count);
+
+/* The transform backend is chosen at runtime from those compiled in according
+ * to what the CPU supports. sha256_impl returns the name of the one in use,
+ * sha256_impl_available the name of the nth usable backend or NULL, and
+ * sha256_select_impl forces a usable backend by name. */
+const char *sha256_impl(void);
+const char *sha256_impl_available(int index);
+bool sha256_select_impl(const char *name);
 
 #endif /* !SHA2_H */
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2026 AtlasPool Development Team
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#ifdef USE_AVX2_8WAY
+
+#include <stdint.h>
+#include <immintrin.h>
+
+/* Eight independent sha256 transforms side by side, one per 32 bit lane of
+ * the AVX2 registers. Only this file is built for AVX2 so the binary still
+ * runs on CPUs without it; sha2.c only calls in here after checking cpuid. */
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static const uint32_t K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+#define ADD(a, b) _mm256_add_epi32(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHR(x, n) _mm256_srli_epi32(x, n)
+
+#define BSIG0(x) XOR(XOR(ROTR(x, 2), ROTR(x, 13)), ROTR(x, 22))
+#define BSIG1(x) XOR(XOR(ROTR(x, 6), ROTR(x, 11)), ROTR(x, 25))
+#define SSIG0(x) XOR(XOR(ROTR(x, 7), ROTR(x, 18)), SHR(x, 3))
+#define SSIG1(x) XOR(XOR(ROTR(x, 17), ROTR(x, 19)), SHR(x, 10))
+#define CH(e, f, g) XOR(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g))
+#define MAJ(a, b, c) _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)))
+
+static inline uint32_t be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* One 64 byte block per lane. State is indexed [lane][word]. */
+AVX2_TARGET
+void sha256_avx2_8way(uint32_t state[8][8], const unsigned char *const blocks[8])
+{
+    __m256i a, b, c, d, e, f, g, h, t1, t2;
+    __m256i w[64], s[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        s[i] = _mm256_set_epi32(state[7][i], state[6][i], state[5][i], state[4][i],
+                                state[3][i], state[2][i], state[1][i], state[0][i]);
+    for (i = 0; i < 16; i++)
+        w[i] = _mm256_set_epi32(be32(blocks[7] + i * 4), be32(blocks[6] + i * 4),
+                                be32(blocks[5] + i * 4), be32(blocks[4] + i * 4),
+                                be32(blocks[3] + i * 4), be32(blocks[2] + i * 4),
+                                be32(blocks[1] + i * 4), be32(blocks[0] + i * 4));
+    for (i = 16; i < 64; i++)
+        w[i] = ADD(ADD(SSIG1(w[i - 2]), w[i - 7]), ADD(SSIG0(w[i - 15]), w[i - 16]));
+
+    a = s[0]; b = s[1]; c = s[2]; d = s[3];
+    e = s[4]; f = s[5]; g = s[6]; h = s[7];
+    for (i = 0; i < 64; i++) {
+        t1 = ADD(ADD(ADD(h, BSIG1(e)), ADD(CH(e, f, g), _mm256_set1_epi32(K[i]))), w[i]);
+        t2 = ADD(BSIG0(a), MAJ(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = ADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = ADD(t1, t2);
+    }
+    s[0] = ADD(s[0], a); s[1] = ADD(s[1], b); s[2] = ADD(s[2], c); s[3] = ADD(s[3], d);
+    s[4] = ADD(s[4], e); s[5] = ADD(s[5], f); s[6] = ADD(s[6], g); s[7] = ADD(s[7], h);
+
+    for (i = 0; i < 8; i++) {
+        uint32_t words[8] __attribute__((aligned(32)));
+        int lane;
+
+        _mm256_store_si256((__m256i *)words, s[i]);
+        for (lane = 0; lane < 8; lane++)
+            state[lane][i] = words[lane];
+    }
+}
+
+#endif /* USE_AVX2_8WAY */
@@ -0,0 +1,162 @@
+/*
+ * Based on the x86 SHA extensions transform in Bitcoin Core:
+ * https://github.com/bitcoin/bitcoin/blob/master/src/crypto/sha256_x86_shani.cpp
+ * itself based on https://github.com/noloader/SHA-Intrinsics, and converted
+ * to c.
+ *
+ * The original licence:
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2009-2025 The Bitcoin Core developers
+ * Copyright (c) 2009-2025 Bitcoin Developers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#ifdef USE_X86_SHANI
+
+#include <stdint.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+/* Only this file is built for the SHA extensions so the binary still runs on
+ * CPUs without them; sha2.c only calls in here after checking cpuid. */
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+static const uint32_t K[64] __attribute__((aligned(16))) = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static const uint8_t MASK[16] __attribute__((aligned(16))) = {
+    0x03, 0x02, 0x01, 0x00, 0x07, 0x06, 0x05, 0x04,
+    0x0b, 0x0a, 0x09, 0x08, 0x0f, 0x0e, 0x0d, 0x0c
+};
+
+/* Four rounds of message m with the constants starting at K[i] */
+#define QUADROUND(s0, s1, m, i) do { \
+    const __m128i msg = _mm_add_epi32(m, _mm_load_si128((const __m128i *)&K[i])); \
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg); \
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e)); \
+} while (0)
+
+#define SHIFTMSGA(m0, m1) do { \
+    m0 = _mm_sha256msg1_epu32(m0, m1); \
+} while (0)
+
+#define SHIFTMSGC(m0, m1, m2) do { \
+    m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1); \
+} while (0)
+
+#define SHIFTMSGB(m0, m1, m2) do { \
+    SHIFTMSGC(m0, m1, m2); \
+    SHIFTMSGA(m0, m1); \
+} while (0)
+
+#define LOAD(in) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in)), \
+				  _mm_load_si128((const __m128i *)MASK))
+
+SHANI_TARGET
+void sha256_x86_shani(uint32_t *s, const unsigned char *chunk, uint64_t blocks)
+{
+    __m128i m0, m1, m2, m3, s0, s1, so0, so1, t1, t2;
+
+    /* Load state, reordered into the ABEF/CDGH layout the instructions use */
+    s0 = _mm_loadu_si128((const __m128i *)s);
+    s1 = _mm_loadu_si128((const __m128i *)(s + 4));
+    t1 = _mm_shuffle_epi32(s0, 0xB1);
+    t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+
+    while (blocks--) {
+        /* Remember old state */
+        so0 = s0;
+        so1 = s1;
+
+        /* Load data and transform */
+        m0 = LOAD(chunk);
+        QUADROUND(s0, s1, m0, 0);
+        m1 = LOAD(chunk + 16);
+        QUADROUND(s0, s1, m1, 4);
+        SHIFTMSGA(m0, m1);
+        m2 = LOAD(chunk + 32);
+        QUADROUND(s0, s1, m2, 8);
+        SHIFTMSGA(m1, m2);
+        m3 = LOAD(chunk + 48);
+        QUADROUND(s0, s1, m3, 12);
+        SHIFTMSGB(m2, m3, m0);
+        QUADROUND(s0, s1, m0, 16);
+        SHIFTMSGB(m3, m0, m1);
+        QUADROUND(s0, s1, m1, 20);
+        SHIFTMSGB(m0, m1, m2);
+        QUADROUND(s0, s1, m2, 24);
+        SHIFTMSGB(m1, m2, m3);
+        QUADROUND(s0, s1, m3, 28);
+        SHIFTMSGB(m2, m3, m0);
+        QUADROUND(s0, s1, m0, 32);
+        SHIFTMSGB(m3, m0, m1);
+        QUADROUND(s0, s1, m1, 36);
+        SHIFTMSGB(m0, m1, m2);
+        QUADROUND(s0, s1, m2, 40);
+        SHIFTMSGB(m1, m2, m3);
+        QUADROUND(s0, s1, m3, 44);
+        SHIFTMSGB(m2, m3, m0);
+        QUADROUND(s0, s1, m0, 48);
+        SHIFTMSGB(m3, m0, m1);
+        QUADROUND(s0, s1, m1, 52);
+        SHIFTMSGC(m0, m1, m2);
+        QUADROUND(s0, s1, m2, 56);
+        SHIFTMSGC(m1, m2, m3);
+        QUADROUND(s0, s1, m3, 60);
+
+        /* Combine with old state */
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+
+        /* Advance */
+        chunk += 64;
+    }
+
+    /* Back to the ABCD/EFGH state layout */
+    t1 = _mm_shuffle_epi32(s0, 0x1B);
+    t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 0x08);
+    _mm_storeu_si128((__m128i *)s, s0);
+    _mm_storeu_si128((__m128i *)(s + 4), s1);
+}
+
+#endif /* USE_X86_SHANI */
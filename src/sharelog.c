@@ -0,0 +1,436 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ckpool.h"
+#include "libckpool.h"
+#include "sharelog.h"
+#include "uthash.h"
+#include "utlist.h"
+
+/* Shares are written to the sharelog of their workbase by a dedicated thread
+ * so a slow disk never holds up the share processors. They queue records that
+ * are already serialised and the writer takes the whole queue at once,
+ * appending to files it keeps open with large stdio buffers, so many records
+ * go out in each write. Binary sharelog records are queued with their strings
+ * which the writer interns into the file they go to. */
+
+/* Files kept open, enough for the current and previous workbase */
+#define SHARELOG_FILES 2
+/* stdio buffer of each open file, written out whenever full */
+#define SHARELOG_BUFSIZE 262144
+/* Longest time a record can sit in a buffer unwritten */
+#define SHARELOG_FLUSH_MS 1000
+/* Bytes queued before share processors have to wait for the writer */
+#define SHARELOG_MAX_QUEUED (64 * 1024 * 1024)
+
+typedef struct sharelog_rec sharelog_rec_t;
+
+struct sharelog_rec {
+	sharelog_rec_t *next;
+	sharelog_rec_t *prev;
+	char *fname;
+	char *buf;
+	int len;
+
+	/* Binary records have a struct sharelog_share in buf */
+	bool binary;
+	char *strings[SLS_STRINGS];
+};
+
+typedef struct sharelog_strid sharelog_strid_t;
+
+struct sharelog_strid {
+	UT_hash_handle hh;
+	char *str;
+	uint32_t id;
+};
+
+struct sharelog_file {
+	char *fname;
+	FILE *fp;
+	char *vbuf;
+	int64_t last_used;
+
+	/* Strings interned in a binary sharelog */
+	bool binary;
+	sharelog_strid_t *strids;
+	uint32_t strid;
+};
+
+struct sharelog {
+	ckpool_t *ckp;
+	pthread_t pth;
+
+	/* Protects the queue and the back pressure counters */
+	mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t space_cond;
+	sharelog_rec_t *recs;
+	int queued;
+	int64_t queued_bytes;
+	int max_queued;
+	int64_t stalls;		/* Records that waited for room in the queue */
+	int64_t stall_ms;	/* Total time spent waiting */
+
+	/* Only touched by the writer */
+	struct sharelog_file files[SHARELOG_FILES];
+	int64_t uses;
+	int64_t records;
+	int64_t bytes;
+	int64_t strings;	/* Strings interned in binary sharelogs */
+	int64_t writes;		/* Times the writer emptied the queue */
+	int64_t flushes;
+	int64_t opens;
+	int64_t errors;
+};
+
+static void sharelog_flush_files(sharelog_t *sharelog)
+{
+	int i;
+
+	for (i = 0; i < SHARELOG_FILES; i++) {
+		struct sharelog_file *file = &sharelog->files[i];
+
+		if (!file->fp)
+			continue;
+		if (unlikely(fflush(file->fp))) {
+			LOGERR("Failed to flush %s", file->fname);
+			sharelog->errors++;
+		}
+	}
+	sharelog->flushes++;
+}
+
+static void sharelog_add_strid(struct sharelog_file *file, const char *str, const int len,
+			       const uint32_t id)
+{
+	sharelog_strid_t *strid = ckalloc(sizeof(sharelog_strid_t));
+
+	strid->str = strndup(str, len);
+	strid->id = id;
+	HASH_ADD_KEYPTR(hh, file->strids, strid->str, strlen(strid->str), strid);
+	if (id > file->strid)
+		file->strid = id;
+}
+
+static void sharelog_clear_strids(struct sharelog_file *file)
+{
+	sharelog_strid_t *strid, *tmp;
+
+	HASH_ITER(hh, file->strids, strid, tmp) {
+		HASH_DEL(file->strids, strid);
+		free(strid->str);
+		free(strid);
+	}
+	file->strid = 0;
+}
+
+/* Read back the strings already interned in an existing binary sharelog we
+ * are about to append to, so their ids are reused rather than clashing */
+static void sharelog_load_strids(sharelog_t *sharelog, struct sharelog_file *file)
+{
+	char magic[SHARELOG_MAGIC_LEN], str[65536];
+	struct sharelog_string hdr;
+	FILE *fp;
+
+	fp = fopen(file->fname, "re");
+	if (unlikely(!fp)) {
+		LOGERR("Failed to fopen %s to read back its strings", file->fname);
+		sharelog->errors++;
+		return;
+	}
+	if (unlikely(fread(magic, SHARELOG_MAGIC_LEN, 1, fp) != 1 ||
+		     memcmp(magic, SHARELOG_MAGIC, SHARELOG_MAGIC_LEN))) {
+		LOGWARNING("Binary sharelog %s has no valid header", file->fname);
+		goto out;
+	}
+	while (fread(&hdr.type, 1, 1, fp) == 1) {
+		if (hdr.type == SHARELOG_SHARE) {
+			if (fseek(fp, sizeof(struct sharelog_share) - 1, SEEK_CUR))
+				break;
+		} else if (hdr.type == SHARELOG_STRING) {
+			if (fread(&hdr.pad, sizeof(hdr) - 1, 1, fp) != 1 ||
+			    (hdr.len && fread(str, hdr.len, 1, fp) != 1))
+				break;
+			sharelog_add_strid(file, str, hdr.len, hdr.id);
+		} else {
+			LOGWARNING("Invalid record type %d in binary sharelog %s", hdr.type,
+				   file->fname);
+			break;
+		}
+	}
+out:
+	fclose(fp);
+}
+
+/* Find the open file for fname, replacing the least recently used one if it
+ * isn't open. Takes the fname string. */
+static struct sharelog_file *sharelog_file(sharelog_t *sharelog, char *fname)
+{
+	struct sharelog_file *file, *lru = NULL;
+	int i;
+
+	for (i = 0; i < SHARELOG_FILES; i++) {
+		file = &sharelog->files[i];
+		if (file->fname && !strcmp(file->fname, fname)) {
+			free(fname);
+			file->last_used = ++sharelog->uses;
+			return file;
+		}
+		if (!lru || file->last_used < lru->last_used)
+			lru = &sharelog->files[i];
+	}
+
+	file = lru;
+	if (file->fp && unlikely(fclose(file->fp))) {
+		LOGERR("Failed to fclose %s", file->fname);
+		sharelog->errors++;
+	}
+	free(file->fname);
+	file->fname = NULL;
+	sharelog_clear_strids(file);
+	file->binary = false;
+	file->fp = fopen(fname, "ae");
+	if (unlikely(!file->fp)) {
+		LOGERR("Failed to fopen %s", fname);
+		sharelog->errors++;
+		free(fname);
+		file->last_used = 0;
+		return NULL;
+	}
+	setvbuf(file->fp, file->vbuf, _IOFBF, SHARELOG_BUFSIZE);
+	file->fname = fname;
+	file->last_used = ++sharelog->uses;
+	sharelog->opens++;
+	return file;
+}
+
+/* Give a binary sharelog its header if it's new, otherwise pick up the
+ * strings it already has */
+static void sharelog_binary_open(sharelog_t *sharelog, struct sharelog_file *file)
+{
+	struct stat st;
+
+	if (unlikely(fstat(fileno(file->fp), &st))) {
+		LOGERR("Failed to fstat %s", file->fname);
+		sharelog->errors++;
+		return;
+	}
+	if (st.st_size)
+		sharelog_load_strids(sharelog, file);
+	else
+		fwrite(SHARELOG_MAGIC, SHARELOG_MAGIC_LEN, 1, file->fp);
+}
+
+static uint32_t sharelog_intern(sharelog_t *sharelog, struct sharelog_file *file, const char *str)
+{
+	struct sharelog_string hdr = {};
+	sharelog_strid_t *strid;
+	int len;
+
+	if (!str)
+		return 0;
+	HASH_FIND_STR(file->strids, str, strid);
+	if (likely(strid))
+		return strid->id;
+
+	len = strlen(str);
+	if (unlikely(len > 65535))
+		len = 65535;
+	hdr.type = SHARELOG_STRING;
+	hdr.len = len;
+	hdr.id = file->strid + 1;
+	sharelog_add_strid(file, str, len, hdr.id);
+	fwrite(&hdr, sizeof(hdr), 1, file->fp);
+	fwrite(str, len, 1, file->fp);
+	sharelog->strings++;
+	return hdr.id;
+}
+
+static void sharelog_write(sharelog_t *sharelog, sharelog_rec_t *rec)
+{
+	struct sharelog_file *file = sharelog_file(sharelog, rec->fname);
+	int i;
+
+	if (likely(file) && rec->binary) {
+		struct sharelog_share *share = (struct sharelog_share *)rec->buf;
+
+		if (!file->binary) {
+			sharelog_binary_open(sharelog, file);
+			file->binary = true;
+		}
+		for (i = 0; i < SLS_STRINGS; i++)
+			share->strings[i] = sharelog_intern(sharelog, file, rec->strings[i]);
+	}
+	if (likely(file)) {
+		if (unlikely(fwrite(rec->buf, rec->len, 1, file->fp) != 1)) {
+			LOGERR("Failed to fwrite to %s", file->fname);
+			sharelog->errors++;
+		} else {
+			sharelog->records++;
+			sharelog->bytes += rec->len;
+		}
+	}
+	for (i = 0; i < SLS_STRINGS; i++)
+		free(rec->strings[i]);
+	free(rec->buf);
+	free(rec);
+}
+
+static void *sharelogger(void *arg)
+{
+	sharelog_t *sharelog = (sharelog_t *)arg;
+	tv_t now, last_flush;
+
+	pthread_detach(pthread_self());
+	rename_proc("sharelogger");
+	tv_time(&last_flush);
+
+	while (42) {
+		sharelog_rec_t *recs, *rec, *tmp;
+		ts_t abs;
+
+		mutex_lock(&sharelog->lock);
+		if (!sharelog->recs) {
+			tv_time(&now);
+			tv_to_ts(&abs, &now);
+			abs.tv_nsec += SHARELOG_FLUSH_MS * 1000000ll;
+			abs.tv_sec += abs.tv_nsec / 1000000000;
+			abs.tv_nsec %= 1000000000;
+			cond_timedwait(&sharelog->cond, &sharelog->lock, &abs);
+		}
+		recs = sharelog->recs;
+		sharelog->recs = NULL;
+		sharelog->queued = 0;
+		sharelog->queued_bytes = 0;
+		pthread_cond_broadcast(&sharelog->space_cond);
+		mutex_unlock(&sharelog->lock);
+
+		if (recs) {
+			DL_FOREACH_SAFE(recs, rec, tmp) {
+				DL_DELETE(recs, rec);
+				sharelog_write(sharelog, rec);
+			}
+			sharelog->writes++;
+		}
+
+		tv_time(&now);
+		if (ms_tvdiff(&now, &last_flush) >= SHARELOG_FLUSH_MS) {
+			sharelog_flush_files(sharelog);
+			copy_tv(&last_flush, &now);
+		}
+	}
+	return NULL;
+}
+
+sharelog_t *create_sharelog(ckpool_t *ckp)
+{
+	sharelog_t *sharelog = ckzalloc(sizeof(sharelog_t));
+	int i;
+
+	sharelog->ckp = ckp;
+	mutex_init(&sharelog->lock);
+	cond_init(&sharelog->cond);
+	cond_init(&sharelog->space_cond);
+	for (i = 0; i < SHARELOG_FILES; i++)
+		sharelog->files[i].vbuf = ckalloc(SHARELOG_BUFSIZE);
+	create_pthread(&sharelog->pth, sharelogger, sharelog);
+
+	return sharelog;
+}
+
+static void sharelog_queue(sharelog_t *sharelog, sharelog_rec_t *rec)
+{
+	int len = rec->len;
+
+	mutex_lock(&sharelog->lock);
+	if (unlikely(sharelog->queued_bytes >= SHARELOG_MAX_QUEUED)) {
+		tv_t start, end;
+
+		tv_time(&start);
+		sharelog->stalls++;
+		while (sharelog->queued_bytes >= SHARELOG_MAX_QUEUED)
+			cond_wait(&sharelog->space_cond, &sharelog->lock);
+		tv_time(&end);
+		sharelog->stall_ms += ms_tvdiff(&end, &start);
+	}
+	DL_APPEND(sharelog->recs, rec);
+	sharelog->queued_bytes += len;
+	if (++sharelog->queued > sharelog->max_queued)
+		sharelog->max_queued = sharelog->queued;
+	pthread_cond_signal(&sharelog->cond);
+	mutex_unlock(&sharelog->lock);
+}
+
+/* Queue len bytes of buf to be appended to the file fname, taking both
+ * strings. Only waits if the writer has fallen far behind. */
+void sharelog_add(sharelog_t *sharelog, char *fname, char *buf, const int len)
+{
+	sharelog_rec_t *rec = ckzalloc(sizeof(sharelog_rec_t));
+
+	rec->fname = fname;
+	rec->buf = buf;
+	rec->len = len;
+	sharelog_queue(sharelog, rec);
+}
+
+/* As sharelog_add for a binary sharelog share record, taking fname and
+ * copying the share and its strings, which may be NULL. */
+void sharelog_add_share(sharelog_t *sharelog, char *fname, const struct sharelog_share *share,
+			const char *strings[SLS_STRINGS])
+{
+	sharelog_rec_t *rec = ckzalloc(sizeof(sharelog_rec_t));
+	int i;
+
+	rec->fname = fname;
+	rec->len = sizeof(struct sharelog_share);
+	rec->buf = ckalloc(rec->len);
+	memcpy(rec->buf, share, rec->len);
+	rec->binary = true;
+	for (i = 0; i < SLS_STRINGS; i++) {
+		if (strings[i])
+			rec->strings[i] = strdup(strings[i]);
+	}
+	sharelog_queue(sharelog, rec);
+}
+
+json_t *sharelog_stats(sharelog_t *sharelog)
+{
+	int queued, max_queued, open = 0, i;
+	int64_t queued_bytes, stalls, stall_ms;
+	json_t *val;
+
+	mutex_lock(&sharelog->lock);
+	queued = sharelog->queued;
+	queued_bytes = sharelog->queued_bytes;
+	max_queued = sharelog->max_queued;
+	stalls = sharelog->stalls;
+	stall_ms = sharelog->stall_ms;
+	mutex_unlock(&sharelog->lock);
+
+	for (i = 0; i < SHARELOG_FILES; i++) {
+		if (sharelog->files[i].fp)
+			open++;
+	}
+
+	JSON_CPACK(val, "{si,sI,si,sI,sI,sI,sI,sI,sI,sI,sI,sI,si}",
+		   "queued", queued, "queuedbytes", queued_bytes, "maxqueued", max_queued,
+		   "stalls", stalls, "stallms", stall_ms, "records", sharelog->records,
+		   "bytes", sharelog->bytes, "strings", sharelog->strings, "writes", sharelog->writes,
+		   "flushes", sharelog->flushes, "opens", sharelog->opens,
+		   "errors", sharelog->errors, "open", open);
+	return val;
+}
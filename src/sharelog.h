@@ -0,0 +1,79 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "ckpool.h"
+
+/* Binary sharelog format, in host byte order. A file starts with
+ * SHARELOG_MAGIC followed by a stream of records, each starting with its
+ * type. The strings of each file are interned: a string record assigns the
+ * next id to a string the first time it is used in that file, and share
+ * records refer to strings by id, 0 being no string. */
+#define SHARELOG_MAGIC "CKSLOG01"
+#define SHARELOG_MAGIC_LEN 8
+
+enum sharelog_type {
+	SHARELOG_STRING = 1,
+	SHARELOG_SHARE = 2
+};
+
+/* Strings of a share record */
+enum sharelog_str {
+	SLS_CREATEINET,
+	SLS_WORKERNAME,
+	SLS_USERNAME,
+	SLS_ADDRESS,
+	SLS_AGENT,
+	SLS_STRINGS
+};
+
+/* Followed by len bytes of string, not null terminated */
+struct sharelog_string {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t len;
+	uint32_t id;
+} __attribute__((packed));
+
+struct sharelog_share {
+	uint8_t type;
+	uint8_t result;
+	int8_t errn;
+	uint8_t enonce1len;
+	uint8_t nonce2len;
+	uint8_t pad[3];
+	uint32_t nonce;
+	uint32_t ntime;
+	int64_t workinfoid;
+	int64_t clientid;
+	int64_t createsec;
+	int64_t creatensec;
+	double diff;
+	double sdiff;
+	uint8_t enonce1[16];
+	uint8_t nonce2[16];
+	uint8_t hash[32];	/* In the byte order of the hash in json sharelogs */
+	uint32_t strings[SLS_STRINGS];
+} __attribute__((packed));
+
+typedef struct sharelog sharelog_t;
+
+sharelog_t *create_sharelog(ckpool_t *ckp);
+void sharelog_add(sharelog_t *sharelog, char *fname, char *buf, const int len);
+void sharelog_add_share(sharelog_t *sharelog, char *fname, const struct sharelog_share *share,
+			const char *strings[SLS_STRINGS]);
+json_t *sharelog_stats(sharelog_t *sharelog);
+
+#endif /* SHARELOG_H */
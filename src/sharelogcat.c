@@ -0,0 +1,184 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Streams binary sharelogs back out as the json lines ckpool writes to its
+ * sharelogs when binarysharelog is not set. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sharelog.h"
+
+struct strtable {
+	char **strs;
+	uint32_t count;
+};
+
+static void set_string(struct strtable *table, const uint32_t id, char *str)
+{
+	if (id >= table->count) {
+		uint32_t count = id + 1024;
+
+		table->strs = realloc(table->strs, sizeof(char *) * count);
+		if (unlikely(!table->strs))
+			quit(1, "Failed to realloc string table of %u entries", count);
+		memset(table->strs + table->count, 0, sizeof(char *) * (count - table->count));
+		table->count = count;
+	}
+	free(table->strs[id]);
+	table->strs[id] = str;
+}
+
+static const char *get_string(const struct strtable *table, const uint32_t id)
+{
+	if (!id || id >= table->count)
+		return NULL;
+	return table->strs[id];
+}
+
+static void clear_strings(struct strtable *table)
+{
+	uint32_t i;
+
+	for (i = 0; i < table->count; i++)
+		free(table->strs[i]);
+	free(table->strs);
+	table->strs = NULL;
+	table->count = 0;
+}
+
+/* Set key to the interned string id, leaving it out if there is none as
+ * happens with json_set_string of a NULL string */
+static void set_interned(json_t *val, const char *key, const struct strtable *table,
+			 const uint32_t id)
+{
+	const char *str = get_string(table, id);
+
+	if (str)
+		json_set_string(val, key, str);
+}
+
+static void print_share(const struct sharelog_share *share, const struct strtable *table)
+{
+	char hex[68], cdfield[64];
+	json_t *val;
+	char *s;
+
+	val = json_object();
+	json_set_int(val, "workinfoid", share->workinfoid);
+	json_set_int64(val, "clientid", share->clientid);
+	__bin2hex(hex, share->enonce1, MIN(share->enonce1len, sizeof(share->enonce1)));
+	json_set_string(val, "enonce1", hex);
+	__bin2hex(hex, share->nonce2, MIN(share->nonce2len, sizeof(share->nonce2)));
+	json_set_string(val, "nonce2", hex);
+	sprintf(hex, "%08x", share->nonce);
+	json_set_string(val, "nonce", hex);
+	sprintf(hex, "%08x", share->ntime);
+	json_set_string(val, "ntime", hex);
+	json_set_double(val, "diff", share->diff);
+	json_set_double(val, "sdiff", share->sdiff);
+	/* Shares that were never hashed have an empty hash */
+	if (share->sdiff < 0)
+		hex[0] = '\0';
+	else
+		__bin2hex(hex, share->hash, 32);
+	json_set_string(val, "hash", hex);
+	json_set_bool(val, "result", share->result);
+	if (share->errn != SE_NONE)
+		json_set_string(val, "reject-reason", SHARE_ERR(share->errn));
+	json_set_int(val, "errn", share->errn);
+	sprintf(cdfield, "%"PRId64",%"PRId64, share->createsec, share->creatensec);
+	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createby", "code");
+	json_set_string(val, "createcode", "parse_submit");
+	set_interned(val, "createinet", table, share->strings[SLS_CREATEINET]);
+	set_interned(val, "workername", table, share->strings[SLS_WORKERNAME]);
+	set_interned(val, "username", table, share->strings[SLS_USERNAME]);
+	set_interned(val, "address", table, share->strings[SLS_ADDRESS]);
+	set_interned(val, "agent", table, share->strings[SLS_AGENT]);
+
+	s = json_dumps(val, JSON_EOL);
+	fputs(s, stdout);
+	free(s);
+	json_decref(val);
+}
+
+static bool cat_sharelog(FILE *fp, const char *fname)
+{
+	struct strtable table = {};
+	char magic[SHARELOG_MAGIC_LEN];
+	struct sharelog_string hdr;
+	struct sharelog_share share;
+	bool ret = false;
+	uint8_t type;
+
+	if (fread(magic, SHARELOG_MAGIC_LEN, 1, fp) != 1 ||
+	    memcmp(magic, SHARELOG_MAGIC, SHARELOG_MAGIC_LEN)) {
+		LOGERR("%s is not a binary sharelog", fname);
+		goto out;
+	}
+	while (fread(&type, 1, 1, fp) == 1) {
+		if (type == SHARELOG_SHARE) {
+			share.type = type;
+			if (fread(&share.result, sizeof(share) - 1, 1, fp) != 1) {
+				LOGERR("Truncated share record in %s", fname);
+				goto out;
+			}
+			print_share(&share, &table);
+		} else if (type == SHARELOG_STRING) {
+			char *str;
+
+			if (fread(&hdr.pad, sizeof(hdr) - 1, 1, fp) != 1) {
+				LOGERR("Truncated string record in %s", fname);
+				goto out;
+			}
+			str = ckzalloc(hdr.len + 1);
+			if (hdr.len && fread(str, hdr.len, 1, fp) != 1) {
+				LOGERR("Truncated string record in %s", fname);
+				free(str);
+				goto out;
+			}
+			set_string(&table, hdr.id, str);
+		} else {
+			LOGERR("Invalid record type %d in %s", type, fname);
+			goto out;
+		}
+	}
+	ret = true;
+out:
+	clear_strings(&table);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	bool ret = true;
+	int i;
+
+	if (argc < 2)
+		return cat_sharelog(stdin, "stdin") ? 0 : 1;
+
+	for (i = 1; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "re");
+
+		if (unlikely(!fp)) {
+			LOGERR("Failed to fopen %s", argv[i]);
+			ret = false;
+			continue;
+		}
+		if (!cat_sharelog(fp, argv[i]))
+			ret = false;
+		fclose(fp);
+	}
+	return ret ? 0 : 1;
+}
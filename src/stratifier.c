@@ -30,6 +30,7 @@
 #include "libckpool.h"
 #include "bitcoin.h"
 #include "sha2.h"
+#include "sharelog.h"
 #include "stratifier.h"
 #include "uthash.h"
 #include "utlist.h"
@@ -100,14 +101,6 @@ struct json_params {
 
 typedef struct json_params json_params_t;
 
-/* Stratum json messages with their associated client id */
-struct smsg {
-	json_t *json_msg;
-	int64_t client_id;
-};
-
-typedef struct smsg smsg_t;
-
 struct userwb {
 	UT_hash_handle hh;
 	int64_t id;
@@ -115,6 +108,10 @@ struct userwb {
 	uchar *coinb2bin; // Coinb2 cointaining this user's address for generation
 	char *coinb2;
 	int coinb2len; // Length of user coinb2
+	uchar *coinb2pad; // As coinb2bin with the sha256 padding appended
+	int coinb2padlen; // Length of above
+
+	bcast_t *notify[2]; // Serialised notify of this work, unclean and clean
 };
 
 struct user_instance;
@@ -151,7 +148,7 @@ struct user_instance {
 
 	int64_t shares;
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	decay_t decay; /* Shares not yet accounted for in hashmeter */
 
 	double dsps1; /* Diff shares per second, 1 minute rolling average */
 	double dsps5; /* ... 5 minute ... */
@@ -159,7 +156,6 @@ struct user_instance {
 	double dsps1440;
 	double dsps10080;
 	tv_t last_share;
-	tv_t last_decay;
 
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
@@ -182,7 +178,7 @@ struct worker_instance {
 
 	int64_t shares;
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	decay_t decay; /* Shares not yet accounted for in hashmeter */
 
 	double dsps1;
 	double dsps5;
@@ -190,7 +186,6 @@ struct worker_instance {
 	double dsps1440;
 	double dsps10080;
 	tv_t last_share;
-	tv_t last_decay;
 	time_t start_time;
 
 	double best_diff; /* Best share found by this worker */
@@ -208,6 +203,7 @@ typedef struct proxy_base proxy_t;
 /* Per client stratum instance == workers */
 struct stratum_instance {
 	UT_hash_handle hh;
+	UT_hash_handle shard_hh; /* Hashed by id on its instance shard */
 	int64_t id;
 
 	/* Virtualid used as unique local id for passthrough clients */
@@ -229,7 +225,9 @@ struct stratum_instance {
 	char identity[128];
 
 	/* Reference count for when this instance is used outside of the
-	 * instance_lock */
+	 * instance_lock, updated atomically. INSTANCE_DROPPED is set in it once
+	 * the instance is dropped so no new references can be taken and
+	 * whoever leaves it with no references removes it */
 	int ref;
 
 	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
@@ -242,7 +240,7 @@ struct stratum_instance {
 	int64_t old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	decay_t decay; /* Shares not yet accounted for in hashmeter */
 
 	double dsps1; /* Diff shares per second, 1 minute rolling average */
 	double dsps5; /* ... 5 minute ... */
@@ -253,7 +251,6 @@ struct stratum_instance {
 	int ssdc; /* Shares since diff change */
 	tv_t first_share;
 	tv_t last_share;
-	tv_t last_decay;
 	time_t first_invalid; /* Time of first invalid in run of non stale rejects */
 	time_t upstream_invalid; /* As first_invalid but for upstream responses */
 	time_t start_time;
@@ -261,7 +258,7 @@ struct stratum_instance {
 	char address[INET6_ADDRSTRLEN];
 	bool node; /* Is this a mining node */
 	bool subscribed;
-	bool authorising; /* In progress, protected by instance_lock */
+	bool authorising; /* In progress, protected by its shard lock */
 	bool authorised;
 	bool dropped;
 	bool idle;
@@ -302,13 +299,53 @@ struct stratum_instance {
 	bool remote; /* Is this a remote client on a trusted remote server */
 };
 
-struct share {
-	UT_hash_handle hh;
-	uchar hash[32];
+/* Duplicate share detection. Shares are kept in a table sharded by the top
+ * bits of the first 8 bytes of their hash, each shard being an open
+ * addressing table probed linearly with its own lock. Slots hold those 8
+ * bytes as the key with the share's workbase id while the full hashes live in
+ * a parallel slab only compared on a key match. Entries with a workbase id
+ * below the table's floor are dead, so purging shares on a block change or
+ * ageing a workbase only raises the floor. Dead slots get reused by new
+ * entries and dropped when their shard is resized. */
+#define SHARE_SHARD_BITS 6
+#define SHARE_SHARDS (1 << SHARE_SHARD_BITS)
+#define SHARE_SHARD_SLOTS 1024	/* Initial slots of each shard */
+
+struct share_slot {
+	uint64_t key;		/* 0 for an empty slot */
 	int64_t workbase_id;
 };
 
-typedef struct share share_t;
+struct share_shard {
+	mutex_t lock;
+	struct share_slot *slots;
+	uchar (*hashes)[32];
+	uint32_t mask;
+	uint32_t used;		/* Slots with live or dead entries */
+};
+
+struct share_table {
+	struct share_shard shards[SHARE_SHARDS];
+	int64_t floor;
+	int64_t generated;
+};
+
+typedef struct share_table share_table_t;
+
+/* Stratum instances are all on the stratum_instances hashtable under
+ * instance_lock for iterating over them, and are also indexed by id in
+ * shards, each with its own lock, so that finding the instance of every
+ * message and share only takes the read lock of its shard. Instances are
+ * added to and removed from their shard with instance_lock held. */
+#define INSTANCE_SHARD_BITS 4
+#define INSTANCE_SHARDS (1 << INSTANCE_SHARD_BITS)
+
+struct instance_shard {
+	cklock_t lock;
+	stratum_instance_t *instances;
+};
+
+#define INSTANCE_DROPPED (1 << 30)
 
 struct proxy_base {
 	UT_hash_handle hh;
@@ -445,6 +482,8 @@ struct stratifier_data {
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
 
+	sharelog_t *sharelog;	// Share log writer
+
 	int user_instance_id;
 
 	stratum_instance_t *stratum_instances;
@@ -462,10 +501,9 @@ struct stratifier_data {
 	/* Protects both stratum and user instances */
 	cklock_t instance_lock;
 
-	share_t *shares;
-	mutex_t share_lock;
+	struct instance_shard instance_shards[INSTANCE_SHARDS];
 
-	int64_t shares_generated;
+	share_table_t *shares;
 
 	int proxy_count; /* Total proxies generated (not necessarily still alive) */
 	proxy_t *proxy; /* Current proxy in use */
@@ -767,6 +805,9 @@ static void clear_userwb(sdata_t *sdata, int64_t id)
 		HASH_DEL(instance->userwbs, userwb);
 		free(userwb->coinb2bin);
 		free(userwb->coinb2);
+		free(userwb->coinb2pad);
+		drop_bcast(userwb->notify[0]);
+		drop_bcast(userwb->notify[1]);
 		free(userwb);
 	}
 	ck_wunlock(&sdata->instance_lock);
@@ -777,13 +818,19 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	if (ckp->btcsolo)
 		clear_userwb(ckp->sdata, wb->id);
 	free(wb->flags);
-	free(wb->txn_data);
+	if (wb->blockreq)
+		put_blockreq(wb->blockreq);
+	if (wb->gtxns) {
+		gbt_txns_clear(wb->gtxns);
+		free(wb->gtxns);
+	}
 	free(wb->txn_hashes);
 	free(wb->logdir);
 	free(wb->coinb1bin);
 	free(wb->coinb1);
 	free(wb->coinb2bin);
 	free(wb->coinb2);
+	free(wb->coinb2pad);
 	free(wb->coinb3bin);
 	json_decref(wb->merkle_array);
 	if (wb->json)
@@ -791,44 +838,102 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
-static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+static void init_share_shard(struct share_shard *shard, const uint32_t slots)
+{
+	shard->slots = ckzalloc(sizeof(struct share_slot) * slots);
+	shard->hashes = ckalloc(32 * slots);
+	shard->mask = slots - 1;
+	shard->used = 0;
+}
+
+/* slots per shard must be a power of 2 */
+static share_table_t *create_share_table(const uint32_t slots)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	share_table_t *table = ckzalloc(sizeof(share_table_t));
+	int i;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
-		}
+	for (i = 0; i < SHARE_SHARDS; i++) {
+		mutex_init(&table->shards[i].lock);
+		init_share_shard(&table->shards[i], slots);
 	}
-	mutex_unlock(&sdata->share_lock);
+	table->floor = INT64_MIN;
+	return table;
+}
+
+static void free_share_table(share_table_t *table)
+{
+	int i;
 
-	if (purged)
-		LOGINFO("Cleared %d shares from share hashtable", purged);
+	for (i = 0; i < SHARE_SHARDS; i++) {
+		free(table->shards[i].slots);
+		free(table->shards[i].hashes);
+	}
+	free(table);
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
-static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+static inline uint64_t share_key(const uchar *hash)
 {
-	share_t *share, *tmp;
-	int aged = 0;
+	uint64_t key;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
+	memcpy(&key, hash, 8);
+	/* Zero marks an empty slot */
+	return key ? key : 1;
+}
+
+/* Rebuild a full shard with only its live entries, doubling its size if
+ * they still fill more than half of it. Must hold the shard lock */
+static void resize_share_shard(struct share_shard *shard, const int64_t floor)
+{
+	struct share_slot *slots = shard->slots;
+	uchar (*hashes)[32] = shard->hashes;
+	uint32_t i, live = 0, size = shard->mask + 1;
+
+	for (i = 0; i < size; i++) {
+		if (slots[i].key && slots[i].workbase_id >= floor)
+			live++;
 	}
-	mutex_unlock(&sdata->share_lock);
+	init_share_shard(shard, live * 2 > size ? size * 2 : size);
+	for (i = 0; i < size; i++) {
+		uint32_t idx;
 
-	if (aged)
-		LOGINFO("Aged %d shares from share hashtable", aged);
+		if (!slots[i].key || slots[i].workbase_id < floor)
+			continue;
+		idx = slots[i].key & shard->mask;
+		while (shard->slots[idx].key)
+			idx = (idx + 1) & shard->mask;
+		shard->slots[idx] = slots[i];
+		memcpy(shard->hashes[idx], hashes[i], 32);
+		shard->used++;
+	}
+	free(slots);
+	free(hashes);
+}
+
+/* Raise the floor below which share entries are dead to wb_id */
+static void raise_share_floor(sdata_t *sdata, const int64_t wb_id)
+{
+	share_table_t *table = sdata->shares;
+	int64_t floor = __atomic_load_n(&table->floor, __ATOMIC_RELAXED);
+
+	while (floor < wb_id) {
+		if (__atomic_compare_exchange_n(&table->floor, &floor, wb_id, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/* Drop all shares with a workbase id less than wb_id for block changes */
+static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+{
+	raise_share_floor(sdata, wb_id);
+	LOGINFO("Cleared shares below workbase %"PRId64" from share hashtable", wb_id);
+}
+
+/* Drop the shares of workbases being discarded, those below the lowest
+ * workbase id still in use */
+static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+{
+	raise_share_floor(sdata, wb_id);
 }
 
 /* Append a bulk list already created to the ssends list */
@@ -839,7 +944,8 @@ static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int mess
 	mutex_lock(ssends->lock);
 	ssends->messages += messages;
 	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
+	/* Wake all the ssender workers to share the bulk list */
+	pthread_cond_broadcast(ssends->cond);
 	mutex_unlock(ssends->lock);
 }
 
@@ -855,7 +961,7 @@ static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int mes
 	ssends->msgs = bulk_send;
 	ssends->messages += messages;
 	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
+	pthread_cond_broadcast(ssends->cond);
 	mutex_unlock(ssends->lock);
 }
 
@@ -992,11 +1098,69 @@ static void send_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
 		send_node_workinfo(ckp, sdata, wb);
 }
 
+/* Create a copy of coinb2 followed by the sha256 padding for the coinbase it
+ * ends, so that everything after the coinb1 midstate is whole blocks that can
+ * be hashed directly for each share. */
+static uchar *coinb2_padded(const workbase_t *wb, const uchar *coinb2bin, const int coinb2len,
+			    int *padlen)
+{
+	int cblen, tail, blocks;
+	uint64_t bits;
+	uchar *pad;
+
+	cblen = wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + coinb2len;
+	tail = cblen - wb->coinb1midlen;
+	/* Room for the 0x80 terminator and 64 bit length */
+	blocks = (tail + 9 + 63) / 64;
+	*padlen = coinb2len + blocks * 64 - tail;
+	pad = ckzalloc(*padlen);
+	memcpy(pad, coinb2bin, coinb2len);
+	pad[coinb2len] = 0x80;
+	bits = htobe64((uint64_t)cblen * 8);
+	memcpy(pad + *padlen - 8, &bits, 8);
+	return pad;
+}
+
+/* Coinb1 is constant for the life of a workbase so store the midstate of its
+ * whole blocks to only hash the remainder of the coinbase for each share. */
+static void wb_coinbase_midstate(workbase_t *wb)
+{
+	sha256_ctx ctx;
+
+	wb->coinb1midlen = wb->coinb1len & ~(SHA256_BLOCK_SIZE - 1);
+	sha256_init(&ctx);
+	sha256_update(&ctx, wb->coinb1bin, wb->coinb1midlen);
+	memcpy(wb->coinb1mid, ctx.h, sizeof(wb->coinb1mid));
+	wb->coinb2pad = coinb2_padded(wb, wb->coinb2bin, wb->coinb2len, &wb->coinb2padlen);
+}
+
+/* Build the mining.notify json of a userwb, clean or unclean */
+static json_t *userwb_notify(const workbase_t *wb, const struct userwb *userwb, const bool clean)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
+			"params",
+			wb->idstring,
+			wb->prevhash,
+			wb->coinb1,
+			userwb->coinb2,
+			json_deep_copy(wb->merkle_array),
+			wb->bbversion,
+			wb->nbit,
+			wb->ntime,
+			clean,
+			"id", json_null(),
+			"method", "mining.notify");
+	return val;
+}
+
 /* Entered with instance_lock held, make sure wb can't be pulled from us */
 static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
 {
 	struct userwb *userwb;
 	int64_t id = wb->id;
+	int clean;
 
 	/* Make sure this user doesn't have this userwb already */
 	HASH_FIND_I64(user->userwbs, &id, userwb);
@@ -1015,6 +1179,15 @@ static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *u
 	memcpy(userwb->coinb2bin + userwb->coinb2len, wb->coinb3bin, wb->coinb3len);
 	userwb->coinb2len += wb->coinb3len;
 	userwb->coinb2 = bin2hex(userwb->coinb2bin, userwb->coinb2len);
+	userwb->coinb2pad = coinb2_padded(wb, userwb->coinb2bin, userwb->coinb2len, &userwb->coinb2padlen);
+	/* Serialise the notify of this work once for all of this user's
+	 * clients to share when it is broadcast */
+	for (clean = 0; clean < 2; clean++) {
+		json_t *val = userwb_notify(wb, userwb, clean);
+
+		userwb->notify[clean] = create_bcast(val);
+		json_decref(val);
+	}
 	HASH_ADD_I64(user->userwbs, id, userwb);
 }
 
@@ -1039,8 +1212,11 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	pool_stats_t *stats = &sdata->stats;
 	double old_diff = stats->network_diff;
 	workbase_t *tmp, *tmpa;
+	int64_t min_id = 0;
+	bool aged = false;
 	int len, ret;
 
+	wb_coinbase_midstate(wb);
 	ts_realtime(&wb->gentime);
 	/* Stats network_diff is not protected by lock but is not a critical
 	 * value */
@@ -1103,14 +1279,25 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 			ck_wunlock(&sdata->workbase_lock);
 
 			/* Drop lock to avoid recursive locks */
-			age_share_hashtable(sdata, tmp->id);
 			clear_workbase(ckp, tmp);
+			aged = true;
 
 			ck_wlock(&sdata->workbase_lock);
 		}
 	}
+	if (aged) {
+		/* Shares of any workbase below the oldest one left are dead */
+		min_id = wb->id;
+		HASH_ITER(hh, sdata->workbases, tmp, tmpa) {
+			if (tmp->id < min_id)
+				min_id = tmp->id;
+		}
+	}
 	ck_wunlock(&sdata->workbase_lock);
 
+	if (aged)
+		age_share_hashtable(sdata, min_id);
+
 	/* This wb can't be pulled out from under us so no workbase lock is
 	 * required to generate_userwbs */
 	if (ckp->btcsolo)
@@ -1145,10 +1332,11 @@ static void submit_transaction(ckpool_t *ckp, const char *hash)
 /* Build a hashlist of all transactions, allowing us to compare with the list of
  * existing transactions to determine which need to be propagated */
 static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char *hash,
-		    const char *data, bool local)
+		    const char *data, const int len, bool local)
 {
 	bool found = false;
 	txntable_t *txn;
+	char *copy;
 
 	/* Look for transactions we already know about and increment their
 	 * refcount if we're still using them. */
@@ -1173,8 +1361,11 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 
 	txn = ckzalloc(sizeof(txntable_t));
 	memcpy(txn->hash, hash, 65);
+	copy = ckalloc(len + 1);
+	memcpy(copy, data, len);
+	copy[len] = '\0';
 	if (local)
-		txn->data = strdup(data);
+		txn->data = copy;
 	else {
 		/* Get the data from our local bitcoind as a way of confirming it
 		 * already knows about this transaction. */
@@ -1182,9 +1373,10 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 		if (!txn->data) {
 			/* If our local bitcoind hasn't seen this transaction,
 			 * submit it for mempools to be ~synchronised */
-			submit_transaction(ckp, data);
-			txn->data = strdup(data);
-		}
+			submit_transaction(ckp, copy);
+			txn->data = copy;
+		} else
+			free(copy);
 	}
 
 	txn->seen = true;
@@ -1327,69 +1519,74 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 	}
 }
 
+static const char blockreq_start[] = "{\"method\": \"submitblock\", \"params\": [\"";
+static const char blockreq_end[BLOCKREQ_ENDLEN + 1] = "\"]}\n";
+
+/* A block request template with room for txnlen of transaction hex, already
+ * ending the request after it */
+static blockreq_t *new_blockreq(const int txnlen)
+{
+	blockreq_t *req = ckzalloc(sizeof(blockreq_t));
+
+	req->txnofs = BLOCKREQ_HEAD;
+	req->txnlen = txnlen + BLOCKREQ_ENDLEN;
+	req->buf = ckalloc(BLOCKREQ_HEAD + req->txnlen + 1);
+	strcpy(req->buf + req->txnofs + txnlen, blockreq_end);
+	req->refs = 1;
+	return req;
+}
+
+/* A block request template taking over the transaction data arena of gtxns,
+ * which has the room for the rest of the request around it */
+static blockreq_t *gbt_blockreq(gbt_txns_t *gtxns)
+{
+	blockreq_t *req;
+
+	if (unlikely(!gtxns->buf))
+		return new_blockreq(0);
+	req = ckzalloc(sizeof(blockreq_t));
+	req->buf = gtxns->buf;
+	req->txnofs = gtxns->data - gtxns->buf;
+	req->txnlen = gtxns->datalen + BLOCKREQ_ENDLEN;
+	strcpy(req->buf + req->txnofs + gtxns->datalen, blockreq_end);
+	req->refs = 1;
+	gtxns->buf = gtxns->data = NULL;
+	return req;
+}
+
 /* Distill down a set of transactions into an efficient tree arrangement for
  * stratum messages and fast work assembly. */
 static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
-				      json_t *txn_array, bool local)
+				      gbt_txns_t *gtxns, bool local)
 {
 	int i, j, binleft, binlen;
 	txntable_t *txns = NULL;
-	json_t *arr_val;
 	uchar *hashbin;
 
-	wb->txns = json_array_size(txn_array);
+	wb->txns = gtxns->count;
 	wb->merkles = 0;
 	binlen = wb->txns * 32 + 32;
 	hashbin = alloca(binlen + 32);
 	memset(hashbin, 0, 32);
 	binleft = binlen / 32;
-	if (wb->txns) {
-		int len = 1, ofs = 0;
-		const char *txn;
-
-		for (i = 0; i < wb->txns; i++) {
-			arr_val = json_array_get(txn_array, i);
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			if (!txn) {
-				LOGWARNING("json_string_value fail - cannot find transaction data");
-				goto out;
-			}
-			len += strlen(txn);
-		}
-
-		wb->txn_data = ckzalloc(len + 1);
-		wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
-		memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
-
-		for (i = 0; i < wb->txns; i++) {
-			const char *txid, *hash;
-			char binswap[32];
+	if (wb->blockreq)
+		put_blockreq(wb->blockreq);
+	wb->blockreq = gbt_blockreq(gtxns);
+	wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
+	memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
 
-			arr_val = json_array_get(txn_array, i);
+	for (i = 0; i < wb->txns; i++) {
+		const uchar *txid = gtxns->txids + i * 32;
+		const int ofs = gtxns->dataofs[i];
+		char hash[68], txidhex[68];
 
-			// Post-segwit, txid returns the tx hash without witness data
-			txid = json_string_value(json_object_get(arr_val, "txid"));
-			hash = json_string_value(json_object_get(arr_val, "hash"));
-			if (!txid)
-				txid = hash;
-			if (unlikely(!txid)) {
-				LOGERR("Missing txid for transaction in wb_merkle_bins");
-				goto out;
-			}
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			add_txn(ckp, sdata, &txns, hash, txn, local);
-			len = strlen(txn);
-			memcpy(wb->txn_data + ofs, txn, len);
-			ofs += len;
-			if (!hex2bin(binswap, txid, 32)) {
-				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
-				goto out;
-			}
-			memcpy(wb->txn_hashes + i * 65, txid, 64);
-			bswap_256(hashbin + 32 + 32 * i, binswap);
-		}
-	} else
-		wb->txn_hashes = ckzalloc(1);
+		__bin2hex(hash, gtxns->hashes + i * 32, 32);
+		add_txn(ckp, sdata, &txns, hash, wb->blockreq->buf + wb->blockreq->txnofs + ofs,
+			gtxns->dataofs[i + 1] - ofs, local);
+		__bin2hex(txidhex, txid, 32);
+		memcpy(wb->txn_hashes + i * 65, txidhex, 64);
+		bswap_256(hashbin + 32 + 32 * i, txid);
+	}
 	wb->merkle_array = json_array();
 	if (binleft > 1) {
 		while (42) {
@@ -1406,14 +1603,13 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 				binleft++;
 			}
 			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
+				sha256d_64(hashbin + j, hashbin + i);
 			binleft /= 2;
 			binlen = binleft * 32;
 		}
 	}
 	LOGNOTICE("Stored %s workbase with %d transactions", local ? "local" : "remote",
 		  wb->txns);
-out:
 	return txns;
 }
 
@@ -1422,32 +1618,17 @@ static const int witness_nonce_size = sizeof(witness_nonce);
 static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
 static const int witness_header_size = sizeof(witness_header);
 
-static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
+static void gbt_witness_data(workbase_t *wb, const gbt_txns_t *gtxns)
 {
-	int i, binlen, txncount = json_array_size(txn_array);
-	const char* hash;
-	json_t *arr_val;
+	int i, binlen, txncount = gtxns->count;
 	uchar *hashbin;
 
 	binlen = txncount * 32 + 32;
 	hashbin = alloca(binlen + 32);
 	memset(hashbin, 0, 32);
 
-	for (i = 0; i < txncount; i++) {
-		char binswap[32];
-
-		arr_val = json_array_get(txn_array, i);
-		hash = json_string_value(json_object_get(arr_val, "hash"));
-		if (unlikely(!hash)) {
-			LOGERR("Hash missing for transaction");
-			return;
-		}
-		if (!hex2bin(binswap, hash, 32)) {
-			LOGERR("Failed to hex2bin hash in gbt_witness_data");
-			return;
-		}
-		bswap_256(hashbin + 32 + 32 * i, binswap);
-	}
+	for (i = 0; i < txncount; i++)
+		bswap_256(hashbin + 32 + 32 * i, gtxns->hashes + 32 * i);
 
 	// Build merkle root (copied from libblkmaker)
 	for (txncount++ ; txncount > 1 ; txncount /= 2) {
@@ -1458,12 +1639,12 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 		}
 		for (i = 0; i < txncount; i += 2) {
 			// We overlap input and output here, on the first pair
-			gen_hash(hashbin + 32 * i, hashbin + 32 * (i / 2), 64);
+			sha256d_64(hashbin + 32 * i, hashbin + 32 * (i / 2));
 		}
 	}
 
 	memcpy(hashbin + 32, &witness_nonce, witness_nonce_size);
-	gen_hash(hashbin, hashbin + witness_header_size, 32 + witness_nonce_size);
+	sha256d_64(hashbin, hashbin + witness_header_size);
 	memcpy(hashbin, witness_header, witness_header_size);
 	__bin2hex(wb->witnessdata, hashbin, 32 + witness_header_size);
 	wb->insert_witness = true;
@@ -1478,7 +1659,6 @@ static void block_update(ckpool_t *ckp, int *prio)
 	bool new_block = false, ret = false;
 	const char *witnessdata_check;
 	sdata_t *sdata = ckp->sdata;
-	json_t *txn_array;
 	txntable_t *txns;
 	int retries = 0;
 	workbase_t *wb;
@@ -1498,19 +1678,26 @@ retry:
 
 	wb->ckp = ckp;
 
-	txn_array = json_object_get(wb->json, "transactions");
-	txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, true);
+	txns = wb_merkle_bin_txns(ckp, sdata, wb, wb->gtxns, true);
 
 	wb->insert_witness = false;
 
 	witnessdata_check = json_string_value(json_object_get(wb->json, "default_witness_commitment"));
 	if (likely(witnessdata_check)) {
 		LOGDEBUG("Default witness commitment present, adding witness data");
-		gbt_witness_data(wb, txn_array);
+		gbt_witness_data(wb, wb->gtxns);
 		// Verify against the pre-calculated value if it exists. Skip the size/OP_RETURN bytes.
 		if (wb->insert_witness && safecmp(witnessdata_check + 4, wb->witnessdata) != 0)
 			LOGERR("Witness from btcd: %s. Calculated Witness: %s", witnessdata_check + 4, wb->witnessdata);
 	}
+	/* Everything needed from the template handed over by the generator
+	 * is now decoded into the workbase, so release the parsed template
+	 * and what is left of its transactions instead of keeping them until
+	 * the workbase is aged out */
+	json_decref(wb->json);
+	wb->json = NULL;
+	gbt_txns_clear(wb->gtxns);
+	dealloc(wb->gtxns);
 
 	generate_coinbase(ckp, wb);
 
@@ -1615,7 +1802,8 @@ static void request_txns(ckpool_t *ckp, sdata_t *sdata, json_t *txns)
 static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 {
 	const char *hashes = wb->txn_hashes;
-	json_t *txn_array, *missing_txns;
+	json_t *missing_txns;
+	gbt_txns_t gtxns;
 	char hash[68] = {};
 	bool ret = false;
 	txntable_t *txns;
@@ -1636,7 +1824,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		goto out;
 	}
 	ret = true;
-	txn_array = json_array();
+	gbt_txns_init(&gtxns, BLOCKREQ_HEAD, BLOCKREQ_ENDLEN + 1);
 	missing_txns = json_array();
 
 	for (i = 0; i < wb->txns; i++) {
@@ -1651,13 +1839,12 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		if (likely(txn)) {
 			txn->refcount = REFCOUNT_REMOTE;
 			txn->seen = true;
-			JSON_CPACK(txn_val, "{ss,ss}",
-				   "hash", hash, "data", txn->data);
-			json_array_append_new(txn_array, txn_val);
+			if (unlikely(!gbt_txns_add(&gtxns, hash, NULL, txn->data, strlen(txn->data))))
+				ret = false;
 		}
 		ck_wunlock(&sdata->txn_lock);
 
-		if (likely(txn_val))
+		if (likely(txn))
 			continue;
 		/* See if we can find it in our local bitcoind */
 		data = generator_get_txn(ckp, hash);
@@ -1683,9 +1870,8 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		}
 		txn->refcount = REFCOUNT_REMOTE;
 		txn->seen = true;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		if (unlikely(!gbt_txns_add(&gtxns, hash, NULL, txn->data, strlen(txn->data))))
+			ret = false;
 		ck_wunlock(&sdata->txn_lock);
 	}
 
@@ -1695,7 +1881,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		/* These two structures are regenerated so free their ram */
 		json_decref(wb->merkle_array);
 		dealloc(wb->txn_hashes);
-		txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, false);
+		txns = wb_merkle_bin_txns(ckp, sdata, wb, &gtxns, false);
 		if (likely(txns))
 			update_txns(ckp, sdata, txns, false);
 	} else {
@@ -1708,7 +1894,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		request_txns(ckp, sdata, missing_txns);
 	}
 
-	json_decref(txn_array);
+	gbt_txns_clear(&gtxns);
 	json_decref(missing_txns);
 out:
 	return ret;
@@ -1731,6 +1917,7 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 	int64_t skip;
 	json_t *val;
 
+	wb_coinbase_midstate(wb);
 	ts_realtime(&wb->gentime);
 
 	ck_wlock(&sdata->workbase_lock);
@@ -1894,7 +2081,19 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
-/* Calculate share diff and fill in hash and swap. Need to hold workbase read count */
+/* Double sha256 a coinbase resuming from the workbase's coinb1 midstate, where
+ * padlen is the length of the coinbase including its sha256 padding */
+static void coinbase_hash(const workbase_t *wb, const char *coinbase, const int padlen, uchar *hash)
+{
+	int blocks = (padlen - wb->coinb1midlen) / SHA256_BLOCK_SIZE;
+	uchar hash1[32];
+
+	sha256_midstate_final(wb->coinb1mid, (const uchar *)coinbase + wb->coinb1midlen, blocks, hash1);
+	sha256(hash1, 32, hash);
+}
+
+/* Calculate share diff and fill in hash and swap. Need to hold workbase read count.
+ * Coinbase needs room for the sha256 padding of coinb2 */
 static double
 share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
 	   const uint32_t ntime32, uint32_t version_mask, const char *nonce,
@@ -1902,7 +2101,6 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 {
 	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
 	char data[80];
 	int i;
 
@@ -1912,14 +2110,14 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	*cblen += wb->enonce1constlen + wb->enonce1varlen;
 	hex2bin(coinbase + *cblen, nonce2, wb->enonce2varlen);
 	*cblen += wb->enonce2varlen;
-	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
+	memcpy(coinbase + *cblen, wb->coinb2pad, wb->coinb2padlen);
+	coinbase_hash(wb, coinbase, *cblen + wb->coinb2padlen, merkle_root);
 	*cblen += wb->coinb2len;
 
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
 	memcpy(merkle_sha, merkle_root, 32);
 	for (i = 0; i < wb->merkles; i++) {
 		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
+		sha256d_64(merkle_sha, merkle_root);
 		memcpy(merkle_sha, merkle_root, 32);
 	}
 	data32 = (uint32_t *)merkle_sha;
@@ -1950,8 +2148,7 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+	sha256d_80(swap, hash);
 
 	/* Calculate the diff of the share here */
 	return diff_from_target(hash);
@@ -2035,53 +2232,70 @@ static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1,
 	}
 }
 
-/* Process a block into a message for the generator to submit. Must hold
- * workbase readcount */
-static char *
+/* Process a block into a request for the generator to submit. The header
+ * and coinbase are written into the workbase's request template unless a block
+ * from it is still being submitted, when the transactions are copied into a
+ * request of its own. Must hold workbase readcount */
+static blockreq_t *
 process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
 {
-	char *gbt_block, varint[12];
-	int txns = wb->txns + 1;
-	char hexcoinbase[1024];
+	blockreq_t *req = wb->blockreq, *tpl;
+	int txns = wb->txns + 1, refs = 1;
+	char head[BLOCKREQ_HEAD], *p;
 
 	flip_32(flip32, hash);
 	__bin2hex(blockhash, flip32, 32);
 
-	/* Message format: "data" */
-	gbt_block = ckzalloc(1024);
-	__bin2hex(gbt_block, data, 80);
+	/* Request format: start, header, txn count varint, coinbase, txns */
+	strcpy(head, blockreq_start);
+	p = head + strlen(blockreq_start);
+	__bin2hex(p, data, 80);
+	p += 160;
 	if (txns < 0xfd) {
 		uint8_t val8 = txns;
 
-		__bin2hex(varint, (const unsigned char *)&val8, 1);
+		__bin2hex(p, (const unsigned char *)&val8, 1);
+		p += 2;
 	} else if (txns <= 0xffff) {
 		uint16_t val16 = htole16(txns);
 
-		strcat(gbt_block, "fd");
-		__bin2hex(varint, (const unsigned char *)&val16, 2);
+		strcpy(p, "fd");
+		__bin2hex(p + 2, (const unsigned char *)&val16, 2);
+		p += 6;
 	} else {
 		uint32_t val32 = htole32(txns);
 
-		strcat(gbt_block, "fe");
-		__bin2hex(varint, (const unsigned char *)&val32, 4);
+		strcpy(p, "fe");
+		__bin2hex(p + 2, (const unsigned char *)&val32, 4);
+		p += 10;
 	}
-	strcat(gbt_block, varint);
-	__bin2hex(hexcoinbase, coinbase, cblen);
-	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
-	return gbt_block;
+	__bin2hex(p, coinbase, cblen);
+	p += cblen * 2;
+
+	/* Take the template if only the workbase holds it */
+	if (unlikely(!req || !__atomic_compare_exchange_n(&req->refs, &refs, 2, false,
+							  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))) {
+		tpl = req;
+		req = new_blockreq(tpl ? tpl->txnlen - BLOCKREQ_ENDLEN : 0);
+		if (tpl)
+			memcpy(req->buf + req->txnofs, tpl->buf + tpl->txnofs, tpl->txnlen);
+	}
+	req->rpc_req = req->buf + req->txnofs - (p - head);
+	memcpy(req->rpc_req, head, p - head);
+	req->len = p - head + req->txnlen;
+	return req;
 }
 
-/* Submit block data locally, absorbing and freeing gbt_block */
-static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip32, int height)
+/* Submit block data locally, absorbing the reference to req, with the time
+ * it was solved to measure submission latency from */
+static bool local_block_submit(ckpool_t *ckp, blockreq_t *req, const uchar *flip32, int height,
+			       const tv_t *solved)
 {
-	bool ret = generator_submitblock(ckp, gbt_block);
+	bool ret = generator_submitblock(ckp, req, solved);
 	char heighthash[68] = {}, rhash[68] = {};
 	uchar swap256[32];
 
-	free(gbt_block);
 	swap_256(swap256, flip32);
 	__bin2hex(rhash, swap256, 32);
 	generator_preciousblock(ckp, rhash);
@@ -2160,19 +2374,22 @@ static void block_reject(json_t *val);
 
 static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 {
-	char *coinbase = NULL, *enonce1 = NULL, *nonce = NULL, *nonce2 = NULL, *gbt_block,
-		*coinbasehex, *swaphex;
+	char *coinbase = NULL, *enonce1 = NULL, *nonce = NULL, *nonce2 = NULL, *coinbasehex,
+		*swaphex;
 	uchar *enonce1bin = NULL, hash[32], swap[80], flip32[32];
 	uint32_t ntime32, version_mask = 0;
 	char blockhash[68], cdfield[64];
 	int enonce1len, cblen;
 	workbase_t *wb = NULL;
+	blockreq_t *req;
 	json_t *bval;
+	tv_t solve_tv;
 	double diff;
 	ts_t ts_now;
 	int64_t id;
 	bool ret;
 
+	tv_time(&solve_tv);
 	if (unlikely(!json_get_string(&enonce1, val, "enonce1"))) {
 		LOGWARNING("Failed to get enonce1 from node method block");
 		goto out;
@@ -2219,27 +2436,24 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 	json_get_int(&cblen, val, "cblen");
 	json_get_string(&swaphex, val, "swaphex");
 	if (coinbasehex && cblen && swaphex) {
-		uchar hash1[32];
-
 		coinbase = alloca(cblen);
 		hex2bin(coinbase, coinbasehex, cblen);
 		hex2bin(swap, swaphex, 80);
-		sha256(swap, 80, hash1);
-		sha256(hash1, 32, hash);
+		sha256d_80(swap, hash);
 	} else {
 		/* Rebuild the old way if we can if the upstream pool is using
 		 * the old format only */
 		enonce1len = wb->enonce1constlen + wb->enonce1varlen;
 		enonce1bin = alloca(enonce1len);
 		hex2bin(enonce1bin, enonce1, enonce1len);
-		coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len);
+		coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2padlen);
 		/* Fill in the hashes */
 		share_diff(coinbase, enonce1bin, wb, nonce2, ntime32, version_mask, nonce, hash, swap, &cblen);
 	}
 
 	/* Now we have enough to assemble a block */
-	gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	req = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
+	ret = local_block_submit(ckp, req, flip32, wb->height, &solve_tv);
 
 	JSON_CPACK(bval, "{si,ss,ss,sI,ss,ss,si,ss,sI,sf,ss,ss,ss,ss}",
 			 "height", wb->height,
@@ -2356,13 +2570,31 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	sdata->disconnected_generated++;
 }
 
+static struct instance_shard *instance_shard(sdata_t *sdata, const int64_t id)
+{
+	return &sdata->instance_shards[(id ^ (id >> 32)) & (INSTANCE_SHARDS - 1)];
+}
+
+/* Tag an instance as dropped, returning its reference count from before */
+static int mark_dropped(stratum_instance_t *client)
+{
+	client->dropped = true;
+	return __atomic_fetch_or(&client->ref, INSTANCE_DROPPED, __ATOMIC_ACQ_REL);
+}
+
 /* Removes a client instance we know is on the stratum_instances list and from
  * the user client list if it's been placed on it */
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 {
+	struct instance_shard *shard = instance_shard(sdata, client->id);
 	user_instance_t *user = client->user_instance;
 
 	HASH_DEL(sdata->stratum_instances, client);
+	/* Once off its shard nothing can find the instance to take a new
+	 * reference to it */
+	ck_wlock(&shard->lock);
+	HASH_DELETE(shard_hh, shard->instances, client);
+	ck_wunlock(&shard->lock);
 	if (user) {
 		DL_DELETE2(user->clients, client, user_prev, user_next );
 		__dec_worker(sdata, user, client->worker_instance);
@@ -2388,11 +2620,10 @@ static void drop_allclients(ckpool_t *ckp)
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
 		int64_t client_id = client->id;
 
-		if (!client->ref) {
+		if (!(mark_dropped(client) & ~INSTANCE_DROPPED)) {
 			__del_client(sdata, client);
 			__kill_instance(sdata, client);
-		} else
-			client->dropped = true;
+		}
 		kills++;
 		connector_drop_client(ckp, client_id);
 	}
@@ -2420,6 +2651,10 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 	dsdata->sshareq = sdata->sshareq;
 	dsdata->sauthq = sdata->sauthq;
 	dsdata->stxnq = sdata->stxnq;
+	dsdata->sharelog = sdata->sharelog;
+
+	/* Subproxies see little work each so start with a small share table */
+	dsdata->shares = create_share_table(64);
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
@@ -3177,15 +3412,9 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 
 	/* Delete any shares in the proxy's hashtable. */
 	if (dsdata) {
-		share_t *share, *tmpshare;
 		workbase_t *wb, *tmpwb;
 
-		mutex_lock(&dsdata->share_lock);
-		HASH_ITER(hh, dsdata->shares, share, tmpshare) {
-			HASH_DEL(dsdata->shares, share);
-			dealloc(share);
-		}
-		mutex_unlock(&dsdata->share_lock);
+		free_share_table(dsdata->shares);
 
 		/* Do we need to check readcount here if freeing the proxy? */
 		ck_wlock(&dsdata->workbase_lock);
@@ -3262,28 +3491,49 @@ static stratum_instance_t *__instance_by_id(sdata_t *sdata, const int64_t id)
 	return client;
 }
 
-/* Increase the reference count of instance */
+/* Enter with the shard lock held */
+static stratum_instance_t *__shard_instance_by_id(struct instance_shard *shard, const int64_t id)
+{
+	stratum_instance_t *client;
+
+	HASH_FIND(shard_hh, shard->instances, &id, sizeof(int64_t), client);
+	return client;
+}
+
+/* Increase the reference count of instance. Enter with instance_lock held,
+ * which allows references to be taken to dropped instances as well. */
 static void __inc_instance_ref(stratum_instance_t *client)
 {
-	client->ref++;
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_RELAXED);
+}
+
+/* Take a reference to an instance found on its shard unless it has been
+ * dropped. Enter with the shard lock held. */
+static bool __try_instance_ref(stratum_instance_t *client)
+{
+	int ref = __atomic_load_n(&client->ref, __ATOMIC_RELAXED);
+
+	do {
+		if (unlikely(ref & INSTANCE_DROPPED))
+			return false;
+	} while (!__atomic_compare_exchange_n(&client->ref, &ref, ref + 1, false,
+					      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
 }
 
-/* Find an __instance_by_id and increase its reference count allowing us to
- * use this instance outside of instance_lock without fear of it being
- * dereferenced. Does not return dropped clients still on the list. */
+/* Find an instance by id on its shard and increase its reference count
+ * allowing us to use this instance outside of instance_lock without fear of
+ * it being dereferenced. Does not return dropped clients still on the list. */
 static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64_t id)
 {
+	struct instance_shard *shard = instance_shard(sdata, id);
 	stratum_instance_t *client;
 
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, id);
-	if (client) {
-		if (unlikely(client->dropped))
-			client = NULL;
-		else
-			__inc_instance_ref(client);
-	}
-	ck_wunlock(&sdata->instance_lock);
+	ck_rlock(&shard->lock);
+	client = __shard_instance_by_id(shard, id);
+	if (client && unlikely(!__try_instance_ref(client)))
+		client = NULL;
+	ck_runlock(&shard->lock);
 
 	return client;
 }
@@ -3321,7 +3571,7 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 
 static int __dec_instance_ref(stratum_instance_t *client)
 {
-	return --client->ref;
+	return __atomic_sub_fetch(&client->ref, 1, __ATOMIC_ACQ_REL);
 }
 
 /* Decrease the reference count of instance. */
@@ -3329,15 +3579,24 @@ static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const
 			      const char *func, const int line)
 {
 	char_entry_t *entries = NULL;
+	int64_t id = client->id;
 	bool dropped = false;
 	char *msg = NULL;
 	int ref;
 
-	ck_wlock(&sdata->instance_lock);
 	ref = __dec_instance_ref(client);
-	/* See if there are any instances that were dropped that could not be
-	 * moved due to holding a reference and drop them now. */
-	if (unlikely(client->dropped && !ref)) {
+	/* This should never happen */
+	if (unlikely(ref < 0))
+		LOGERR("Instance ref count dropped below zero from %s %s:%d", file, func, line);
+	if (likely(ref != INSTANCE_DROPPED))
+		return;
+
+	/* This was the last reference to an instance that was dropped while
+	 * it was held so drop it now, unless it was removed by someone else
+	 * before we got the lock. */
+	ck_wlock(&sdata->instance_lock);
+	if (__instance_by_id(sdata, id) == client &&
+	    __atomic_load_n(&client->ref, __ATOMIC_ACQUIRE) == INSTANCE_DROPPED) {
 		dropped = true;
 		__drop_client(sdata, client, true, &msg);
 		if (msg)
@@ -3347,10 +3606,6 @@ static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const
 
 	if (entries)
 		notice_msg_entries(&entries);
-	/* This should never happen */
-	if (unlikely(ref < 0))
-		LOGERR("Instance ref count dropped below zero from %s %s:%d", file, func, line);
-
 	if (dropped)
 		reap_proxies(sdata->ckp, sdata);
 }
@@ -3377,6 +3632,7 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 						  int server)
 {
 	sdata_t *sdata = ckp->sdata;
+	struct instance_shard *shard;
 	stratum_instance_t *client;
 	int64_t pass_id;
 
@@ -3427,6 +3683,10 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 
 	ck_wlock(&sdata->instance_lock);
 	HASH_ADD_I64(sdata->stratum_instances, id, client);
+	shard = instance_shard(sdata, client->id);
+	ck_wlock(&shard->lock);
+	HASH_ADD(shard_hh, shard->instances, id, sizeof(int64_t), client);
+	ck_wunlock(&shard->lock);
 	return client;
 }
 
@@ -3477,13 +3737,18 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 
 /* For creating a list of sends without locking that can then be concatenated
  * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
+ * locks. Sends only to sdata bound clients (everyone in ckpool). The message
+ * is serialised once and shared by all direct clients, while passthrough
+ * subclients need node.method and their own client_id so they each get a copy
+ * of a variant with node.method set. */
 static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->sdata;
 	stratum_instance_t *client, *tmp;
 	ckmsg_t *bulk_send = NULL;
+	json_t *subval = NULL;
+	bcast_t *bcast = NULL;
 	int messages = 0;
 
 	if (unlikely(!val)) {
@@ -3513,9 +3778,19 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 
 		client_msg = ckalloc(sizeof(ckmsg_t));
 		msg = ckzalloc(sizeof(smsg_t));
-		if (subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
-		msg->json_msg = json_deep_copy(val);
+		if (subclient(client->id)) {
+			if (!subval) {
+				subval = json_deep_copy(val);
+				json_set_string(subval, "node.method", stratum_msgs[msg_type]);
+			}
+			msg->json_msg = json_deep_copy(subval);
+		} else {
+			if (!bcast)
+				bcast = create_bcast(val);
+			else
+				ref_bcast(bcast);
+			msg->bcast = bcast;
+		}
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
@@ -3523,6 +3798,8 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 	}
 	ck_runlock(&ckp_sdata->instance_lock);
 
+	if (subval)
+		json_decref(subval);
 	json_decref(val);
 
 	if (likely(bulk_send))
@@ -3576,16 +3853,19 @@ static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
 
 	ck_wlock(&sdata->instance_lock);
 	client = __instance_by_id(sdata, id);
-	if (client && !client->dropped) {
-		__disconnect_session(sdata, client);
+	if (client) {
+		int ref = mark_dropped(client);
+
+		if (!(ref & INSTANCE_DROPPED))
+			__disconnect_session(sdata, client);
 		/* If the client is still holding a reference, don't drop them
-		 * now but wait till the reference is dropped */
-		if (!client->ref) {
+		 * now but wait till the reference is dropped. Clients already
+		 * dropped lazily with no references left are removed now. */
+		if (!(ref & ~INSTANCE_DROPPED)) {
 			__drop_client(sdata, client, false, &msg);
 			if (msg)
 				add_msg_entry(&entries, &msg);
-		} else
-			client->dropped = true;
+		}
 	}
 	ck_wunlock(&sdata->instance_lock);
 
@@ -3626,7 +3906,7 @@ static void request_reconnect(sdata_t *sdata, const char *cmd)
 	 * lazily */
 	ck_wlock(&sdata->instance_lock);
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		client->dropped = true;
+		mark_dropped(client);
 	}
 	ck_wunlock(&sdata->instance_lock);
 }
@@ -3674,11 +3954,57 @@ static user_instance_t *user_by_workername(sdata_t *sdata, const char *workernam
 
 static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
 
-static json_t *worker_stats(const worker_instance_t *worker)
+static void decay_client(stratum_instance_t *client, tv_t *now_t)
+{
+	double diff, tdiff;
+
+	if (!begin_decay(&client->decay, now_t, &diff, &tdiff))
+		return;
+	decay_time(&client->dsps1, diff, tdiff, MIN1);
+	decay_time(&client->dsps5, diff, tdiff, MIN5);
+	decay_time(&client->dsps60, diff, tdiff, HOUR);
+	decay_time(&client->dsps1440, diff, tdiff, DAY);
+	decay_time(&client->dsps10080, diff, tdiff, WEEK);
+	end_decay(&client->decay);
+}
+
+static void decay_worker(worker_instance_t *worker, tv_t *now_t)
+{
+	double diff, tdiff;
+
+	if (!begin_decay(&worker->decay, now_t, &diff, &tdiff))
+		return;
+	decay_time(&worker->dsps1, diff, tdiff, MIN1);
+	decay_time(&worker->dsps5, diff, tdiff, MIN5);
+	decay_time(&worker->dsps60, diff, tdiff, HOUR);
+	decay_time(&worker->dsps1440, diff, tdiff, DAY);
+	decay_time(&worker->dsps10080, diff, tdiff, WEEK);
+	end_decay(&worker->decay);
+}
+
+static void decay_user(user_instance_t *user, tv_t *now_t)
+{
+	double diff, tdiff;
+
+	if (!begin_decay(&user->decay, now_t, &diff, &tdiff))
+		return;
+	decay_time(&user->dsps1, diff, tdiff, MIN1);
+	decay_time(&user->dsps5, diff, tdiff, MIN5);
+	decay_time(&user->dsps60, diff, tdiff, HOUR);
+	decay_time(&user->dsps1440, diff, tdiff, DAY);
+	decay_time(&user->dsps10080, diff, tdiff, WEEK);
+	end_decay(&user->decay);
+}
+
+static json_t *worker_stats(worker_instance_t *worker)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
+	tv_t now_t;
+
+	tv_time(&now_t);
+	decay_worker(worker, &now_t);
 
 	ghs = worker->dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
@@ -3704,11 +4030,15 @@ static json_t *worker_stats(const worker_instance_t *worker)
 	return val;
 }
 
-static json_t *user_stats(const user_instance_t *user)
+static json_t *user_stats(user_instance_t *user)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
+	tv_t now_t;
+
+	tv_time(&now_t);
+	decay_user(user, &now_t);
 
 	ghs = user->dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
@@ -3851,27 +4181,58 @@ static void broadcast_ping(sdata_t *sdata)
 
 static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
 {
-	int64_t memsize, generated;
-	ckmsg_t *msg;
-	int objects;
-
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
+	int64_t memsize, generated = 0, msgs = 0, batches = 0;
+	json_t *processed = NULL, *depth = NULL;
+	int objects = 0, i;
+
+	/* Show how the load is spread across a pool of workers */
+	if (ckmsgq->workers > 1) {
+		processed = json_array();
+		if (ckmsgq->affine)
+			depth = json_array();
+	}
+	for (i = 0; i < ckmsgq->workers; i++) {
+		ckmsgq_t *worker = &ckmsgq[i];
+		ckmsg_t *msg;
+		int count;
+
+		if (processed)
+			json_array_append_new(processed, json_integer(worker->processed));
+		msgs += worker->processed;
+		batches += worker->batches;
+		/* Shared pools only have messages on the head's list */
+		if (i && !ckmsgq->affine)
+			continue;
+		mutex_lock(worker->lock);
+		DL_COUNT(worker->msgs, msg, count);
+		generated += worker->messages;
+		mutex_unlock(worker->lock);
+		objects += count;
+		if (depth)
+			json_array_append_new(depth, json_integer(count));
+	}
 
 	memsize = (sizeof(ckmsg_t) + size) * objects;
 	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+	if (processed)
+		json_set_object(*val, "processed", processed);
+	if (depth)
+		json_set_object(*val, "depth", depth);
+	/* Average number of messages handled per call in batch pools */
+	if (batches)
+		json_set_double(*val, "batchsize", (double)msgs / batches);
 }
 
 char *stratifier_stats(ckpool_t *ckp, void *data)
 {
 	json_t *val = json_object(), *subval;
-	int64_t memsize, generated;
+	int64_t memsize, generated, slots;
 	sdata_t *sdata = data;
-	int objects;
+	int objects, i;
 	char *buf;
 
+	json_set_string(val, "sha256", sha256_impl());
+
 	ck_rlock(&sdata->workbase_lock);
 	objects = HASH_COUNT(sdata->workbases);
 	memsize = SAFE_HASH_OVERHEAD(sdata->workbases) + sizeof(workbase_t) * objects;
@@ -3921,13 +4282,19 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
-	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	generated = __atomic_load_n(&sdata->shares->generated, __ATOMIC_RELAXED);
+	objects = slots = 0;
+	for (i = 0; i < SHARE_SHARDS; i++) {
+		struct share_shard *shard = &sdata->shares->shards[i];
 
-	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+		mutex_lock(&shard->lock);
+		objects += shard->used;
+		slots += shard->mask + 1;
+		mutex_unlock(&shard->lock);
+	}
+	memsize = sizeof(share_table_t) + (sizeof(struct share_slot) + 32) * slots;
+	JSON_CPACK(subval, "{si,si,sI,sI}", "count", objects, "memory", memsize, "generated", generated,
+		   "slots", slots);
 	json_set_object(val, "shares", subval);
 
 	ck_rlock(&sdata->txn_lock);
@@ -3940,11 +4307,15 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 
 	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
 	json_set_object(val, "ssends", subval);
+	ckmsgq_stats(sdata->sshareq, sizeof(json_params_t), &subval);
+	json_set_object(val, "sshareq", subval);
 	/* Don't know exactly how big the string is so just count the pointer for now */
 	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
 	json_set_object(val, "srecvs", subval);
 	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
 	json_set_object(val, "stxnq", subval);
+	if (sdata->sharelog)
+		json_set_object(val, "sharelog", sharelog_stats(sdata->sharelog));
 
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
@@ -4005,9 +4376,13 @@ static void reconnect_client_id(sdata_t *sdata, const int64_t client_id)
 
 /* API commands */
 
-static json_t *userinfo(const user_instance_t *user)
+static json_t *userinfo(user_instance_t *user)
 {
 	json_t *val;
+	tv_t now_t;
+
+	tv_time(&now_t);
+	decay_user(user, &now_t);
 
 	JSON_CPACK(val, "{ss,si,si,sf,sf,sf,sf,sf,sf,si}",
 		   "user", user->username, "id", user->id, "workers", user->workers,
@@ -4126,9 +4501,13 @@ out:
 	send_api_response(res, *sockd);
 }
 
-static json_t *workerinfo(const user_instance_t *user, const worker_instance_t *worker)
+static json_t *workerinfo(const user_instance_t *user, worker_instance_t *worker)
 {
 	json_t *val;
+	tv_t now_t;
+
+	tv_time(&now_t);
+	decay_worker(worker, &now_t);
 
 	JSON_CPACK(val, "{ss,ss,si,sf,sf,sf,sf,si,sf,si,sb}",
 		   "user", user->username, "worker", worker->workername, "id", user->id,
@@ -4208,9 +4587,13 @@ static void getusers(sdata_t *sdata, int *sockd)
 	send_api_response(val, *sockd);
 }
 
-static json_t *clientinfo(const stratum_instance_t *client)
+static json_t *clientinfo(stratum_instance_t *client)
 {
 	json_t *val = json_object();
+	tv_t now_t;
+
+	tv_time(&now_t);
+	decay_client(client, &now_t);
 
 	/* Too many fields for a pack object, do each discretely to keep track */
 	json_set_int(val, "id", client->id);
@@ -4558,7 +4941,7 @@ retry:
 
 		/* This is a message for a node */
 		if (likely(val))
-			ckmsgq_add(sdata->srecvs, val);
+			stratifier_add_recv(ckp, val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -5063,64 +5446,6 @@ static double dsps_from_key(json_t *val, const char *key)
 	return ret;
 }
 
-static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &client->last_decay);
-
-	/* If we're calling the hashmeter too frequently we'll just end up
-	 * racing and having inappropriate values, so store up diff and update
-	 * at most 20 times per second. Use an integer for uadiff to make the
-	 * update atomic */
-	if (tdiff < 0.05) {
-		client->uadiff += diff;
-		return;
-	}
-	copy_tv(&client->last_decay, now_t);
-	diff += client->uadiff;
-	client->uadiff = 0;
-	decay_time(&client->dsps1, diff, tdiff, MIN1);
-	decay_time(&client->dsps5, diff, tdiff, MIN5);
-	decay_time(&client->dsps60, diff, tdiff, HOUR);
-	decay_time(&client->dsps1440, diff, tdiff, DAY);
-	decay_time(&client->dsps10080, diff, tdiff, WEEK);
-}
-
-static void decay_worker(worker_instance_t *worker, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &worker->last_decay);
-
-	if (tdiff < 0.05) {
-		worker->uadiff += diff;
-		return;
-	}
-	copy_tv(&worker->last_decay, now_t);
-	diff += worker->uadiff;
-	worker->uadiff = 0;
-	decay_time(&worker->dsps1, diff, tdiff, MIN1);
-	decay_time(&worker->dsps5, diff, tdiff, MIN5);
-	decay_time(&worker->dsps60, diff, tdiff, HOUR);
-	decay_time(&worker->dsps1440, diff, tdiff, DAY);
-	decay_time(&worker->dsps10080, diff, tdiff, WEEK);
-}
-
-static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &user->last_decay);
-
-	if (tdiff < 0.05) {
-		user->uadiff += diff;
-		return;
-	}
-	copy_tv(&user->last_decay, now_t);
-	diff += user->uadiff;
-	user->uadiff = 0;
-	decay_time(&user->dsps1, diff, tdiff, MIN1);
-	decay_time(&user->dsps5, diff, tdiff, MIN5);
-	decay_time(&user->dsps60, diff, tdiff, HOUR);
-	decay_time(&user->dsps1440, diff, tdiff, DAY);
-	decay_time(&user->dsps10080, diff, tdiff, WEEK);
-}
-
 static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bool *new_user);
 static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *user,
 					    const char *workername, bool *new_worker);
@@ -5199,7 +5524,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 		dealloc(buf);
 
 		copy_tv(&user->last_share, &now);
-		copy_tv(&user->last_decay, &now);
+		copy_tv(&user->decay.last, &now);
 		user->dsps1 = dsps_from_key(val, "hashrate1m");
 		user->dsps5 = dsps_from_key(val, "hashrate5m");
 		user->dsps60 = dsps_from_key(val, "hashrate1hr");
@@ -5218,7 +5543,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 			user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
 			user->dsps10080, user->best_diff, user->best_ever, user->auth_time);
 		if (tvsec_diff > 60)
-			decay_user(user, 0, &now);
+			decay_user(user, &now);
 
 		worker_array = json_object_get(val, "worker");
 		json_array_foreach(worker_array, index, arr_val) {
@@ -5237,7 +5562,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 				continue;
 			}
 			workers++;
-			copy_tv(&worker->last_decay, &now);
+			copy_tv(&worker->decay.last, &now);
 			worker->dsps1 = dsps_from_key(arr_val, "hashrate1m");
 			worker->dsps5 = dsps_from_key(arr_val, "hashrate5m");
 			worker->dsps60 = dsps_from_key(arr_val, "hashrate1hr");
@@ -5253,7 +5578,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 			LOGINFO("Successfully read worker %s stats %f %f %f %f %f %ld", worker->workername,
 				worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff, worker->best_ever);
 			if (tvsec_diff > 60)
-				decay_worker(worker, 0, &now);
+				decay_worker(worker, &now);
 		}
 		json_decref(val);
 	}
@@ -5534,7 +5859,7 @@ static json_t *parse_authorise(stratum_instance_t *client, const json_t *params_
 				LOGINFO("Client %s %s worker %s rate limited due to failed auth attempts",
 					client->identity, client->address, buf);
 			}
-			client->dropped = true;
+			mark_dropped(client);
 			goto out;
 		}
 	}
@@ -5645,14 +5970,14 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		copy_tv(&client->ldc, &now_t);
 	}
 
-	decay_client(client, diff, &now_t);
+	add_decay(&client->decay, diff);
 	copy_tv(&client->last_share, &now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_decay(&worker->decay, diff);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_decay(&user->decay, diff);
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
@@ -5676,7 +6001,10 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		return;
 	}
 
-	/* Diff rate ratio */
+	/* Diff rate ratio. The averages barely move within a second so only
+	 * decay them once a second rather than on every share. */
+	if (decay_due(&client->decay, &now_t, 1))
+		decay_client(client, &now_t);
 	dsps = client->dsps5 / bias;
 	drr = dsps / (double)client->diff;
 
@@ -5763,12 +6091,14 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 		const char *nonce2, const char *nonce, const uint32_t ntime32, const uint32_t version_mask,
 		const bool stale)
 {
-	char blockhash[68], cdfield[64], *gbt_block;
+	char blockhash[68], cdfield[64];
 	sdata_t *sdata = client->sdata;
+	blockreq_t *req;
 	ckpool_t *ckp = wb->ckp;
 	double network_diff;
 	json_t *val = NULL;
 	uchar flip32[32];
+	tv_t solve_tv;
 	ts_t ts_now;
 	bool ret;
 
@@ -5776,6 +6106,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	network_diff = sdata->current_workbase->network_diff * 0.999;
 	if (likely(diff < network_diff))
 		return;
+	tv_time(&solve_tv);
 
 	LOGWARNING("Possible %sblock solve diff %lf !", stale ? "stale share " : "", diff);
 	/* Can't submit a block in proxy mode without the transactions */
@@ -5785,7 +6116,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	ts_realtime(&ts_now);
 	sprintf(cdfield, "%lu,%lu", ts_now.tv_sec, ts_now.tv_nsec);
 
-	gbt_block = process_block(wb, coinbase, cblen, data, hash, flip32, blockhash);
+	req = process_block(wb, coinbase, cblen, data, hash, flip32, blockhash);
 	send_node_block(ckp, sdata, client->enonce1, nonce, nonce2, ntime32, version_mask,
 			wb->id, diff, client->id, coinbase, cblen, data);
 
@@ -5821,7 +6152,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 
 	/* Submit block locally after sending it to remote locations avoiding
 	 * the delay of local verification */
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, req, flip32, wb->height, &solve_tv);
 	if (ret)
 		block_solve(ckp, val);
 	else
@@ -5830,8 +6161,10 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	json_decref(val);
 }
 
-/* Entered with instance_lock held */
-static inline uchar *__user_coinb2(const stratum_instance_t *client, const workbase_t *wb, int *cb2len)
+/* Entered with instance_lock held. Returns the padded coinb2 for the
+ * client's coinbase with its unpadded and padded lengths */
+static inline uchar *__user_coinb2(const stratum_instance_t *client, const workbase_t *wb, int *cb2len,
+				   int *cb2padlen)
 {
 	struct userwb *userwb;
 	int64_t id;
@@ -5844,111 +6177,195 @@ static inline uchar *__user_coinb2(const stratum_instance_t *client, const workb
 	if (unlikely(!userwb))
 		goto out_nouserwb;
 	*cb2len = userwb->coinb2len;
-	return userwb->coinb2bin;
+	*cb2padlen = userwb->coinb2padlen;
+	return userwb->coinb2pad;
 
 out_nouserwb:
 	*cb2len = wb->coinb2len;
-	return wb->coinb2bin;
+	*cb2padlen = wb->coinb2padlen;
+	return wb->coinb2pad;
 }
 
-/* Needs to be entered with workbase readcount and client holding a ref count. */
-static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
-			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
-			      const char *nonce, uchar *hash, const bool stale)
+/* A share's coinbase and block header built ready for hashing, so that the
+ * shares batched up by the share processors can be hashed together */
+typedef struct share_hash {
+	workbase_t *wb;		/* Held with a readcount until hashed */
+	/* Leave ample enough room for donation generation address (~25) + length counter + user generation
+	 * wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 25 + cb2len
+	 * + up to 72 bytes of sha256 padding */
+	char coinbase[1024];
+	int cblen;
+	int padlen;		/* Coinbase length including the sha256 padding */
+	uchar merkle_sha[64];
+	char data[80];		/* Header awaiting its merkle root */
+	uchar swap[80];
+	uchar hash[32];
+	bool hashed;
+} share_hash_t;
+
+/* Build the coinbase and header of a share. Needs to be entered with
+ * workbase readcount and client holding a ref count. */
+static void share_build(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
+			const char *nonce2, const uint32_t ntime32, const uint32_t version_mask,
+			const char *nonce, share_hash_t *sh)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	char *coinbase, data[80];
-	uchar swap[80], hash1[32];
-	int cblen, i, cb2len;
+	uint32_t *data32, benonce32;
+	int cb2len, cb2padlen;
 	uchar *coinb2bin;
-	double ret;
-
-	/* Leave ample enough room for donation generation address (~25) + length counter + user generation
-	 * wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 25 + cb2len */
 
-	coinbase = alloca(1024);
-	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
-	cblen = wb->coinb1len;
-	memcpy(coinbase + cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
-	cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
-	cblen += wb->enonce2varlen;
+	memcpy(sh->coinbase, wb->coinb1bin, wb->coinb1len);
+	sh->cblen = wb->coinb1len;
+	memcpy(sh->coinbase + sh->cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
+	sh->cblen += wb->enonce1constlen + wb->enonce1varlen;
+	hex2bin(sh->coinbase + sh->cblen, nonce2, wb->enonce2varlen);
+	sh->cblen += wb->enonce2varlen;
 
 	ck_rlock(&sdata->instance_lock);
-	coinb2bin = __user_coinb2(client, wb, &cb2len);
-	memcpy(coinbase + cblen, coinb2bin, cb2len);
+	coinb2bin = __user_coinb2(client, wb, &cb2len, &cb2padlen);
+	memcpy(sh->coinbase + sh->cblen, coinb2bin, cb2padlen);
 	ck_runlock(&sdata->instance_lock);
 
-	cblen += cb2len;
+	sh->padlen = sh->cblen + cb2padlen;
+	sh->cblen += cb2len;
 
-	gen_hash((uchar *)coinbase, merkle_root, cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip_32(swap32, data32);
-
-	/* Copy the cached header binary and insert the merkle root */
-	memcpy(data, wb->headerbin, 80);
-	memcpy(data + 36, merkle_root, 32);
+	/* Copy the cached header binary, the merkle root goes in once hashed */
+	memcpy(sh->data, wb->headerbin, 80);
 
 	/* Update nVersion when version_mask is in use */
 	if (version_mask) {
-		version_mask = htobe32(version_mask);
-		data32 = (uint32_t *)data;
-		*data32 |= version_mask;
+		data32 = (uint32_t *)sh->data;
+		*data32 |= htobe32(version_mask);
 	}
 
 	/* Insert the nonce value into the data */
 	hex2bin(&benonce32, nonce, 4);
-	data32 = (uint32_t *)(data + 64 + 12);
+	data32 = (uint32_t *)(sh->data + 64 + 12);
 	*data32 = benonce32;
 
 	/* Insert the ntime value into the data */
-	data32 = (uint32_t *)(data + 68);
+	data32 = (uint32_t *)(sh->data + 68);
 	*data32 = htobe32(ntime32);
+	sh->hashed = false;
+}
 
-	/* Hash the share */
-	data32 = (uint32_t *)data;
-	swap32 = (uint32_t *)swap;
-	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+/* Hash count built shares, as many at once as sha256d_lanes allows. The
+ * coinbases resume from their workbase's coinb1 midstate and the merkle
+ * branches of all the shares are then walked in lockstep. */
+static void share_hash(share_hash_t **shs, const int count)
+{
+	const uint32_t *midstate[count];
+	const uchar *blocks[count];
+	uchar *digest[count];
+	int block_nb[count];
+	int i, level, lanes;
+
+	for (i = 0; i < count; i++) {
+		share_hash_t *sh = shs[i];
+		const workbase_t *wb = sh->wb;
+
+		midstate[i] = wb->coinb1mid;
+		blocks[i] = (const uchar *)sh->coinbase + wb->coinb1midlen;
+		block_nb[i] = (sh->padlen - wb->coinb1midlen) / SHA256_BLOCK_SIZE;
+		digest[i] = sh->merkle_sha;
+	}
+	sha256d_lanes(midstate, blocks, block_nb, digest, count);
+
+	for (level = 0; ; level++) {
+		for (i = lanes = 0; i < count; i++) {
+			share_hash_t *sh = shs[i];
+
+			if (level >= sh->wb->merkles)
+				continue;
+			memcpy(sh->merkle_sha + 32, &sh->wb->merklebin[level], 32);
+			blocks[lanes] = sh->merkle_sha;
+			digest[lanes++] = sh->merkle_sha;
+		}
+		if (!lanes)
+			break;
+		sha256d_64_lanes(blocks, digest, lanes);
+	}
+
+	for (i = 0; i < count; i++) {
+		share_hash_t *sh = shs[i];
+
+		flip_32(sh->data + 36, sh->merkle_sha);
+		flip_80(sh->swap, sh->data);
+		blocks[i] = sh->swap;
+		digest[i] = sh->hash;
+		sh->hashed = true;
+	}
+	sha256d_80_lanes(blocks, digest, count);
+}
+
+/* Needs to be entered with workbase readcount and client holding a ref count.
+ * sh is a share already hashed by a batch or NULL. */
+static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
+			      const char *nonce2, const uint32_t ntime32, const uint32_t version_mask,
+			      const char *nonce, uchar *hash, const bool stale, share_hash_t *sh)
+{
+	share_hash_t *share;
+	double ret;
+
+	if (sh && sh->hashed && sh->wb == wb)
+		share = sh;
+	else {
+		share = alloca(sizeof(share_hash_t));
+		share->wb = (workbase_t *)wb;
+		share_build(sdata, client, wb, nonce2, ntime32, version_mask, nonce, share);
+		share_hash(&share, 1);
+	}
+	memcpy(hash, share->hash, 32);
 
 	/* Calculate the diff of the share here */
 	ret = diff_from_target(hash);
 
 	/* Test we haven't solved a block regardless of share status */
-	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32, version_mask, stale);
+	test_blocksolve(client, wb, share->swap, hash, ret, share->coinbase, share->cblen, nonce2,
+			nonce, ntime32, version_mask ? htobe32(version_mask) : 0, stale);
 
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
+/* Optimised for the common case where shares are new. A dead entry still
+ * counts as a duplicate of a share from its own workbase. */
 static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
+	share_table_t *table = sdata->shares;
+	uint64_t key = share_key(hash);
+	struct share_shard *shard = &table->shards[key >> (64 - SHARE_SHARD_BITS)];
+	int64_t floor = __atomic_load_n(&table->floor, __ATOMIC_RELAXED);
+	int64_t reuse = -1;
 	bool ret = true;
+	uint32_t idx;
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	__atomic_add_fetch(&table->generated, 1, __ATOMIC_RELAXED);
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+	mutex_lock(&shard->lock);
+	for (idx = key & shard->mask; shard->slots[idx].key; idx = (idx + 1) & shard->mask) {
+		struct share_slot *slot = &shard->slots[idx];
+		bool dead = slot->workbase_id < floor;
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
+		if (slot->key == key && (!dead || slot->workbase_id == wb_id) &&
+		    !memcmp(shard->hashes[idx], hash, 32)) {
+			ret = false;
+			goto out_unlock;
+		}
+		if (dead && reuse < 0)
+			reuse = idx;
 	}
+	if (reuse >= 0)
+		idx = reuse;
+	else
+		shard->used++;
+	shard->slots[idx].key = key;
+	shard->slots[idx].workbase_id = wb_id;
+	memcpy(shard->hashes[idx], hash, 32);
+	/* Keep the load factor under 3/4 */
+	if (unlikely(shard->used > shard->mask / 4 * 3))
+		resize_share_shard(shard, floor);
+out_unlock:
+	mutex_unlock(&shard->lock);
+
 	return ret;
 }
 
@@ -6011,78 +6428,156 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 
 #define JSON_ERR(err) json_string(SHARE_ERR(err))
 
-/* Needs to be entered with client holding a ref count. */
+/* The fields of a mining.submit, pointing into its read only json params */
+struct submit_params {
+	const char *workername;
+	const char *job_id;
+	char *nonce2;
+	const char *ntime;
+	char *nonce;
+	const char *version_mask;
+};
+
+static enum share_err parse_submit_params(const json_t *params_val, struct submit_params *sp)
+{
+	if (unlikely(!json_is_array(params_val)))
+		return SE_NOT_ARRAY;
+	if (unlikely(json_array_size(params_val) < 5))
+		return SE_INVALID_SIZE;
+	sp->workername = json_string_value(json_array_get(params_val, 0));
+	if (unlikely(!sp->workername || !strlen(sp->workername)))
+		return SE_NO_USERNAME;
+	sp->job_id = json_string_value(json_array_get(params_val, 1));
+	if (unlikely(!sp->job_id || !strlen(sp->job_id)))
+		return SE_NO_JOBID;
+	sp->nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
+	if (unlikely(!sp->nonce2 || !strlen(sp->nonce2) || !validhex(sp->nonce2)))
+		return SE_NO_NONCE2;
+	sp->ntime = json_string_value(json_array_get(params_val, 3));
+	if (unlikely(!sp->ntime || !strlen(sp->ntime) || !validhex(sp->ntime)))
+		return SE_NO_NTIME;
+	sp->nonce = (char *)json_string_value(json_array_get(params_val, 4));
+	if (unlikely(!sp->nonce || strlen(sp->nonce) < 8 || !validhex(sp->nonce)))
+		return SE_NO_NONCE;
+	sp->version_mask = json_string_value(json_array_get(params_val, 5));
+	return SE_NONE;
+}
+
+/* Fix broken clients sending too many chars. Nonce2 is part of the read only
+ * json so put a fixed copy in nonce2buf, which needs room for 16 chars. Same
+ * with nonce in noncebuf, but we need at least 8 chars which
+ * parse_submit_params checked for. */
+static void fix_submit_nonces(const workbase_t *wb, struct submit_params *sp, char *nonce2buf,
+			      char *noncebuf)
+{
+	int len, nlen;
+
+	len = wb->enonce2varlen * 2;
+	nlen = strlen(sp->nonce2);
+	if (unlikely(nlen != len)) {
+		if (nlen > len)
+			memcpy(nonce2buf, sp->nonce2, len);
+		else {
+			memset(nonce2buf, '0', len);
+			memcpy(nonce2buf, sp->nonce2, nlen);
+		}
+		nonce2buf[len] = '\0';
+		sp->nonce2 = nonce2buf;
+	}
+	len = 8;
+	nlen = strlen(sp->nonce);
+	if (unlikely(nlen > len)) {
+		memcpy(noncebuf, sp->nonce, len);
+		noncebuf[len] = '\0';
+		sp->nonce = noncebuf;
+	}
+}
+
+/* Queue the binary sharelog equivalent of the json share record built by
+ * parse_submit, taking fname. Needs to be entered with client holding a ref
+ * count. */
+static void sharelog_binary_share(sdata_t *sdata, const stratum_instance_t *client, char *fname,
+				  const int64_t id, const char *nonce2, const char *nonce,
+				  const char *ntime, const double diff, const double sdiff,
+				  const char *sharehash, const bool result, const enum share_err err,
+				  const ts_t *now)
+{
+	const char *strings[SLS_STRINGS];
+	struct sharelog_share share = {};
+	ckpool_t *ckp = sdata->ckp;
+	int len;
+
+	share.type = SHARELOG_SHARE;
+	share.result = result;
+	share.errn = err;
+	len = strlen(client->enonce1) / 2;
+	share.enonce1len = MIN(len, (int)sizeof(share.enonce1));
+	hex2bin(share.enonce1, client->enonce1, share.enonce1len);
+	/* Nonce2 of an invalid jobid share is unchecked so may not fit */
+	len = strlen(nonce2) / 2;
+	share.nonce2len = MIN(len, (int)sizeof(share.nonce2));
+	hex2bin(share.nonce2, nonce2, share.nonce2len);
+	sscanf(nonce, "%x", &share.nonce);
+	sscanf(ntime, "%x", &share.ntime);
+	share.workinfoid = id;
+	share.clientid = ckp->remote ? client->virtualid : client->id;
+	share.createsec = now->tv_sec;
+	share.creatensec = now->tv_nsec;
+	share.diff = diff;
+	share.sdiff = sdiff;
+	/* Left zeroed for shares that were never hashed */
+	if (sharehash)
+		memcpy(share.hash, sharehash, 32);
+	strings[SLS_CREATEINET] = ckp->serverurl[client->server];
+	strings[SLS_WORKERNAME] = client->workername;
+	strings[SLS_USERNAME] = client->user_instance->username;
+	strings[SLS_ADDRESS] = client->address;
+	strings[SLS_AGENT] = client->useragent;
+	sharelog_add_share(sdata->sharelog, fname, &share, strings);
+}
+
+/* Needs to be entered with client holding a ref count. sh is the share
+ * already hashed by sshare_batch or NULL. */
 static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+			    const json_t *params_val, json_t **err_val, share_hash_t *sh)
 {
 	bool share = false, result = false, invalid = true, submit = false, stale = false;
-	const char *workername, *job_id, *ntime, *version_mask;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
 	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce, *nonce2;
+	const char *workername, *job_id, *ntime;
+	char nonce2buf[20], noncebuf[12];
 	uint32_t ntime32, version_mask32 = 0;
 	sdata_t *sdata = client->sdata;
+	char *fname = NULL, *s, *nonce, *nonce2;
 	enum share_err err = SE_NONE;
 	ckpool_t *ckp = client->ckp;
 	char idstring[24] = {};
+	struct submit_params sp;
 	workbase_t *wb = NULL;
 	uchar hash[32];
-	int nlen, len;
 	time_t now_t;
 	json_t *val;
 	int64_t id;
 	ts_t now;
-	FILE *fp;
 
 	ts_realtime(&now);
 	now_t = now.tv_sec;
 	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (unlikely(json_array_size(params_val) < 5)) {
-		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	workername = json_string_value(json_array_get(params_val, 0));
-	if (unlikely(!workername || !strlen(workername))) {
-		err = SE_NO_USERNAME;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	job_id = json_string_value(json_array_get(params_val, 1));
-	if (unlikely(!job_id || !strlen(job_id))) {
-		err = SE_NO_JOBID;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
-	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
-		err = SE_NO_NONCE2;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	ntime = json_string_value(json_array_get(params_val, 3));
-	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
-		err = SE_NO_NTIME;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	nonce = (char *)json_string_value(json_array_get(params_val, 4));
-	if (unlikely(!nonce || strlen(nonce) < 8 || !validhex(nonce))) {
-		err = SE_NO_NONCE;
+	err = parse_submit_params(params_val, &sp);
+	if (unlikely(err != SE_NONE)) {
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
+	workername = sp.workername;
+	job_id = sp.job_id;
+	ntime = sp.ntime;
+	nonce2 = sp.nonce2;
+	nonce = sp.nonce;
 
-	version_mask = json_string_value(json_array_get(params_val, 5));
-	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
-		sscanf(version_mask, "%x", &version_mask32);
+	if (sp.version_mask && strlen(sp.version_mask) && validhex(sp.version_mask)) {
+		sscanf(sp.version_mask, "%x", &version_mask32);
 		// check version mask
 		if (version_mask32 && ((~ckp->version_mask) & version_mask32) != 0) {
 			// means client changed some bits which server doesn't allow to change
@@ -6110,39 +6605,19 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 		err = SE_INVALID_JOBID;
 		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
+		ASPRINTF(&fname, "%s.%s", sdata->current_workbase->logdir,
+			 ckp->binarysharelog ? "sharebin" : "sharelog");
 		goto out_nowb;
 	}
 	wdiff = wb->diff;
 	strncpy(idstring, wb->idstring, 20);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
-	/* Fix broken clients sending too many chars. Nonce2 is part of the
-	 * read only json so use a temporary variable and modify it. */
-	len = wb->enonce2varlen * 2;
-	nlen = strlen(nonce2);
-	if (unlikely(nlen != len)) {
-		if (nlen > len) {
-			nonce2 = strdupa(nonce2);
-			nonce2[len] = '\0';
-		} else if (nlen < len) {
-			char *tmp = nonce2;
-
-			nonce2 = strdupa("0000000000000000");
-			memcpy(nonce2, tmp, nlen);
-			nonce2[len] = '\0';
-		}
-	}
-	/* Same with nonce, but we need at least 8 chars. We checked for this
-	 * earlier. */
-	len = 8;
-	nlen = strlen(nonce);
-	if (unlikely(nlen > len)) {
-		nonce = strdupa(nonce);
-		nonce[len] = '\0';
-	}
+	ASPRINTF(&fname, "%s.%s", wb->logdir, ckp->binarysharelog ? "sharebin" : "sharelog");
+	fix_submit_nonces(wb, &sp, nonce2buf, noncebuf);
+	nonce2 = sp.nonce2;
+	nonce = sp.nonce;
 	if (id < sdata->blockchange_id)
 		stale = true;
-	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale);
+	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale, sh);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
@@ -6259,17 +6734,14 @@ out_nowb:
         json_set_string(val, "agent", client->useragent);
 
 	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
+		if (ckp->binarysharelog) {
+			sharelog_binary_share(sdata, client, fname, id, nonce2, nonce, ntime, diff,
+					      sdiff, hexhash[0] ? sharehash : NULL, result, err, &now);
+		} else {
 			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
+			sharelog_add(sdata->sharelog, fname, s, strlen(s));
+		}
+		fname = NULL;
 	}
 	if (ckp->remote)
 		upstream_json_msgtype(ckp, val, SM_SHARE);
@@ -6386,55 +6858,79 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 {
 	int64_t id = wb->id;
 	struct userwb *userwb;
-	json_t *val;
 
 	HASH_FIND_I64(user->userwbs, &id, userwb);
 	if (unlikely(!userwb)) {
 		LOGINFO("Failed to find userwb in __user_notify!");
 		return NULL;
 	}
-
-	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
-			"params",
-			wb->idstring,
-			wb->prevhash,
-			wb->coinb1,
-			userwb->coinb2,
-			json_deep_copy(wb->merkle_array),
-			wb->bbversion,
-			wb->nbit,
-			wb->ntime,
-			clean,
-			"id", json_null(),
-			"method", "mining.notify");
-	return val;
+	return userwb_notify(wb, userwb, clean);
 }
 
-/* Sends a stratum update with a unique coinb2 for every client. Avoid
+/* Sends a stratum update with a unique coinb2 for every user, sharing the
+ * notify serialised for each user's userwb between all its clients in one
+ * pass under the instance read lock. Passthrough subclients need node.method
+ * so they are sent theirs as json once the lock is released to avoid
  * recursive locking. */
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
 {
+	ckmsg_t *bulk_send = NULL, *sub_sends = NULL, *client_msg, *tmpmsg;
+	struct userwb *userwb = NULL;
 	stratum_instance_t *client, *tmp;
-	json_t *json_msg;
+	user_instance_t *user = NULL;
+	int messages = 0;
+	int64_t id;
 
-	ck_wlock(&sdata->instance_lock);
+	if (sdata->ckp->node)
+		return;
+
+	ck_rlock(&sdata->workbase_lock);
+	id = sdata->current_workbase->id;
+	ck_runlock(&sdata->workbase_lock);
+
+	ck_rlock(&sdata->instance_lock);
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
+		smsg_t *msg;
+
 		if (!client->user_instance)
 			continue;
-		__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+		/* Clients of the same user tend to be together */
+		if (client->user_instance != user) {
+			user = client->user_instance;
+			HASH_FIND_I64(user->userwbs, &id, userwb);
+		}
+		if (unlikely(!userwb)) {
+			LOGINFO("Failed to find userwb in stratum_broadcast_updates!");
+			continue;
+		}
 
-		ck_rlock(&sdata->workbase_lock);
-		json_msg = __user_notify(sdata->current_workbase, client->user_instance, clean);
-		ck_runlock(&sdata->workbase_lock);
+		client_msg = ckalloc(sizeof(ckmsg_t));
+		msg = ckzalloc(sizeof(smsg_t));
+		msg->client_id = client->id;
+		client_msg->data = msg;
+		if (subclient(client->id)) {
+			msg->json_msg = json_loads(userwb->notify[clean]->buf, 0, NULL);
+			DL_APPEND(sub_sends, client_msg);
+			continue;
+		}
+		msg->bcast = userwb->notify[clean];
+		ref_bcast(msg->bcast);
+		DL_APPEND(bulk_send, client_msg);
+		messages++;
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	if (likely(bulk_send))
+		ssend_bulk_append(sdata, bulk_send, messages);
 
-		if (likely(json_msg))
-			stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+	DL_FOREACH_SAFE(sub_sends, client_msg, tmpmsg) {
+		smsg_t *msg = client_msg->data;
 
-		ck_wlock(&sdata->instance_lock);
-		__dec_instance_ref(client);
+		DL_DELETE(sub_sends, client_msg);
+		stratum_add_send(sdata, msg->json_msg, msg->client_id, SM_UPDATE);
+		free(msg);
+		free(client_msg);
 	}
-	ck_wunlock(&sdata->instance_lock);
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -6606,7 +7102,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
 
-		ckmsgq_add(sdata->sshareq, jp);
+		ckmsgq_add_id(sdata->sshareq, client_id, jp);
 		return;
 	}
 
@@ -6960,11 +7456,11 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	user->shares += diff;
 	tv_time(&now_t);
 
-	decay_worker(worker, diff, &now_t);
+	add_decay(&worker->decay, diff);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	add_decay(&user->decay, diff);
 	copy_tv(&user->last_share, &now_t);
 
 	LOGINFO("Added %.0lf remote shares to worker %s", diff, workername);
@@ -7175,23 +7671,25 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	if (unlikely(!wb))
 		LOGWARNING("Inadequate data locally to attempt submit of remote block");
 	else {
-		uchar swap[80], hash[32], hash1[32], flip32[32];
-		char *coinbase = alloca(cblen), *gbt_block;
+		uchar swap[80], hash[32], flip32[32];
+		char *coinbase = alloca(cblen);
 		char blockhash[68];
+		blockreq_t *req;
+		tv_t solve_tv;
 
+		tv_time(&solve_tv);
 		LOGWARNING("Possible remote block solve diff %lf !", diff);
 		hex2bin(coinbase, coinbasehex, cblen);
 		hex2bin(swap, swaphex, 80);
-		sha256(swap, 80, hash1);
-		sha256(hash1, 32, hash);
-		gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
+		sha256d_80(swap, hash);
+		req = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
 		/* Note nodes use jobid of the mapped_id instead of workinfoid */
 		json_set_int64(val, "jobid", wb->mapped_id);
 		send_nodes_block(sdata, val, client_id);
 		/* We rely on the remote server to give us the ID_BLOCK
 		 * responses, so only use this response to determine if we
 		 * should reset the best shares. */
-		if (local_block_submit(ckp, gbt_block, flip32, wb->height)) {
+		if (local_block_submit(ckp, req, flip32, wb->height, &solve_tv)) {
 			block_share_summary(sdata);
 			reset_bestshares(sdata);
 		}
@@ -7260,7 +7758,7 @@ static void add_node_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *val)
 			continue;
 		}
 
-		if (add_txn(ckp, sdata, &txns, hash, data, false))
+		if (add_txn(ckp, sdata, &txns, hash, data, strlen(data), false))
 			added++;
 	}
 
@@ -7402,7 +7900,7 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	switch (msg_type) {
 		case SM_SHARE:
 			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			ckmsgq_add_id(sdata->sshareq, client->id, jp);
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -7520,6 +8018,7 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 {
 	char address[INET6_ADDRSTRLEN], *buf = NULL;
 	bool noid = false, dropped = false;
+	struct instance_shard *shard;
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
 	smsg_t *msg;
@@ -7565,17 +8064,25 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 	json_object_clear(val);
 
 	/* Parse the message here */
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, msg->client_id);
+	shard = instance_shard(sdata, msg->client_id);
+	ck_rlock(&shard->lock);
+	client = __shard_instance_by_id(shard, msg->client_id);
+	if (likely(client) && unlikely(!__try_instance_ref(client)))
+		dropped = true;
+	ck_runlock(&shard->lock);
+
 	/* If client_id instance doesn't exist yet, create one */
 	if (unlikely(!client)) {
-		noid = true;
-		client = __stratum_add_instance(ckp, msg->client_id, address, server);
-	} else if (unlikely(client->dropped))
-		dropped = true;
-	if (likely(!dropped))
-		__inc_instance_ref(client);
-	ck_wunlock(&sdata->instance_lock);
+		ck_wlock(&sdata->instance_lock);
+		client = __instance_by_id(sdata, msg->client_id);
+		if (likely(!client)) {
+			noid = true;
+			client = __stratum_add_instance(ckp, msg->client_id, address, server);
+		}
+		if (unlikely(!__try_instance_ref(client)))
+			dropped = true;
+		ck_wunlock(&sdata->instance_lock);
+	}
 
 	if (unlikely(dropped)) {
 		/* Client may be NULL here */
@@ -7601,6 +8108,7 @@ out:
 
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line)
 {
+	int64_t client_id;
 	sdata_t *sdata;
 
 	if (unlikely(!val)) {
@@ -7608,23 +8116,23 @@ void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const ch
 		return;
 	}
 	sdata = ckp->sdata;
-	ckmsgq_add(sdata->srecvs, val);
+	/* Route by client so its messages are processed in order by one
+	 * worker in clientaffinity mode. Node messages have no client_id */
+	client_id = json_integer_value(json_object_get(val, "client_id"));
+	ckmsgq_add_id(sdata->srecvs, client_id, val);
 }
 
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
-	if (unlikely(!msg->json_msg)) {
+	if (unlikely(!msg->json_msg && !msg->bcast)) {
 		LOGERR("Sent null json msg to stratum_sender");
 		free(msg);
 		return;
 	}
 
-	/* Add client_id to the json message and send it to the
-	 * connector process to be delivered */
-	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
-	connector_add_message(ckp, msg->json_msg);
-	/* The connector will free msg->json_msg */
-	free(msg);
+	/* Send the message to the connector to be delivered. The connector
+	 * will free msg and its json_msg or bcast reference */
+	connector_add_message(ckp, msg);
 }
 
 static void discard_json_params(json_params_t *jp)
@@ -7643,53 +8151,126 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
-static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+/* Ref the client submitting a share if it can still do so */
+static stratum_instance_t *sshare_client(sdata_t *sdata, const int64_t client_id)
 {
-	json_t *result_val, *json_msg, *err_val = NULL;
 	stratum_instance_t *client;
-	sdata_t *sdata = ckp->sdata;
-	int64_t client_id;
-
-	client_id = jp->client_id;
 
 	client = ref_instance_by_id(sdata, client_id);
 	if (unlikely(!client)) {
 		LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
-		goto out;
+		return NULL;
 	}
 	if (unlikely(!client->authorised)) {
 		LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
-		goto out_decref;
+		dec_instance_ref(sdata, client);
+		return NULL;
 	}
+	return client;
+}
+
+/* Needs to be entered with client holding a ref count. */
+static void sshare_submit(sdata_t *sdata, stratum_instance_t *client, json_params_t *jp,
+			  share_hash_t *sh)
+{
+	json_t *result_val, *json_msg, *err_val = NULL;
+
 	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
+	result_val = parse_submit(client, json_msg, jp->params, &err_val, sh);
 	json_object_set_new_nocheck(json_msg, "result", result_val);
 	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
 	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
-out_decref:
-	dec_instance_ref(sdata, client);
-out:
+	stratum_add_send(sdata, json_msg, client->id, SM_SHARERESULT);
+}
+
+static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+{
+	sdata_t *sdata = ckp->sdata;
+	stratum_instance_t *client;
+
+	client = sshare_client(sdata, jp->client_id);
+	if (likely(client)) {
+		sshare_submit(sdata, client, jp, NULL);
+		dec_instance_ref(sdata, client);
+	}
 	discard_json_params(jp);
 }
 
+/* Build the share in jp ready for hashing if it parses far enough to have a
+ * workbase, taking a readcount on it. parse_submit validates it in full
+ * afterwards and only uses the hash if it gets that far. Needs to be entered
+ * with client holding a ref count. */
+static bool sshare_prepare(sdata_t *sdata, const stratum_instance_t *client, json_params_t *jp,
+			   share_hash_t *sh)
+{
+	char nonce2buf[20], noncebuf[12];
+	uint32_t ntime32, version_mask32 = 0;
+	struct submit_params sp;
+	int64_t id;
+
+	if (parse_submit_params(jp->params, &sp) != SE_NONE)
+		return false;
+	if (sp.version_mask && strlen(sp.version_mask) && validhex(sp.version_mask))
+		sscanf(sp.version_mask, "%x", &version_mask32);
+	sscanf(sp.job_id, "%lx", &id);
+	sscanf(sp.ntime, "%x", &ntime32);
+	sh->wb = get_workbase(sdata, id);
+	if (unlikely(!sh->wb))
+		return false;
+	fix_submit_nonces(sh->wb, &sp, nonce2buf, noncebuf);
+	share_build(sdata, client, sh->wb, sp.nonce2, ntime32, version_mask32, sp.nonce, sh);
+	return true;
+}
+
+/* Batch version of sshare_process used when several shares can be hashed at
+ * once. The queued shares are built and hashed together, then each is
+ * processed in order as sshare_process would, using its hash. */
+static void sshare_batch(ckpool_t *ckp, json_params_t **jps, const int count)
+{
+	stratum_instance_t *clients[count];
+	share_hash_t *shs, *hashes[count];
+	sdata_t *sdata = ckp->sdata;
+	int i, built = 0;
+
+	shs = ckalloc(sizeof(share_hash_t) * count);
+	for (i = 0; i < count; i++) {
+		clients[i] = sshare_client(sdata, jps[i]->client_id);
+		shs[i].wb = NULL;
+		shs[i].hashed = false;
+		if (clients[i] && sshare_prepare(sdata, clients[i], jps[i], &shs[i]))
+			hashes[built++] = &shs[i];
+	}
+	if (built)
+		share_hash(hashes, built);
+
+	for (i = 0; i < count; i++) {
+		if (clients[i]) {
+			sshare_submit(sdata, clients[i], jps[i], &shs[i]);
+			dec_instance_ref(sdata, clients[i]);
+		}
+		if (shs[i].wb)
+			put_workbase(sdata, shs[i].wb);
+		discard_json_params(jps[i]);
+	}
+	free(shs);
+}
+
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
  * and sets the authorising flag */
 static stratum_instance_t *preauth_ref_instance_by_id(sdata_t *sdata, const int64_t id)
 {
+	struct instance_shard *shard = instance_shard(sdata, id);
 	stratum_instance_t *client;
 
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, id);
+	ck_wlock(&shard->lock);
+	client = __shard_instance_by_id(shard, id);
 	if (client) {
-		if (client->dropped || client->authorising || client->authorised)
+		if (client->authorising || client->authorised || !__try_instance_ref(client))
 			client = NULL;
-		else {
-			__inc_instance_ref(client);
+		else
 			client->authorising = true;
-		}
 	}
-	ck_wunlock(&sdata->instance_lock);
+	ck_wunlock(&shard->lock);
 
 	return client;
 }
@@ -7755,7 +8336,7 @@ static void sauth_process(ckpool_t *ckp, json_params_t *jp)
 	if (client->remote) {
 		/* We don't need to keep a record of clients on remote trusted
 		 * servers after auth'ing them. */
-		client->dropped = true;
+		mark_dropped(client);
 		goto out;
 	}
 
@@ -7970,10 +8551,13 @@ static void *statsupdate(void *arg)
 		char suffix360[16], suffix1440[16], suffix10080[16];
 		int remote_users = 0, remote_workers = 0, idle_workers = 0;
 		log_entry_t *log_entries = NULL;
+		stratum_instance_t *client, *next;
 		char_entry_t *char_list = NULL;
-		stratum_instance_t *client;
+		char_entry_t *entries = NULL;
 		user_instance_t *user;
 		char *fname, *s, *sp;
+		char *msg = NULL;
+		int drops = 0;
 		tv_t now, diff;
 		ts_t ts_now;
 		json_t *val;
@@ -8003,15 +8587,14 @@ static void *statsupdate(void *arg)
 				/* Test for clients that haven't authed in over a minute
 				 * and drop them lazily */
 				if (now.tv_sec > client->start_time + 60) {
-					client->dropped = true;
+					mark_dropped(client);
 					connector_drop_client(ckp, client->id);
 				}
 			} else {
-				per_tdiff = tvdiff(&now, &client->last_share);
 				/* Decay times per connected instance */
+				decay_client(client, &now);
+				per_tdiff = tvdiff(&now, &client->last_share);
 				if (per_tdiff > 60) {
-					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
 					idle_workers++;
 					if (per_tdiff > 600)
 						client->idle = true;
@@ -8021,16 +8604,26 @@ static void *statsupdate(void *arg)
 			}
 
 			ck_wlock(&sdata->instance_lock);
+			next = client->hh.next;
+			/* Grab a reference to the next client allowing us to
+			 * examine it without holding the lock */
+			if (likely(next))
+				__inc_instance_ref(next);
 			/* Drop the reference of the last entry we examined,
-			 * then grab the next client. */
-			__dec_instance_ref(client);
-			client = client->hh.next;
-			/* Grab a reference to this client allowing us to examine
-			 * it without holding the lock */
-			if (likely(client))
-				__inc_instance_ref(client);
+			 * removing it if it was dropped while we held it. */
+			if (unlikely(__dec_instance_ref(client) == INSTANCE_DROPPED)) {
+				__drop_client(sdata, client, true, &msg);
+				if (msg)
+					add_msg_entry(&entries, &msg);
+				drops++;
+			}
+			client = next;
 			ck_wunlock(&sdata->instance_lock);
 		}
+		if (entries)
+			notice_msg_entries(&entries);
+		if (drops)
+			reap_proxies(ckp, sdata);
 
 		user = NULL;
 
@@ -8050,8 +8643,7 @@ static void *statsupdate(void *arg)
 				LOGDEBUG("Skipping inactive user %s", user->username);
 				continue;
 			}
-			if (per_tdiff > 60)
-				decay_user(user, 0, &now);
+			decay_user(user, &now);
 
 			ghs = user->dsps1440 * nonces;
 			suffix_string(ghs, suffix1440, 16, 0);
@@ -8103,9 +8695,9 @@ static void *statsupdate(void *arg)
 			while ((worker = next_worker(sdata, user, worker)) != NULL) {
 				json_t *wval;
 
+				decay_worker(worker, &now);
 				per_tdiff = tvdiff(&now, &worker->last_share);
 				if (per_tdiff > 60) {
-					decay_worker(worker, 0, &now);
 					worker->idle = true;
 					/* Drop storage of workers idle for 1 week */
 					if (per_tdiff > 600000) {
@@ -8565,7 +9157,7 @@ void *stratifier(void *arg)
 {
 	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify;
 	proc_instance_t *pi = (proc_instance_t *)arg;
-	int threads, tvsec_diff = 0;
+	int threads, tvsec_diff = 0, i;
 	ckpool_t *ckp = pi->ckp;
 	int64_t randomiser;
 	sdata_t *sdata;
@@ -8622,18 +9214,35 @@ void *stratifier(void *arg)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
 
 	cklock_init(&sdata->instance_lock);
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		cklock_init(&sdata->instance_shards[i].lock);
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
 
+	sdata->shares = create_share_table(SHARE_SHARD_SLOTS);
+
 	/* Create half as many share processing and receiving threads as there
 	 * are CPUs */
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
 	sdata->updateq = create_ckmsgq(ckp, "updater", &block_update);
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
+	/* Hash queued shares together when the sha256 code can do several at
+	 * once faster than one at a time */
+	if (sha256_lanes() > 1) {
+		sdata->sshareq = create_batch_ckmsgqs(ckp, "sprocessor", &sshare_batch, threads,
+						      sha256_lanes(), ckp->clientaffinity);
+	} else if (ckp->clientaffinity)
+		sdata->sshareq = create_affine_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
+	else
+		sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
+	if (ckp->clientaffinity)
+		sdata->srecvs = create_affine_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	else
+		sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
 	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
-	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	if (ckp->logshares)
+		sdata->sharelog = create_sharelog(ckp);
 	create_pthread(&pth_throbber, throbber, ckp);
 	read_poolstats(ckp, &tvsec_diff);
 	read_userstats(ckp, sdata, tvsec_diff);
@@ -8654,7 +9263,6 @@ void *stratifier(void *arg)
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
-	mutex_init(&sdata->share_lock);
 	if (!ckp->proxy)
 		create_pthread(&pth_zmqnotify, zmqnotify, ckp);
 
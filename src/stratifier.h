@@ -48,7 +48,8 @@ struct genwork {
 	int height;
 	char *flags;
 	int txns;
-	char *txn_data;
+	blockreq_t *blockreq; // submitblock request template with the txns
+	gbt_txns_t *gtxns; // txns of a new template until decoded into the above
 	char *txn_hashes;
 	char witnessdata[80]; //null-terminated ascii
 	bool insert_witness;
@@ -75,6 +76,13 @@ struct genwork {
 	char *coinb3bin; // coinbase3 for variable coinb2len
 	int coinb3len; // length of above
 
+	/* Sha256 midstate of the whole 64 byte blocks at the start of coinb1
+	 * and coinb2 with the sha256 padding of the full coinbase appended */
+	uint32_t coinb1mid[8];
+	int coinb1midlen; // length of coinb1 covered by the midstate
+	uchar *coinb2pad;
+	int coinb2padlen; // length of above including coinb2 itself
+
 	/* Cached header binary */
 	char headerbin[112];
 
@@ -0,0 +1,494 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "uring.h"
+
+/* The single group of provided buffers every receive picks from */
+#define URING_BGID 0
+
+/* User data of the poll on the eventfd waking the reaping thread */
+#define URING_WAKE 0
+
+struct uring {
+	int fd;
+
+	/* Written by other threads to wake the reaping thread to submit what
+	 * they queued, with a multishot poll on it once wake_armed is set */
+	int wakefd;
+	bool wake_armed;
+	pthread_t reaper;
+
+	/* Protects queueing requests on the submission ring */
+	mutex_t sq_lock;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	/* Tail of the requests we have queued, published to sq_tail */
+	unsigned sqe_tail;
+
+	/* Only accessed by the reaping thread */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/* Provided buffers, recycled only by the reaping thread */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	unsigned buf_mask;
+	char *bufs;
+	int bufsize;
+};
+
+static int sys_uring_setup(const unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete,
+			   const unsigned flags, void *arg, const size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(const int fd, const unsigned opcode, void *arg,
+			      const unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned __uring_pending(uring_t *ring)
+{
+	return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Submit the requests the kernel has not taken yet. Errors from the kernel
+ * being busy leave them queued for the next submission. Must hold sq_lock */
+static void __uring_submit(uring_t *ring)
+{
+	unsigned pending = __uring_pending(ring);
+
+	if (pending && sys_uring_enter(ring->fd, pending, 0, 0, NULL, 0) < 0 &&
+	    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		LOGERR("Failed to submit to io_uring: %s", strerror(errno));
+}
+
+/* Get the next free submission entry. When the submission ring is full the
+ * reaping thread can submit what is queued to make room but other threads
+ * are stuck until it does. Must hold sq_lock */
+static struct io_uring_sqe *__uring_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (unlikely(__uring_pending(ring) >= ring->sq_entries)) {
+		if (pthread_equal(pthread_self(), ring->reaper))
+			__uring_submit(ring);
+		if (__uring_pending(ring) >= ring->sq_entries) {
+			LOGERR("Submission ring of io_uring full");
+			return NULL;
+		}
+	}
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/* Publish the sqe from __uring_sqe for the next submission. Must hold
+ * sq_lock */
+static void __uring_queue(uring_t *ring)
+{
+	__atomic_store_n(ring->sq_tail, ++ring->sqe_tail, __ATOMIC_RELEASE);
+}
+
+static bool uring_wake(uring_t *ring, const bool wake)
+{
+	if (wake && unlikely(eventfd_write(ring->wakefd, 1))) {
+		LOGERR("Failed to wake io_uring reaping thread: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool uring_recv(uring_t *ring, const int fd, const uint64_t data, const bool wake)
+{
+	struct io_uring_sqe *sqe;
+	bool ret = false;
+
+	mutex_lock(&ring->sq_lock);
+	sqe = __uring_sqe(ring);
+	if (likely(sqe)) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = data;
+		__uring_queue(ring);
+		ret = true;
+	}
+	mutex_unlock(&ring->sq_lock);
+
+	if (likely(ret))
+		ret = uring_wake(ring, wake);
+	return ret;
+}
+
+bool uring_accept(uring_t *ring, const int fd, const uint64_t data, const bool wake)
+{
+	struct io_uring_sqe *sqe;
+	bool ret = false;
+
+	mutex_lock(&ring->sq_lock);
+	sqe = __uring_sqe(ring);
+	if (likely(sqe)) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = data;
+		__uring_queue(ring);
+		ret = true;
+	}
+	mutex_unlock(&ring->sq_lock);
+
+	if (likely(ret))
+		ret = uring_wake(ring, wake);
+	return ret;
+}
+
+bool uring_poll(uring_t *ring, const int fd, const unsigned events, const uint64_t data,
+		const bool wake)
+{
+	struct io_uring_sqe *sqe;
+	bool ret = false;
+
+	mutex_lock(&ring->sq_lock);
+	sqe = __uring_sqe(ring);
+	if (likely(sqe)) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		sqe->poll32_events = (events << 16) | (events >> 16);
+#else
+		sqe->poll32_events = events;
+#endif
+		sqe->user_data = data;
+		__uring_queue(ring);
+		ret = true;
+	}
+	mutex_unlock(&ring->sq_lock);
+
+	if (likely(ret))
+		ret = uring_wake(ring, wake);
+	return ret;
+}
+
+/* Submits anything queued and copies out up to max completions, waiting up
+ * to timeout ms if there are none */
+static int __uring_wait(uring_t *ring, struct io_uring_cqe *cqes, const int max, const int timeout)
+{
+	unsigned head = *ring->cq_head, tail, pending;
+	int i;
+
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	mutex_lock(&ring->sq_lock);
+	pending = __uring_pending(ring);
+	mutex_unlock(&ring->sq_lock);
+
+	/* Submit and wait in the one call, only waiting if there are no
+	 * completions to reap already */
+	if (head == tail || pending) {
+		struct io_uring_getevents_arg arg;
+		struct __kernel_timespec ts;
+
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		if (sys_uring_enter(ring->fd, pending, head == tail ? 1 : 0,
+				    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+				    sizeof(arg)) < 0) {
+			if (errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				return -1;
+		}
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+	for (i = 0; i < max && head != tail; i++, head++)
+		cqes[i] = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return i;
+}
+
+/* Keep a multishot poll on the wakefd so other threads queueing requests can
+ * wake us from waiting to submit them */
+static bool uring_arm_wake(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	mutex_lock(&ring->sq_lock);
+	sqe = __uring_sqe(ring);
+	if (likely(sqe)) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = ring->wakefd;
+		sqe->len = IORING_POLL_ADD_MULTI;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		sqe->poll32_events = POLLIN << 16;
+#else
+		sqe->poll32_events = POLLIN;
+#endif
+		sqe->user_data = URING_WAKE;
+		__uring_queue(ring);
+		ring->reaper = pthread_self();
+		ring->wake_armed = true;
+	}
+	mutex_unlock(&ring->sq_lock);
+
+	return ring->wake_armed;
+}
+
+int uring_wait(uring_t *ring, struct io_uring_cqe *cqes, const int max, const int timeout)
+{
+	int i, j, ret;
+
+	if (unlikely(!ring->wake_armed) && unlikely(!uring_arm_wake(ring)))
+		return -1;
+	ret = __uring_wait(ring, cqes, max, timeout);
+	/* Drop the wakeups, which only needed to get us here */
+	for (i = j = 0; i < ret; i++) {
+		if (cqes[i].user_data != URING_WAKE) {
+			if (i != j)
+				cqes[j] = cqes[i];
+			j++;
+			continue;
+		}
+		if (cqes[i].res > 0) {
+			eventfd_t val;
+
+			eventfd_read(ring->wakefd, &val);
+		}
+		if (!(cqes[i].flags & IORING_CQE_F_MORE))
+			ring->wake_armed = false;
+	}
+	return ret < 0 ? ret : j;
+}
+
+char *uring_buf(uring_t *ring, const struct io_uring_cqe *cqe)
+{
+	return ring->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * ring->bufsize;
+}
+
+/* Set each field on its own since the ring's tail overlays the resv field of
+ * the first buffer */
+static void add_buf(uring_t *ring, const unsigned bid, const unsigned offset)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring->buf_ring->bufs[(ring->buf_ring->tail + offset) & ring->buf_mask];
+	buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->bufsize);
+	buf->len = ring->bufsize;
+	buf->bid = bid;
+}
+
+void uring_recycle_buf(uring_t *ring, const struct io_uring_cqe *cqe)
+{
+	add_buf(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT, 0);
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Make sure multishot receives into provided buffers, which only newer
+ * kernels support, work on a socketpair */
+static bool test_recv(uring_t *ring)
+{
+	struct io_uring_cqe cqe;
+	bool ret = false;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return false;
+	if (!uring_recv(ring, sv[0], 1, false) || write(sv[1], "", 1) != 1)
+		goto out;
+	if (__uring_wait(ring, &cqe, 1, 1000) == 1 && cqe.res == 1 &&
+	    (cqe.flags & IORING_CQE_F_MORE) && (cqe.flags & IORING_CQE_F_BUFFER)) {
+		uring_recycle_buf(ring, &cqe);
+		ret = true;
+	}
+out:
+	shutdown(sv[0], SHUT_RDWR);
+	/* Reap the end of the receive */
+	while (__uring_wait(ring, &cqe, 1, 100) == 1) {
+		if (cqe.flags & IORING_CQE_F_BUFFER)
+			uring_recycle_buf(ring, &cqe);
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			break;
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+/* nbufs must be a power of 2 */
+uring_t *uring_init(const unsigned entries, const int nbufs, const int bufsize)
+{
+	uring_t *ring = ckzalloc(sizeof(uring_t));
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	unsigned *sq_array;
+	unsigned i;
+
+	ring->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->wakefd < 0) {
+		ring->fd = -1;
+		LOGINFO("Failed to create eventfd for io_uring: %s", strerror(errno));
+		goto out_free;
+	}
+	memset(&params, 0, sizeof(params));
+	/* Room for a multishot receive's completions to pile up per entry */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+#ifdef IORING_SETUP_COOP_TASKRUN
+	/* The reaping thread is the only one submitting so it never needs
+	 * interrupting to complete requests */
+	params.flags |= IORING_SETUP_COOP_TASKRUN;
+	ring->fd = sys_uring_setup(entries, &params);
+	if (ring->fd < 0 && errno == EINVAL) {
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 4;
+		ring->fd = sys_uring_setup(entries, &params);
+	}
+#else
+	ring->fd = sys_uring_setup(entries, &params);
+#endif
+	if (ring->fd < 0) {
+		LOGINFO("Failed to set up io_uring: %s", strerror(errno));
+		goto out_free;
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+		LOGINFO("Kernel io_uring lacks wait timeouts or overflow protection");
+		goto out_free;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto out_free;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto out_free;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto out_free;
+	}
+
+	ring->sq_head = ring->sq_ring + params.sq_off.head;
+	ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+	ring->sq_mask = *(unsigned *)(ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+	/* Each slot of the submission ring always holds its own sqe */
+	sq_array = ring->sq_ring + params.sq_off.array;
+	for (i = 0; i < params.sq_entries; i++)
+		sq_array[i] = i;
+	ring->cq_head = ring->cq_ring + params.cq_off.head;
+	ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+	ring->cq_mask = *(unsigned *)(ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+	ring->buf_ring_size = round_up_page(sizeof(struct io_uring_buf) * nbufs);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		goto out_free;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	reg.ring_entries = nbufs;
+	reg.bgid = URING_BGID;
+	if (sys_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		LOGINFO("Kernel io_uring lacks provided buffer rings: %s", strerror(errno));
+		goto out_free;
+	}
+	ring->buf_mask = nbufs - 1;
+	ring->bufsize = bufsize;
+	ring->bufs = ckalloc((size_t)nbufs * bufsize);
+	for (i = 0; i < (unsigned)nbufs; i++)
+		add_buf(ring, i, i);
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_ring->tail + nbufs, __ATOMIC_RELEASE);
+
+	mutex_init(&ring->sq_lock);
+	if (!test_recv(ring)) {
+		LOGINFO("Kernel io_uring lacks multishot receives");
+		goto out_free;
+	}
+	return ring;
+
+out_free:
+	uring_free(ring);
+	return NULL;
+}
+
+void uring_free(uring_t *ring)
+{
+	if (ring->fd > -1)
+		close(ring->fd);
+	if (ring->wakefd > -1)
+		close(ring->wakefd);
+	if (ring->buf_ring)
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	free(ring->bufs);
+	free(ring);
+}
+
+#endif /* USE_IO_URING */
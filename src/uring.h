@@ -0,0 +1,79 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libckpool.h"
+
+/* A minimal io_uring instance driven with the raw syscalls, with one group of
+ * provided buffers that multishot receives pick from. Any thread can queue
+ * requests but only one thread reaps completions and recycles buffers, and
+ * only it submits so the kernel always completes requests in its context
+ * instead of interrupting other threads to. User data 0 is reserved. */
+typedef struct uring uring_t;
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+
+/* Returns NULL if the kernel cannot do everything the connector needs */
+uring_t *uring_init(const unsigned entries, const int nbufs, const int bufsize);
+void uring_free(uring_t *ring);
+
+/* Queue requests for the next uring_wait of the reaping thread to submit,
+ * waking it if it is waiting when wake is set */
+bool uring_recv(uring_t *ring, const int fd, const uint64_t data, const bool wake);
+bool uring_accept(uring_t *ring, const int fd, const uint64_t data, const bool wake);
+bool uring_poll(uring_t *ring, const int fd, const unsigned events, const uint64_t data,
+		const bool wake);
+
+/* Submits anything queued and waits up to timeout ms for completions,
+ * copying up to max of them into cqes like epoll_wait does with events.
+ * Returns the number copied, 0 on timeout and -1 on error. */
+int uring_wait(uring_t *ring, struct io_uring_cqe *cqes, const int max, const int timeout);
+
+/* The provided buffer a receive completed into, and returning it to the
+ * kernel once it is consumed */
+char *uring_buf(uring_t *ring, const struct io_uring_cqe *cqe);
+void uring_recycle_buf(uring_t *ring, const struct io_uring_cqe *cqe);
+
+#else /* USE_IO_URING */
+
+static inline uring_t *uring_init(const unsigned __maybe_unused entries,
+				  const int __maybe_unused nbufs, const int __maybe_unused bufsize)
+{
+	return NULL;
+}
+
+static inline void uring_free(uring_t __maybe_unused *ring)
+{
+}
+
+static inline bool uring_recv(uring_t __maybe_unused *ring, const int __maybe_unused fd,
+			      const uint64_t __maybe_unused data, const bool __maybe_unused wake)
+{
+	return false;
+}
+
+static inline bool uring_poll(uring_t __maybe_unused *ring, const int __maybe_unused fd,
+			      const unsigned __maybe_unused events,
+			      const uint64_t __maybe_unused data, const bool __maybe_unused wake)
+{
+	return false;
+}
+
+#endif /* USE_IO_URING */
+
+#endif /* URING_H */
@@ -0,0 +1,150 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include "ckpool.h"
+#include "sha2.h"
+
+/* Replays a synthetic share submission stream through shared and client
+ * affine ckmsgq pools, one share at a time and in batches, reporting shares/s
+ * and p99 queue to completion latency for each worker count and checking per
+ * client ordering in affine mode. */
+
+#define TEST_SHARES 200000
+#define TEST_CLIENTS 1000
+
+struct share {
+	int64_t client_id;
+	int64_t seq;
+	int64_t queued_ns;
+	int64_t latency_ns;
+	uchar header[80];
+};
+
+static struct share *shares;
+static int64_t *last_seq;
+static bool check_order;
+static int64_t misordered;
+static int64_t done;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (loglevel > LOG_WARNING)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Stands in for sshare_process: a double sha256 of the header per share */
+static void process_share(ckpool_t __maybe_unused *ckp, struct share *share)
+{
+	uchar hash1[32], hash[32];
+
+	sha256(share->header, 80, hash1);
+	sha256(hash1, 32, hash);
+	share->header[0] ^= hash[31];
+
+	if (check_order) {
+		if (share->seq <= last_seq[share->client_id])
+			__atomic_add_fetch(&misordered, 1, __ATOMIC_RELAXED);
+		last_seq[share->client_id] = share->seq;
+	}
+	share->latency_ns = now_ns() - share->queued_ns;
+	__atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+}
+
+static void process_shares(ckpool_t *ckp, struct share **batch, const int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		process_share(ckp, batch[i]);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void run(const int workers, const bool affine, const int batch)
+{
+	int64_t *latency, start, elapsed;
+	ckmsgq_t *ckmsgq;
+	int i;
+
+	if (batch > 1)
+		ckmsgq = create_batch_ckmsgqs(NULL, "bench", &process_shares, workers, batch, affine);
+	else if (affine)
+		ckmsgq = create_affine_ckmsgqs(NULL, "bench", &process_share, workers);
+	else
+		ckmsgq = create_ckmsgqs(NULL, "bench", &process_share, workers);
+	check_order = affine;
+	misordered = done = 0;
+	for (i = 0; i < TEST_CLIENTS; i++)
+		last_seq[i] = -1;
+	for (i = 0; i < TEST_SHARES; i++) {
+		shares[i].client_id = i % TEST_CLIENTS;
+		shares[i].seq = i;
+		memset(shares[i].header, i, 80);
+	}
+
+	start = now_ns();
+	for (i = 0; i < TEST_SHARES; i++) {
+		shares[i].queued_ns = now_ns();
+		ckmsgq_add_id(ckmsgq, shares[i].client_id, &shares[i]);
+	}
+	while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < TEST_SHARES)
+		cksleep_ms(1);
+	elapsed = now_ns() - start;
+
+	latency = ckalloc(sizeof(int64_t) * TEST_SHARES);
+	for (i = 0; i < TEST_SHARES; i++)
+		latency[i] = shares[i].latency_ns;
+	qsort(latency, TEST_SHARES, sizeof(int64_t), cmp_int64);
+	printf("%-6s workers=%-2d batch=%d %10.0f shares/s  p99 latency %8.1fus\n",
+	       affine ? "affine" : "shared", workers, batch,
+	       (double)TEST_SHARES * 1000000000 / elapsed,
+	       latency[TEST_SHARES * 99 / 100] / 1000.0);
+	free(latency);
+
+	if (misordered) {
+		printf("%"PRId64" shares processed out of order for their client\n", misordered);
+		exit(-1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int workers;
+
+	shares = ckzalloc(sizeof(struct share) * TEST_SHARES);
+	last_seq = ckalloc(sizeof(int64_t) * TEST_CLIENTS);
+
+	for (workers = 1; workers <= 8; workers *= 2) {
+		run(workers, false, 1);
+		run(workers, true, 1);
+		run(workers, false, SHA256_LANES);
+		run(workers, true, SHA256_LANES);
+	}
+
+	printf("All ckmsgq tests passed.\n");
+	return(0);
+}
@@ -0,0 +1,88 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "libckpool.h"
+
+/* Checks the lazily decayed hashrate accumulator keeps fractional diff from
+ * concurrent share threads, and that a client submitting shares steadily at
+ * its target rate only decays its averages once a second as add_submit does,
+ * not on every share. */
+
+#define TEST_THREADS 4
+#define TEST_ADDS 100000
+#define TEST_SHARE_MS 10
+#define TEST_SECONDS 60
+
+static decay_t decay;
+
+static void *add_thread(void __maybe_unused *arg)
+{
+	int i;
+
+	for (i = 0; i < TEST_ADDS; i++)
+		add_decay(&decay, 0.25);
+	return NULL;
+}
+
+static void tv_add_ms(tv_t *tv, const int ms)
+{
+	tv->tv_usec += ms * 1000;
+	tv->tv_sec += tv->tv_usec / 1000000;
+	tv->tv_usec %= 1000000;
+}
+
+int main(void)
+{
+	pthread_t pth[TEST_THREADS];
+	double diff, tdiff, total = 0, dsps5 = 0;
+	int i, shares, decays = 0;
+	tv_t now_t;
+
+	/* Fractional diff is not lost between threads */
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_create(&pth[i], NULL, add_thread, NULL);
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(pth[i], NULL);
+	tv_time(&now_t);
+	if (!begin_decay(&decay, &now_t, &diff, &tdiff) || diff != TEST_THREADS * TEST_ADDS * 0.25) {
+		printf("Accumulated diff %f instead of %f.\n", diff, TEST_THREADS * TEST_ADDS * 0.25);
+		exit(-1);
+	}
+	/* Only one thread decays at a time */
+	if (begin_decay(&decay, &now_t, &diff, &tdiff)) {
+		printf("Decay begun while already busy.\n");
+		exit(-1);
+	}
+	end_decay(&decay);
+
+	/* Shares within a second of the last decay do no decay work */
+	shares = TEST_SECONDS * 1000 / TEST_SHARE_MS;
+	for (i = 0; i < shares; i++) {
+		tv_add_ms(&now_t, TEST_SHARE_MS);
+		add_decay(&decay, 1.5);
+		if (!decay_due(&decay, &now_t, 1))
+			continue;
+		if (!begin_decay(&decay, &now_t, &diff, &tdiff)) {
+			printf("Failed to begin due decay.\n");
+			exit(-1);
+		}
+		decay_time(&dsps5, diff, tdiff, MIN5);
+		total += diff;
+		end_decay(&decay);
+		decays++;
+	}
+	if (decays != TEST_SECONDS) {
+		printf("Decayed %d times for %d shares over %d seconds.\n", decays, shares, TEST_SECONDS);
+		exit(-1);
+	}
+	if (total != shares * 1.5) {
+		printf("Decayed diff %f of %f.\n", total, shares * 1.5);
+		exit(-1);
+	}
+	printf("%d shares decayed %d times, dsps5 %f\n", shares, decays, dsps5);
+	return 0;
+}
@@ -0,0 +1,186 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <jansson.h>
+#include "libckpool.h"
+#include "gbtparse.h"
+
+/* Checks the streaming getblocktemplate transaction parser against decoding
+ * the same template with jansson the way the stratifier used to, and compares
+ * their speed on a template the size of a full mainnet block. */
+
+#define TEST_TXNS 3500
+#define TEST_ITERATIONS 20
+#define HEADROOM 1258
+#define TAILROOM 5
+
+static uint32_t rnd_state = 42;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static char *rnd_hex(char *p, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	while (len--)
+		*p++ = hex[rnd() & 0xf];
+	return p;
+}
+
+/* A template laid out as bitcoind returns it with the transactions mainnet
+ * blocks typically have, a few large ones among many small ones, and a
+ * pre-segwit transaction without a hash */
+static char *make_template(int *len)
+{
+	char *json = malloc(8 * 1024 * 1024), *p = json;
+	int i, size;
+
+	p += sprintf(p, "{\"result\":{\"capabilities\":[\"proposal\"],\"version\":536870912,"
+		     "\"rules\":[\"csv\",\"!segwit\",\"taproot\"],\"vbavailable\":{},\"vbrequired\":0,"
+		     "\"previousblockhash\":\"00000000000000000001a2b3c4d5e6f708192a3b4c5d6e7f8091a2b3c4d5e6f7\","
+		     "\"transactions\":[");
+	for (i = 0; i < TEST_TXNS; i++) {
+		size = i % 100 ? 150 + rnd() % 450 : 2000 + rnd() % 8000;
+		if (i)
+			*p++ = ',';
+		p += sprintf(p, "{\"data\":\"");
+		p = rnd_hex(p, size * 2);
+		p += sprintf(p, "\",\"txid\":\"");
+		p = rnd_hex(p, 64);
+		if (i != 7) {
+			p += sprintf(p, "\",\"hash\":\"");
+			p = rnd_hex(p, 64);
+		}
+		p += sprintf(p, "\",\"depends\":[%d,%d],\"fee\":%u,\"sigops\":%u,\"weight\":%d}",
+			     i / 2, i / 3, rnd() % 100000, rnd() % 20, size * 4);
+	}
+	p += sprintf(p, "],\"coinbaseaux\":{},\"coinbasevalue\":312500000,"
+		     "\"longpollid\":\"00000000000000000001a2b3c4d5e6f708192a3b4c5d6e7f8091a2b3c4d5e6f7123\","
+		     "\"target\":\"0000000000000000000342190000000000000000000000000000000000000000\","
+		     "\"mintime\":1700000000,\"mutable\":[\"time\",\"transactions\",\"prevblock\"],"
+		     "\"noncerange\":\"00000000ffffffff\",\"sigoplimit\":80000,\"sizelimit\":4000000,"
+		     "\"weightlimit\":4000000,\"curtime\":1700000600,\"bits\":\"17034219\",\"height\":820000,"
+		     "\"default_witness_commitment\":\"6a24aa21a9ed00\"},\"error\":null,\"id\":0}");
+	*len = p - json;
+	return json;
+}
+
+/* Decode the template the way the stratifier used to from jansson */
+static void jansson_txns(const char *json, gbt_txns_t *txns)
+{
+	json_t *val = json_loads(json, 0, NULL), *txn_array, *arr_val;
+	int i, size;
+
+	txn_array = json_object_get(json_object_get(val, "result"), "transactions");
+	size = json_array_size(txn_array);
+	for (i = 0; i < size; i++) {
+		const char *data, *txid, *hash;
+
+		arr_val = json_array_get(txn_array, i);
+		data = json_string_value(json_object_get(arr_val, "data"));
+		txid = json_string_value(json_object_get(arr_val, "txid"));
+		hash = json_string_value(json_object_get(arr_val, "hash"));
+		if (!gbt_txns_add(txns, txid, hash, data, strlen(data))) {
+			printf("Failed to add transaction %d from jansson.\n", i);
+			exit(-1);
+		}
+	}
+	json_decref(val);
+}
+
+static double elapsed_us(struct timeval *start_time, struct timeval *end_time)
+{
+	return (1000000 * end_time->tv_sec + end_time->tv_usec) - (1000000 * start_time->tv_sec + start_time->tv_usec);
+}
+
+int main(void)
+{
+	double jansson_time = 0, parse_time = 0;
+	struct timeval start_time, end_time;
+	gbt_txns_t expected, txns;
+	char *json, *copy;
+	json_t *val;
+	int len, i;
+
+	json = make_template(&len);
+	copy = malloc(len + 1);
+
+	gbt_txns_init(&expected, HEADROOM, TAILROOM);
+	jansson_txns(json, &expected);
+	memcpy(copy, json, len + 1);
+	gbt_txns_init(&txns, HEADROOM, TAILROOM);
+	if (!gbt_parse_txns(copy, len, &txns)) {
+		printf("Failed to parse template.\n");
+		exit(-1);
+	}
+	if (txns.count != TEST_TXNS || expected.count != TEST_TXNS) {
+		printf("Parsed %d transactions of %d.\n", txns.count, TEST_TXNS);
+		exit(-1);
+	}
+	if (memcmp(txns.txids, expected.txids, TEST_TXNS * 32) ||
+	    memcmp(txns.hashes, expected.hashes, TEST_TXNS * 32) ||
+	    memcmp(txns.dataofs, expected.dataofs, (TEST_TXNS + 1) * sizeof(int)) ||
+	    txns.datalen != expected.datalen || memcmp(txns.data, expected.data, txns.datalen)) {
+		printf("Parsed transactions differ from jansson.\n");
+		exit(-1);
+	}
+	if (txns.data != txns.buf + HEADROOM) {
+		printf("Transaction data is not after its headroom.\n");
+		exit(-1);
+	}
+	/* The rest of the template is left for jansson without them */
+	val = json_loads(copy, 0, NULL);
+	if (!val || json_array_size(json_object_get(json_object_get(val, "result"), "transactions")) ||
+	    json_integer_value(json_object_get(json_object_get(val, "result"), "height")) != 820000) {
+		printf("Template left after the transactions is wrong.\n");
+		exit(-1);
+	}
+	json_decref(val);
+	gbt_txns_clear(&txns);
+
+	/* A truncated template fails leaving the json untouched */
+	memcpy(copy, json, len + 1);
+	copy[len / 2] = '\0';
+	gbt_txns_init(&txns, HEADROOM, TAILROOM);
+	if (gbt_parse_txns(copy, len / 2, &txns) || memcmp(copy, json, len / 2)) {
+		printf("Failed to reject truncated template.\n");
+		exit(-1);
+	}
+	gbt_txns_clear(&txns);
+
+	for (i = 0; i < TEST_ITERATIONS; i++) {
+		gettimeofday(&start_time, NULL);
+		gbt_txns_init(&txns, HEADROOM, TAILROOM);
+		jansson_txns(json, &txns);
+		gbt_txns_clear(&txns);
+		gettimeofday(&end_time, NULL);
+		jansson_time += elapsed_us(&start_time, &end_time);
+
+		memcpy(copy, json, len + 1);
+		gettimeofday(&start_time, NULL);
+		gbt_txns_init(&txns, HEADROOM, TAILROOM);
+		gbt_parse_txns(copy, len, &txns);
+		val = json_loads(copy, 0, NULL);
+		json_decref(val);
+		gbt_txns_clear(&txns);
+		gettimeofday(&end_time, NULL);
+		parse_time += elapsed_us(&start_time, &end_time);
+	}
+	printf("%d byte template with %d transactions: jansson %.2fms, gbtparse %.2fms\n",
+	       len, TEST_TXNS, jansson_time / TEST_ITERATIONS / 1000, parse_time / TEST_ITERATIONS / 1000);
+
+	gbt_txns_clear(&expected);
+	free(copy);
+	free(json);
+	return 0;
+}
@@ -31,8 +31,44 @@ void test(const unsigned char *input,unsigned int len,const unsigned char *expec
 	}
 }
 
-int main(int argc, char **argv)
+// Check resuming from a saved midstate over pre-padded blocks matches sha256()
+void test_midstate(void)
+{
+	unsigned char data[192], expected_output[32], output_hash[32];
+	unsigned int len, midlen, padlen, i;
+	uint64_t bits;
+	sha256_ctx ctx;
+
+	for (len = 64; len < 150; len++) {
+		for (i = 0; i < sizeof(data); i++)
+			data[i] = i * 7 + len;
+		sha256(data, len, expected_output);
+
+		midlen = len & ~63;
+		sha256_init(&ctx);
+		sha256_update(&ctx, data, midlen);
+		padlen = (len + 9 + 63) & ~63;
+		memset(data + len, 0, padlen - len);
+		data[len] = 0x80;
+		bits = (uint64_t)len * 8;
+		for (i = 0; i < 8; i++)
+			data[padlen - 1 - i] = bits >> (i * 8);
+		sha256_midstate_final(ctx.h, data + midlen, (padlen - midlen) / 64, output_hash);
+		if (memcmp(expected_output, output_hash, 32)) {
+			printf("sha256 midstate hash of length %u failed to calculate correctly.\n", len);
+			exit(-1);
+		}
+	}
+}
+
+void test_impl(const char *name)
 {
+	if (!sha256_select_impl(name)) {
+		printf("Failed to select sha256 backend %s.\n", name);
+		exit(-1);
+	}
+	printf("Testing sha256 backend %s\n", name);
+
 	// Perform a simple test first
 	{
 		const unsigned char data[]="Test";
@@ -108,6 +144,18 @@ int main(int argc, char **argv)
 		elapsed_time=(1000000 * end_time.tv_sec + end_time.tv_usec) - (1000000 * start_time.tv_sec + start_time.tv_usec);
 		printf("Elapsed time=%.1fms, Managed to do %.1f SHA256 iterations/s\n",elapsed_time/1000,TEST_ITERATIONS/elapsed_time*1000000);
         }
+}
+
+int main(int argc, char **argv)
+{
+	const char *best = sha256_impl(), *name;
+	int i;
+
+	printf("Selected sha256 backend %s\n", best);
+
+	// Cross check every backend this CPU can run
+	for (i = 0; (name = sha256_impl_available(i)); i++)
+		test_impl(name);
 
 	printf("All sha256() tests passed.\n");
 	return(0);
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "sha2.h"
+
+/* Checks the fixed length sha256d_64 and sha256d_80 kernels and the multi
+ * buffer sha256d_lanes variants against the generic sha256 path on every
+ * backend and compares their speed. */
+
+#define TEST_ITERATIONS 1000000
+
+static void sha256d(const unsigned char *data, unsigned int len, unsigned char *hash)
+{
+	unsigned char hash1[32];
+
+	sha256(data, len, hash1);
+	sha256(hash1, 32, hash);
+}
+
+static double elapsed_us(struct timeval *start_time, struct timeval *end_time)
+{
+	return (1000000 * end_time->tv_sec + end_time->tv_usec) - (1000000 * start_time->tv_sec + start_time->tv_usec);
+}
+
+void test_impl(const char *name)
+{
+	unsigned char data[128], expected_output[32], output_hash[32];
+	struct timeval start_time, end_time;
+	double generic_time, fixed_time;
+	int i, x;
+
+	if (!sha256_select_impl(name)) {
+		printf("Failed to select sha256 backend %s.\n", name);
+		exit(-1);
+	}
+
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = i * 13 + 7;
+
+	sha256d(data, 64, expected_output);
+	sha256d_64(data, output_hash);
+	if (memcmp(expected_output, output_hash, 32)) {
+		printf("sha256d_64 failed to calculate correctly on %s.\n", name);
+		exit(-1);
+	}
+	sha256d(data, 80, expected_output);
+	sha256d_80(data, output_hash);
+	if (memcmp(expected_output, output_hash, 32)) {
+		printf("sha256d_80 failed to calculate correctly on %s.\n", name);
+		exit(-1);
+	}
+	// Merkle trees are built with the output overlapping the input
+	sha256d(data, 64, expected_output);
+	sha256d_64(data, data);
+	if (memcmp(expected_output, data, 32)) {
+		printf("sha256d_64 failed with overlapping output on %s.\n", name);
+		exit(-1);
+	}
+
+	gettimeofday(&start_time, NULL);
+	for (x = 0; x < TEST_ITERATIONS; x++)
+		sha256d(data, 64, data);
+	gettimeofday(&end_time, NULL);
+	generic_time = elapsed_us(&start_time, &end_time);
+	gettimeofday(&start_time, NULL);
+	for (x = 0; x < TEST_ITERATIONS; x++)
+		sha256d_64(data, data);
+	gettimeofday(&end_time, NULL);
+	fixed_time = elapsed_us(&start_time, &end_time);
+	printf("%-8s 64 byte: generic %.1f, sha256d_64 %.1f sha256d/s\n", name,
+	       TEST_ITERATIONS / generic_time * 1000000, TEST_ITERATIONS / fixed_time * 1000000);
+
+	gettimeofday(&start_time, NULL);
+	for (x = 0; x < TEST_ITERATIONS; x++)
+		sha256d(data, 80, data);
+	gettimeofday(&end_time, NULL);
+	generic_time = elapsed_us(&start_time, &end_time);
+	gettimeofday(&start_time, NULL);
+	for (x = 0; x < TEST_ITERATIONS; x++)
+		sha256d_80(data, data);
+	gettimeofday(&end_time, NULL);
+	fixed_time = elapsed_us(&start_time, &end_time);
+	printf("%-8s 80 byte: generic %.1f, sha256d_80 %.1f sha256d/s\n", name,
+	       TEST_ITERATIONS / generic_time * 1000000, TEST_ITERATIONS / fixed_time * 1000000);
+}
+
+/* Lanes of differing length, some finished from a midstate, and more of
+ * them than are hashed at once */
+#define TEST_LANES 13
+
+void test_lanes(const char *name)
+{
+	unsigned char data[TEST_LANES][256], digest[TEST_LANES][32], expected_output[32];
+	const unsigned char *message[TEST_LANES], *blocks[TEST_LANES];
+	const uint32_t *midstate[TEST_LANES];
+	unsigned char *output[TEST_LANES];
+	uint32_t mid[TEST_LANES][8];
+	int block_nb[TEST_LANES];
+	struct timeval start_time, end_time;
+	double single_time, lanes_time;
+	int i, j, x, len;
+
+	sha256_select_impl(name);
+	for (i = 0; i < TEST_LANES; i++) {
+		sha256_ctx ctx;
+
+		for (j = 0; j < 256; j++)
+			data[i][j] = i * 31 + j * 7;
+		len = 64 + i * 11;
+		sha256d(data[i], len, expected_output);
+		/* Pad the message the way sha256_final does */
+		sha256_init(&ctx);
+		sha256_update(&ctx, data[i], len & ~63);
+		memcpy(mid[i], ctx.h, sizeof(mid[i]));
+		block_nb[i] = (len & 63) > 55 ? 2 : 1;
+		memset(data[i] + len, 0, 256 - len);
+		data[i][len] = 0x80;
+		for (j = 0; j < 4; j++)
+			data[i][(len & ~63) + block_nb[i] * 64 - 1 - j] = (len * 8) >> (j * 8);
+		midstate[i] = i & 1 ? NULL : mid[i];
+		if (!midstate[i])
+			block_nb[i] += len >> 6;
+		blocks[i] = midstate[i] ? data[i] + (len & ~63) : data[i];
+		output[i] = digest[i];
+		sha256d_lanes(midstate, blocks, block_nb, output, i + 1);
+		if (memcmp(expected_output, digest[i], 32)) {
+			printf("sha256d_lanes failed to calculate correctly on %s with %d lanes.\n",
+			       name, i + 1);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < TEST_LANES; i++) {
+		message[i] = data[i];
+		output[i] = data[i];
+	}
+	for (i = 0; i < TEST_LANES; i++)
+		sha256d(data[i], 64, digest[i]);
+	sha256d_64_lanes(message, output, TEST_LANES);
+	for (i = 0; i < TEST_LANES; i++) {
+		if (memcmp(digest[i], data[i], 32)) {
+			printf("sha256d_64_lanes failed with overlapping output on %s.\n", name);
+			exit(-1);
+		}
+	}
+	for (i = 0; i < TEST_LANES; i++)
+		sha256d(data[i], 80, digest[i]);
+	sha256d_80_lanes(message, output, TEST_LANES);
+	for (i = 0; i < TEST_LANES; i++) {
+		if (memcmp(digest[i], data[i], 32)) {
+			printf("sha256d_80_lanes failed with overlapping output on %s.\n", name);
+			exit(-1);
+		}
+	}
+
+	gettimeofday(&start_time, NULL);
+	for (x = 0; x < TEST_ITERATIONS; x += SHA256_LANES) {
+		for (i = 0; i < SHA256_LANES; i++)
+			sha256d_80(message[i], output[i]);
+	}
+	gettimeofday(&end_time, NULL);
+	single_time = elapsed_us(&start_time, &end_time);
+	gettimeofday(&start_time, NULL);
+	for (x = 0; x < TEST_ITERATIONS; x += SHA256_LANES)
+		sha256d_80_lanes(message, output, SHA256_LANES);
+	gettimeofday(&end_time, NULL);
+	lanes_time = elapsed_us(&start_time, &end_time);
+	printf("%-8s %d lanes: sha256d_80 %.1f, sha256d_80_lanes %.1f sha256d/s\n", name,
+	       sha256_lanes(), TEST_ITERATIONS / single_time * 1000000,
+	       TEST_ITERATIONS / lanes_time * 1000000);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name;
+	int i;
+
+	for (i = 0; (name = sha256_impl_available(i)); i++) {
+		test_impl(name);
+		test_lanes(name);
+	}
+
+	printf("All sha256d tests passed.\n");
+	return(0);
+}
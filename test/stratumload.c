@@ -0,0 +1,319 @@
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <jansson.h>
+
+/* Stratum load generator for comparing connector backends. Connects clients
+ * to a running pool that each keep a number of mining.submit requests in
+ * flight, submitting another as each response arrives, and reports the share
+ * rate the pool sustained along with the CPU time the pool process and its
+ * connector threads used over the run, normalised to 100k shares/s.
+ *
+ * Run the pool against any bitcoind with a low mindiff, once with "iouring"
+ * set in its config and once without, e.g.:
+ *   stratumload -p 3333 -c 400 -w 4 -d 20 -P $(pgrep -x ckpool)
+ * The shares need not be valid, every response costs the connector the same.
+ * Not run by make check as it needs a running pool. */
+
+#define LOAD_ADDRESS "1BvBMSEYstWetqTFn5Au4m4GFg7xJaNVN2"
+#define LOAD_BUFSIZE 65536
+#define LOAD_EVENTS 256
+#define LOAD_WARMUP 2
+
+struct load_client {
+	int id;
+	int fd;
+	char buf[LOAD_BUFSIZE];
+	int len;
+	bool ready;
+	int inflight;
+	unsigned seq;
+	int en2size;
+	char jobid[64];
+	char ntime[16];
+};
+
+typedef struct load_client load_client_t;
+
+/* Default threads of the connector process, as named by rename_proc */
+static const char *connector_threads[] = {
+	"ckp@connector", "ckp@creceiver", "ckp@cmpq", "ckp@cunixrq", NULL
+};
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_line(load_client_t *client, const char *line)
+{
+	int len = strlen(line), ofs = 0, ret;
+
+	while (ofs < len) {
+		ret = write(client->fd, line + ofs, len - ofs);
+		if (ret > 0)
+			ofs += ret;
+		else if (ret < 0 && errno != EAGAIN) {
+			fprintf(stderr, "Client %d failed to write\n", client->id);
+			exit(1);
+		} else
+			usleep(100);
+	}
+}
+
+static void submit_share(load_client_t *client)
+{
+	char line[512], en2[33];
+
+	/* Unique extranonce2 per submit so none are rejected as duplicates */
+	snprintf(en2, sizeof(en2), "%08x%024x", client->seq, client->id);
+	en2[client->en2size * 2] = '\0';
+	snprintf(line, sizeof(line), "{\"id\":%u,\"method\":\"mining.submit\",\"params\":"
+		 "[\"%s.%d\",\"%s\",\"%s\",\"%s\",\"%08x\"]}\n", client->seq + 100,
+		 LOAD_ADDRESS, client->id, client->jobid, en2, client->ntime, (unsigned)rand());
+	client->seq++;
+	client->inflight++;
+	send_line(client, line);
+}
+
+/* CPU seconds used by the pool process, and by those of its threads whose
+ * names start with any of threads */
+static void pool_cpu(const int pid, const char **threads, double *total, double *selected)
+{
+	long ticks = sysconf(_SC_CLK_TCK);
+	char path[300], stat[512];
+	struct dirent *dir;
+	DIR *d;
+
+	*total = *selected = 0;
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		exit(1);
+	}
+	while ((dir = readdir(d))) {
+		unsigned long utime, stime;
+		char *name, *end;
+		FILE *fp;
+		int i;
+
+		if (dir->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", pid, dir->d_name);
+		fp = fopen(path, "re");
+		if (!fp)
+			continue;
+		if (!fgets(stat, sizeof(stat), fp)) {
+			fclose(fp);
+			continue;
+		}
+		fclose(fp);
+		name = strchr(stat, '(');
+		end = strrchr(stat, ')');
+		if (!name || !end)
+			continue;
+		*end = '\0';
+		name++;
+		/* utime and stime are the 12th and 13th fields after the name */
+		if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &utime, &stime) != 2)
+			continue;
+		*total += (double)(utime + stime) / ticks;
+		for (i = 0; threads[i]; i++) {
+			if (!strncmp(name, threads[i], strlen(threads[i]))) {
+				*selected += (double)(utime + stime) / ticks;
+				break;
+			}
+		}
+	}
+	closedir(d);
+}
+
+static void parse_notify(load_client_t *client, json_t *params)
+{
+	const char *jobid = json_string_value(json_array_get(params, 0));
+	const char *ntime = json_string_value(json_array_get(params, 7));
+
+	if (!jobid || !ntime || strlen(jobid) >= sizeof(client->jobid) ||
+	    strlen(ntime) >= sizeof(client->ntime))
+		return;
+	strcpy(client->jobid, jobid);
+	strcpy(client->ntime, ntime);
+}
+
+/* Returns true when the line is the response to a submit */
+static bool parse_line(load_client_t *client, char *line)
+{
+	json_t *val, *method;
+	bool ret = false;
+
+	/* Share responses are by far the most common so skip decoding them */
+	if (client->ready && !strstr(line, "\"method\""))
+		return true;
+	val = json_loads(line, 0, NULL);
+	if (!val)
+		return false;
+	method = json_object_get(val, "method");
+	if (json_is_string(method)) {
+		if (!strcmp(json_string_value(method), "mining.notify"))
+			parse_notify(client, json_object_get(val, "params"));
+	} else if (json_integer_value(json_object_get(val, "id")) == 1) {
+		/* Subscribe result of [subscriptions, extranonce1, en2size] */
+		client->en2size = json_integer_value(json_array_get(json_object_get(val, "result"), 2));
+		if (client->en2size < 1 || client->en2size > 16)
+			client->en2size = 8;
+	} else if (json_integer_value(json_object_get(val, "id")) >= 100)
+		ret = true;
+	json_decref(val);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-a host] [-p port] [-c clients] [-w inflight] [-d seconds]"
+		" [-P poolpid]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int port = 3333, nclients = 400, inflight = 4, duration = 20, pid = 0;
+	double start = 0, end = 0, total0 = 0, conn0 = 0, total1, conn1, elapsed, rate;
+	int64_t responses = 0, counted = 0;
+	struct epoll_event events[LOAD_EVENTS];
+	const char *host = "127.0.0.1";
+	load_client_t *clients;
+	int epfd, ready = 0, c, i;
+
+	while ((c = getopt(argc, argv, "a:c:d:hp:P:w:")) != -1) {
+		switch (c) {
+			case 'a':
+				host = optarg;
+				break;
+			case 'c':
+				nclients = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'P':
+				pid = atoi(optarg);
+				break;
+			case 'w':
+				inflight = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (nclients < 1 || inflight < 1 || duration < 1)
+		usage(argv[0]);
+
+	clients = calloc(nclients, sizeof(load_client_t));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	for (i = 0; i < nclients; i++) {
+		load_client_t *client = &clients[i];
+		struct sockaddr_in addr;
+		struct epoll_event event;
+		char line[256];
+		int one = 1;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+			usage(argv[0]);
+		client->id = i;
+		client->en2size = 8;
+		client->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			fprintf(stderr, "Client %d failed to connect to %s:%d\n", i, host, port);
+			exit(1);
+		}
+		setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(client->fd, F_SETFL, O_NONBLOCK);
+		snprintf(line, sizeof(line), "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[\"stratumload\"]}\n"
+			 "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"%s.%d\",\"x\"]}\n",
+			 LOAD_ADDRESS, i);
+		send_line(client, line);
+		event.events = EPOLLIN;
+		event.data.ptr = client;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &event);
+	}
+
+	while (!end || now_s() < end) {
+		int nfds = epoll_wait(epfd, events, LOAD_EVENTS, 1000);
+
+		/* Start measuring once every client has been submitting a while */
+		if (end && !start && now_s() >= end - duration) {
+			start = now_s();
+			counted = responses;
+			if (pid)
+				pool_cpu(pid, connector_threads, &total0, &conn0);
+		}
+		for (i = 0; i < nfds; i++) {
+			load_client_t *client = events[i].data.ptr;
+			char *line, *eol;
+			int ret;
+
+			ret = read(client->fd, client->buf + client->len, LOAD_BUFSIZE - client->len - 1);
+			if (ret <= 0) {
+				fprintf(stderr, "Client %d disconnected\n", client->id);
+				exit(1);
+			}
+			client->len += ret;
+			client->buf[client->len] = '\0';
+			line = client->buf;
+			while ((eol = strchr(line, '\n'))) {
+				*eol = '\0';
+				if (parse_line(client, line) && client->inflight) {
+					client->inflight--;
+					responses++;
+					submit_share(client);
+				} else if (!client->ready && client->jobid[0]) {
+					client->ready = true;
+					while (client->inflight < inflight)
+						submit_share(client);
+					if (++ready == nclients)
+						end = now_s() + LOAD_WARMUP + duration;
+				}
+				line = eol + 1;
+			}
+			client->len -= line - client->buf;
+			memmove(client->buf, line, client->len);
+		}
+	}
+
+	elapsed = now_s() - start;
+	rate = (responses - counted) / elapsed;
+	printf("%d clients, %d in flight each: %.0f shares/s\n", nclients, inflight, rate);
+	if (pid) {
+		pool_cpu(pid, connector_threads, &total1, &conn1);
+		total1 = (total1 - total0) / elapsed;
+		conn1 = (conn1 - conn0) / elapsed;
+		printf("Pool CPU %.3f cores, %.3f per 100k shares/s\n", total1, total1 * 100000 / rate);
+		printf("Connector CPU %.3f cores, %.3f per 100k shares/s\n", conn1, conn1 * 100000 / rate);
+	}
+	return 0;
+}